@@ -0,0 +1,228 @@
+// Benchmark of the game engine, built from the same sources as the game. Times map generation, map and save files,
+// placing items, find-path and game commands on maps of growing size and prints results as JSON.
+#define main GameMain
+#include "main.c"
+#undef main
+#include <sys/resource.h>
+
+#define BENCH_MAX_SAMPLES 100 // Largest number of repetitions of one measurement.
+#define BENCH_DENSE_MAX_ROOMS 4096 // CreateGraph makes about n*n/4 edges, larger maps are generated as sparse trees.
+#define BENCH_PLAY_COMMANDS 10000 // Number of commands in the script given to Play.
+
+// Times of repetitions of one measurement in nanoseconds.
+typedef struct samples {
+    int len; // Number of repetitions done.
+    double ns[BENCH_MAX_SAMPLES]; // Time of every repetition.
+} samples_t;
+
+void BenchUsage() {
+    fprintf(stderr,"USAGE: ./benchmark [-m max-rooms] [-n repetitions]\n");
+    exit(EXIT_FAILURE);
+}
+
+// Returns current time in nanoseconds.
+double NowNs() {
+    struct timespec now;
+    if(clock_gettime(CLOCK_MONOTONIC,&now)) ERR("clock_gettime");
+    return now.tv_sec*1.0e9+now.tv_nsec;
+}
+
+int CompareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y)-(x < y);
+}
+
+// Returns percentile p of sorted samples, nearest rank.
+double Percentile(samples_t* s, double p) {
+    int rank = (int)ceil(p/100*s->len);
+    return s->ns[rank > 0 ? rank-1 : 0];
+}
+
+// Prints one result as a JSON object, preceded by a comma unless it is the first one of its map size.
+void PrintResult(const char* name, int k, samples_t* s, bool* first) {
+    int i;
+    double sum = 0;
+    if(s->len == 0) return;
+    qsort(s->ns,s->len,sizeof(double),CompareDoubles);
+    for(i=0;i<s->len;i++) sum += s->ns[i];
+    printf("%s\n    {\"name\":\"%s\",",*first ? "" : ",",name);
+    if(k) printf("\"k\":%d,",k);
+    printf("\"samples\":%d,\"unit\":\"ns\",\"mean\":%.0f,\"p50\":%.0f,\"p90\":%.0f,\"p99\":%.0f,\"max\":%.0f}",
+           s->len,sum/s->len,Percentile(s,50),Percentile(s,90),Percentile(s,99),s->ns[s->len-1]);
+    *first = false;
+    s->len = 0;
+}
+
+// Writes a script of count valid commands for the game in args to buf, playing it on args on the way:
+// moves to random neighbors, picking up items found and dropping them in rooms with a free slot.
+size_t MakeScript(gameArgs_t* args, char* buf, int count) {
+    size_t len = 0;
+    int i;
+    for(i=0;i<count-1;i++) {
+        int room = args->currentRoom, *slots = &args->roomSlots[2*room];
+        if(args->itemHeld == -1 && slots[0] != -1 && i%3 == 0) {
+            len += sprintf(buf+len,"pick-up %d\n",slots[0]);
+            args->itemHeld = slots[0];
+            RemoveItem(args,slots[0]);
+        }
+        else if(args->itemHeld != -1 && args->itemsInRoom[room] <= 1 && i%3 == 1) {
+            len += sprintf(buf+len,"drop %d\n",args->itemHeld);
+            PlaceItem(args,args->itemHeld,room);
+            args->itemHeld = -1;
+        }
+        else {
+            long first = args->graph.offsets[room];
+            args->currentRoom = args->graph.neighbors[first+rand()%(args->graph.offsets[room+1]-first)];
+            len += sprintf(buf+len,"move-to %d\n",args->currentRoom);
+        }
+    }
+    len += sprintf(buf+len,"quit\n");
+    return len;
+}
+
+// Runs Play on the game in args with commands from script, with output of the game thrown away.
+void PlayScript(gameArgs_t* args, char* script, size_t len) {
+    int devNull = open("/dev/null",O_WRONLY), savedStdout = dup(STDOUT_FILENO);
+    lineReader_t input;
+    FILE* file = fmemopen(script,len,"r");
+    if(devNull < 0 || savedStdout < 0) ERR("open");
+    if(!file) ERR("fmemopen");
+    InitReader(&input,file);
+    args->input = &input;
+    fflush(stdout);
+    if(dup2(devNull,STDOUT_FILENO) < 0) ERR("dup2");
+    Play(args);
+    fflush(stdout);
+    if(dup2(savedStdout,STDOUT_FILENO) < 0) ERR("dup2");
+    free(input.buf);
+    if(fclose(file)) ERR("fclose");
+    if(close(devNull) || close(savedStdout)) ERR("close");
+}
+
+// Runs all measurements on maps with n rooms, repeating each of them reps times, and prints them as JSON.
+void BenchSize(int n, int reps, char* dir, bool firstSize) {
+    static samples_t s;
+    char mapPath[MAX_PATH], savePath[MAX_PATH];
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    gameArgs_t args;
+    struct rusage usage;
+    bool first = true;
+    int i,j;
+    double start;
+    const int ks[] = {1,16,256};
+    memset(&args,0,sizeof(args));
+    args.mutex = &mutex;
+    args.headless = true;
+    outBuffer_t output = {NULL,0,0,STDOUT_FILENO};
+    args.output = &output;
+    snprintf(mapPath,MAX_PATH,"%s/map",dir);
+    snprintf(savePath,MAX_PATH,"%s/save",dir);
+    args.autosavePath = savePath;
+    printf("%s\n  {\"rooms\":%d,\"results\":[",firstSize ? "" : ",",n);
+    if(n <= BENCH_DENSE_MAX_ROOMS) {
+        for(i=0;i<reps;i++) {
+            start = NowNs();
+            graph_t graph = CreateGraph(n);
+            s.ns[s.len++] = NowNs()-start;
+            FreeGraph(&graph);
+        }
+        PrintResult("CreateGraph",0,&s,&first);
+    }
+    for(i=0;i<reps;i++) {
+        start = NowNs();
+        GenerateMap(n,mapPath,TOPOLOGY_TREE,MAPGEN_DEFAULT_DEGREE,i);
+        s.ns[s.len++] = NowNs()-start;
+    }
+    PrintResult("GenerateMap",0,&s,&first);
+    args.roomCount = n;
+    if(n <= BENCH_DENSE_MAX_ROOMS) args.graph = CreateGraph(n);
+    else if(!ReadGraph(&args,mapPath)) ERR("ReadGraph");
+    for(i=0;i<reps;i++) {
+        start = NowNs();
+        SaveGraph(&args.graph,n,mapPath);
+        s.ns[s.len++] = NowNs()-start;
+    }
+    PrintResult("SaveGraph",0,&s,&first);
+    if(n <= BENCH_DENSE_MAX_ROOMS) FreeGraph(&args.graph);
+    else ReleaseGame(&args);
+    for(i=0;i<reps;i++) {
+        start = NowNs();
+        if(!ReadGraph(&args,mapPath)) ERR("ReadGraph");
+        s.ns[s.len++] = NowNs()-start;
+        if(i < reps-1) ReleaseGame(&args);
+    }
+    PrintResult("ReadGraph",0,&s,&first);
+    for(i=0;i<reps;i++) {
+        start = NowNs();
+        if(!OrganizeItems(&args)) ERR("OrganizeItems");
+        s.ns[s.len++] = NowNs()-start; // Item arrays stay in the arena, reused by the next placement like in a new game.
+    }
+    PrintResult("OrganizeItems",0,&s,&first);
+    for(i=0;i<reps;i++) {
+        start = NowNs();
+        SaveGame(&args,savePath);
+        s.ns[s.len++] = NowNs()-start;
+    }
+    PrintResult("SaveGame",0,&s,&first);
+    ReleaseGame(&args);
+    for(i=0;i<reps;i++) {
+        start = NowNs();
+        if(!LoadGame(&args,savePath)) ERR("LoadGame");
+        s.ns[s.len++] = NowNs()-start;
+        if(i < reps-1) ReleaseGame(&args);
+    }
+    PrintResult("LoadGame",0,&s,&first);
+    for(j=0;j<(int)(sizeof(ks)/sizeof(ks[0]));j++) {
+        for(i=0;i<reps;i++) {
+            int target = rand()%n;
+            start = NowNs();
+            findPathReturnArgs_t* path = FindPath(&args,ks[j],target);
+            s.ns[s.len++] = NowNs()-start;
+            FreePath(path);
+        }
+        PrintResult("FindPath",ks[j],&s,&first);
+    }
+    DestroyWalkPool(args.walkPool);
+    args.walkPool = NULL;
+    char* script = (char*)malloc(32*BENCH_PLAY_COMMANDS);
+    if(!script) ERR("malloc");
+    size_t len = MakeScript(&args,script,BENCH_PLAY_COMMANDS);
+    ReleaseGame(&args);
+    for(i=0;i<reps;i++) {
+        if(!LoadGame(&args,savePath)) ERR("LoadGame");
+        start = NowNs();
+        PlayScript(&args,script,len); // Play ends the game and releases it.
+        s.ns[s.len++] = (NowNs()-start)/BENCH_PLAY_COMMANDS;
+    }
+    PrintResult("PlayCommand",0,&s,&first);
+    free(script);
+    free(args.arena);
+    args.arena = NULL;
+    args.arenaSize = 0;
+    OutFree(&output);
+    if(getrusage(RUSAGE_SELF,&usage)) ERR("getrusage");
+    printf("\n  ],\"peakRssKb\":%ld}",usage.ru_maxrss);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    int opt, n, maxRooms = 1000000, reps = 0;
+    char dir[] = "/tmp/migbenchXXXXXX", path[MAX_PATH];
+    while((opt = getopt(argc,argv,"m:n:")) != -1) {
+        if(opt == 'm') maxRooms = atoi(optarg);
+        else if(opt == 'n') reps = atoi(optarg);
+        else BenchUsage();
+    }
+    if(optind != argc || maxRooms < 10 || reps < 0 || reps > BENCH_MAX_SAMPLES) BenchUsage();
+    if(!mkdtemp(dir)) ERR("mkdtemp");
+    srand(1);
+    printf("{\"threads\":%d,\"sizes\":[",ProcessorCount());
+    for(n=10;n<=maxRooms;n*=10) BenchSize(n,reps ? reps : n <= 1000 ? 100 : n <= 100000 ? 10 : 3,dir,n == 10);
+    printf("\n]}\n");
+    snprintf(path,MAX_PATH,"%s/map",dir);
+    unlink(path);
+    snprintf(path,MAX_PATH,"%s/save",dir);
+    unlink(path);
+    if(rmdir(dir)) ERR("rmdir");
+    return EXIT_SUCCESS;
+}
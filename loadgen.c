@@ -0,0 +1,204 @@
+// Load generator for the game server, keeping many connections busy with move-to commands and printing latency as JSON.
+#define main GameMain
+#include "main.c"
+#undef main
+
+#define LOADGEN_ROOMS 10000 // Rooms of the map generated when none is given.
+#define LOADGEN_REPLY 65536 // Longest reply of the server.
+
+// Client connection of the load generator.
+typedef struct loadConn {
+    int fd; // Socket connected to the server.
+    char reply[LOADGEN_REPLY]; // Part of the reply received so far.
+    int replyLen; // Number of bytes in reply.
+    bool playing; // The game is started, otherwise start-game is in flight.
+    double sent; // Time the command in flight was sent, in nanoseconds.
+} loadConn_t;
+
+// Thread of the load generator with its own epoll instance and share of the connections.
+typedef struct loadWorker {
+    char* socketPath; // Socket of the server.
+    char* mapPath; // Map games are started on.
+    int connCount; // Number of connections of the thread.
+    double end; // Time to stop sending commands, in nanoseconds.
+    rng_t rng; // Generator choosing rooms to move to.
+    pthread_t thread; // Thread of the worker.
+    uint32_t* latencies; // Latency of every command in nanoseconds, saturated at UINT32_MAX.
+    long len; // Number of latencies.
+    long cap; // Number of latencies that fit in latencies.
+} loadWorker_t;
+
+void LoadUsage() {
+    fprintf(stderr,"USAGE: ./loadgen -s socket-path [-c connections] [-t threads] [-d seconds] [-m map]\n");
+    exit(EXIT_FAILURE);
+}
+
+// Returns current time in nanoseconds.
+double NowNs() {
+    struct timespec now;
+    if(clock_gettime(CLOCK_MONOTONIC,&now)) ERR("clock_gettime");
+    return now.tv_sec*1.0e9+now.tv_nsec;
+}
+
+int CompareLatencies(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y)-(x < y);
+}
+
+// Sends command line to the server.
+void SendCommand(loadConn_t* conn, const char* line) {
+    size_t len = strlen(line), done = 0;
+    conn->sent = NowNs();
+    while(done < len) {
+        ssize_t count = send(conn->fd,line+done,len-done,MSG_NOSIGNAL);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0) ERR("send");
+        done += count;
+    }
+}
+
+// Sends the next command of conn after its reply was received: move to a random neighbor given in the reply,
+// or a new game if the previous one ended.
+void NextCommand(loadWorker_t* worker, loadConn_t* conn) {
+    char line[MAX_PATH], *rooms = strstr(conn->reply,"Available rooms are: ");
+    int neighbors[1024], count = 0;
+    if(!rooms) {
+        conn->playing = false;
+        snprintf(line,sizeof(line),"start-game %s\n",worker->mapPath);
+        SendCommand(conn,line);
+        return;
+    }
+    char *pos = rooms+strlen("Available rooms are: "), *end;
+    while(count < 1024) {
+        long room = strtol(pos,&end,10);
+        if(end == pos) break;
+        neighbors[count++] = room;
+        pos = end;
+    }
+    if(count == 0) snprintf(line,sizeof(line),"find-path 1 0\n"); // Room without neighbors, ask for something else.
+    else snprintf(line,sizeof(line),"move-to %d\n",neighbors[RngBelow(&worker->rng,count)]);
+    SendCommand(conn,line);
+}
+
+// Function passed to threads of the load generator.
+void* LoadWork(void* pVoid) {
+    loadWorker_t* worker = pVoid;
+    struct sockaddr_un address;
+    struct epoll_event event, events[SERVER_EVENTS];
+    int i, open = worker->connCount, epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd < 0) ERR("epoll_create1");
+    loadConn_t* conns = (loadConn_t*)calloc(worker->connCount,sizeof(loadConn_t));
+    if(!conns) ERR("calloc");
+    memset(&address,0,sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path,worker->socketPath,sizeof(address.sun_path)-1);
+    for(i=0;i<worker->connCount;i++) {
+        if((conns[i].fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0)) < 0) ERR("socket");
+        if(connect(conns[i].fd,(struct sockaddr*)&address,sizeof(address))) ERR("connect");
+        event.events = EPOLLIN;
+        event.data.ptr = &conns[i];
+        if(epoll_ctl(epollFd,EPOLL_CTL_ADD,conns[i].fd,&event)) ERR("epoll_ctl");
+        NextCommand(worker,&conns[i]); // Empty reply, starts a game.
+    }
+    while(open > 0) {
+        int ready = epoll_wait(epollFd,events,SERVER_EVENTS,-1);
+        if(ready < 0 && errno == EINTR) continue;
+        if(ready < 0) ERR("epoll_wait");
+        for(i=0;i<ready;i++) {
+            loadConn_t* conn = events[i].data.ptr;
+            ssize_t count = recv(conn->fd,conn->reply+conn->replyLen,LOADGEN_REPLY-1-conn->replyLen,0);
+            if(count < 0 && errno == EINTR) continue;
+            if(count <= 0) ERR("recv");
+            conn->replyLen += count;
+            conn->reply[conn->replyLen] = '\0';
+            if(conn->replyLen < 2 || strcmp(conn->reply+conn->replyLen-2,"\n\n") != 0) {
+                if(conn->replyLen == LOADGEN_REPLY-1) ERR("reply too long");
+                continue; // Reply is not complete yet.
+            }
+            double now = NowNs();
+            if(conn->playing) {
+                if(worker->len == worker->cap) {
+                    worker->cap = worker->cap ? 2*worker->cap : 65536;
+                    worker->latencies = (uint32_t*)realloc(worker->latencies,sizeof(uint32_t)*worker->cap);
+                    if(!worker->latencies) ERR("realloc");
+                }
+                worker->latencies[worker->len++] = now-conn->sent < UINT32_MAX ? now-conn->sent : UINT32_MAX;
+            }
+            conn->playing = true;
+            if(now >= worker->end) {
+                if(close(conn->fd)) ERR("close"); // Server saves the game and closes the session.
+                open--;
+            }
+            else NextCommand(worker,conn);
+            conn->replyLen = 0;
+        }
+    }
+    if(close(epollFd)) ERR("close");
+    free(conns);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int opt, i, connCount = 256, threadCount = ProcessorCount();
+    double seconds = 5, sum = 0;
+    char *socketPath = NULL, *mapPath = NULL, dir[] = "/tmp/migloadXXXXXX", path[MAX_PATH];
+    while((opt = getopt(argc,argv,"s:c:t:d:m:")) != -1) {
+        if(opt == 's') socketPath = optarg;
+        else if(opt == 'c') connCount = atoi(optarg);
+        else if(opt == 't') threadCount = atoi(optarg);
+        else if(opt == 'd') seconds = atof(optarg);
+        else if(opt == 'm') mapPath = optarg;
+        else LoadUsage();
+    }
+    if(optind != argc || !socketPath || connCount < 1 || threadCount < 1 || seconds <= 0) LoadUsage();
+    if(threadCount > connCount) threadCount = connCount;
+    bool generated = !mapPath;
+    if(generated) {
+        if(!mkdtemp(dir)) ERR("mkdtemp");
+        snprintf(path,MAX_PATH,"%s/map",dir);
+        GenerateMap(LOADGEN_ROOMS,path,TOPOLOGY_SMALL_WORLD,MAPGEN_DEFAULT_DEGREE,1);
+        mapPath = realpath(path,NULL); // The server resolves the path from its own directory.
+        if(!mapPath) ERR("realpath");
+    }
+    loadWorker_t* workers = (loadWorker_t*)calloc(threadCount,sizeof(loadWorker_t));
+    if(!workers) ERR("calloc");
+    double start = NowNs();
+    for(i=0;i<threadCount;i++) {
+        workers[i].socketPath = socketPath;
+        workers[i].mapPath = mapPath;
+        workers[i].connCount = connCount/threadCount+(i < connCount%threadCount);
+        workers[i].end = start+seconds*1.0e9;
+        RngSeed(&workers[i].rng,i+1);
+        if(pthread_create(&workers[i].thread,NULL,LoadWork,&workers[i])) ERR("pthread_create");
+    }
+    long total = 0;
+    for(i=0;i<threadCount;i++) {
+        if(pthread_join(workers[i].thread,NULL)) ERR("pthread_join");
+        total += workers[i].len;
+    }
+    double elapsed = (NowNs()-start)/1.0e9;
+    uint32_t* all = (uint32_t*)malloc(sizeof(uint32_t)*(total ? total : 1));
+    if(!all) ERR("malloc");
+    for(total=0,i=0;i<threadCount;i++) {
+        memcpy(all+total,workers[i].latencies,sizeof(uint32_t)*workers[i].len);
+        total += workers[i].len;
+        free(workers[i].latencies);
+    }
+    qsort(all,total,sizeof(uint32_t),CompareLatencies);
+    for(long j=0;j<total;j++) sum += all[j];
+    const double ps[] = {50,90,99,99.9};
+    printf("{\"connections\":%d,\"threads\":%d,\"seconds\":%.3f,\"commands\":%ld,\"commandsPerSecond\":%.0f,\"latency\":{\"unit\":\"ns\",\"mean\":%.0f",
+           connCount,threadCount,elapsed,total,total/elapsed,total ? sum/total : 0.0);
+    for(i=0;i<(int)(sizeof(ps)/sizeof(ps[0]));i++) {
+        long rank = (long)ceil(ps[i]/100*total);
+        printf(",\"p%g\":%u",ps[i],total ? all[rank > 0 ? rank-1 : 0] : 0);
+    }
+    printf(",\"max\":%u}}\n",total ? all[total-1] : 0);
+    free(all);
+    free(workers);
+    if(generated) {
+        if(unlink(mapPath) || rmdir(dir)) ERR("unlink");
+        free(mapPath);
+    }
+    return EXIT_SUCCESS;
+}
@@ -9,13 +9,69 @@
 #include <unistd.h>
 #include <math.h>
 #include <pthread.h>
-#include <ftw.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
 #include <signal.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 
 #define MAX_PATH 1000
-#define MAX_GRAPH 1000
-#define MAX_FD 20
+#define SAVE_MAGIC "MIGSAVE" // First bytes of every map and save file.
+#define SAVE_VERSION 1
+#define MAX_SECTIONS 16
+#define BITSET_WORDS(n) (((n)+63)/64) // Number of 64-bit words of a bitset with n bits.
+#define BFS_ALPHA 14 // Exact path search switches to bottom-up when frontier has more than 1/BFS_ALPHA of unvisited edges.
+#define BFS_BETA 24 // and back to top-down when frontier has less than 1/BFS_BETA of all rooms.
+#define ROUTE_TABLE_MAX_ROOMS 4096 // Largest map for which -r auto builds next-hop table (32 MB).
+#define ALT_LANDMARKS 16 // Number of landmarks of ALT distance oracle.
+#define NO_HOP UINT16_MAX // Entry of next-hop table for unreachable destination.
+#define ANALYZE_MAX_ROOMS 65535 // Largest map taken by analyze-map, so distances fit in uint16 and rows in 512 MB.
+#define NO_DIST UINT16_MAX // Entry of distance matrix of analyze-map for unreachable room.
+#define SOLVE_SECONDS 5 // Default time budget of solve.
+#define SOLVE_MAX_SECONDS 86400 // Longest time budget of solve, larger ones are cut to it.
+#define SOLVE_CANDIDATES 4 // Number of nearest deliverable items a randomized plan of solve chooses from.
+#define SOLVE_REPORT_MS 1000 // Time between progress reports of solve.
+#define SOLVE_CHECK 256 // Carries between checks of the time budget while a plan of solve is built.
+#define SOLVE_BOUND_WORK (1L << 30) // Largest rooms*(rooms+edges) for which solve finds distances of all items to their rooms.
+#define STRESS_SECONDS 2 // Default time every run of multiplayer lasts.
+#define STRESS_CHECK 256 // Actions of a player of multiplayer between checks of the time.
+#define DROP_AWAY 4 // A player of multiplayer drops a held item outside of its room with probability 1/DROP_AWAY.
+#define WALK_MAX_STEPS 1000 // Limit of steps of one random walk of find-path.
+#define SESSION_MAX_WALKS 1024 // Most random walks of find-path in a server session, whose worker serves other clients meanwhile.
+#define WALK_SET_BITS 11 // Set of rooms visited by one walk has 2^WALK_SET_BITS slots, over twice WALK_MAX_STEPS.
+#define JOURNAL_MAGIC "MIGJRNL" // First bytes of every journal file.
+#define JOURNAL_COMMIT_MS 50 // Longest time an event waits in memory before it is written to the journal.
+#define JOURNAL_BATCH 256 // Number of waiting events that get written at once without waiting longer.
+#define AUTOSAVE_SECONDS 60 // Time between full snapshots of the game, counted from last save.
+#define INPUT_BLOCK (1 << 20) // Size of blocks commands are read in.
+#define OUTPUT_BLOCK (1 << 16) // Size of buffered output written at once, also within a batch of input.
+#define METRICS_SAMPLE 16 // Every METRICS_SAMPLE-th command of each kind is timed, reading the clock costs as much as a simple command.
+#define HISTOGRAM_SUB_BITS 4 // Histogram buckets split every power of two into 2^HISTOGRAM_SUB_BITS equal parts.
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64-HISTOGRAM_SUB_BITS+1)*HISTOGRAM_SUB) // Enough for any 64-bit value.
+#define SNAPSHOT_RETRIES 3 // Copies of the game torn by commands after which autosave copies it under the mutex.
+#define LIVE_SYNC_MS 1000 // Time between flushes of changed pages of a live game file.
+#define MAPGEN_CHUNK_ROOMS 65536 // Rooms in one chunk of a generated map, every chunk has its own generator stream.
+#define MAPGEN_DEFAULT_DEGREE 8 // Average number of neighbors of generated sparse maps.
+#define DIRWALK_BUFFER 65536 // Size of buffer for directory entries read at once by getdents64.
+#define SHUFFLE_CHUNK 1048576 // Elements in one chunk of parallel shuffle, every chunk has its own generator stream.
+#define SERVER_EVENTS 256 // Largest number of events handled by a worker of the game server at once.
+#define WHEEL_SLOTS 64 // Slots of the autosave timer wheel of the game server, one per second, more than AUTOSAVE_SECONDS.
+#define SMALL_WORLD_REWIRE 0.1 // Probability that an edge of small-world lattice is moved to a random room.
 
 // A macro that describes an error and its source, if occured.
 #define ERR(source) (perror(source),\
@@ -25,28 +81,364 @@
 // A macro that computes time between end and start.
 #define ELAPSED(start,end) ((end).tv_sec-(start).tv_sec)+(((end).tv_nsec - (start).tv_nsec) * 1.0e-9)
 
+// A macro that writes string literal text at pos and gives end of the text.
+#define FORMAT_TEXT(pos,text) (memcpy((pos),(text),sizeof(text)-1),(pos)+sizeof(text)-1)
+
+// Undirected graph stored in compressed sparse row form, which becomes game map.
+typedef struct graph {
+    long* offsets; // Neighbors of room i are neighbors[offsets[i]] .. neighbors[offsets[i+1]-1].
+    int* neighbors; // Sorted neighbor lists of all rooms, one after another.
+} graph_t;
+
+// Undirected graph stored as adjacency matrix with a bitset row for every room, used for dense maps.
+typedef struct bitGraph {
+    int roomCount; // Number of rooms.
+    long words; // Words of every row, BITSET_WORDS(roomCount).
+    uint64_t* rows; // Bit j of row i (words rows[i*words] .. rows[i*words+words-1]) is set if rooms i and j are neighbors.
+} bitGraph_t;
+
+// Growable list of undirected edges, used to build a graph.
+typedef struct edgeList {
+    int* ends; // Two rooms for every edge.
+    long len; // Number of edges.
+    long cap; // Number of edges that fit in ends.
+} edgeList_t;
+
+// Identifiers of sections in map and save files.
+enum saveSectionId {
+    SECTION_OFFSETS, // Graph row offsets, int64 for every room plus one.
+    SECTION_NEIGHBORS, // Graph neighbor lists, int32 for every edge end.
+    SECTION_PROPER_ROOM, // One byte for every item, written by older versions, replaced by SECTION_PROPER_BITS.
+    SECTION_ITEMS, // int32 for every item.
+    SECTION_ITEM_DEST, // int32 for every item.
+    SECTION_ITEMS_IN_ROOM, // int32 for every room.
+    SECTION_NEXT_HOP, // Optional next-hop table of routing index, uint16 for every pair of rooms.
+    SECTION_LANDMARKS, // Optional landmark distances of routing index, int32 for every landmark and room.
+    SECTION_PROPER_BITS, // Bitset of properly placed items, uint64 words.
+    SECTION_ROOM_SLOTS, // Two int32 item slots for every room, -1 if empty.
+    SECTION_ADJACENCY // Adjacency bitset rows of dense maps instead of SECTION_OFFSETS and SECTION_NEIGHBORS, uint64 words.
+};
+
+// Kinds of routing index, selected with -r option.
+enum routeMode {
+    ROUTE_NONE, // No index, find-path --route searches from scratch.
+    ROUTE_TABLE, // Next hop for every pair of rooms, queries cost path length.
+    ROUTE_ALT, // Distances from a few landmarks guiding A* search, memory linear in number of rooms.
+    ROUTE_AUTO // Table for small maps, landmarks for large ones.
+};
+
+// Index answering path queries on a map, which does not change during a game.
+typedef struct routeIndex {
+    int mode; // ROUTE_TABLE or ROUTE_ALT.
+    int roomCount; // Number of rooms on the map.
+    uint16_t* nextHop; // Table: nextHop[x*roomCount+v] is next room on a shortest path from v to x, or NO_HOP.
+    int* landmarkDist; // ALT: distance of every room from every landmark (ALT_LANDMARKS rows), -1 if unreachable.
+    int* searchDist; // ALT: distance from start found by A* search.
+    int* searchParent; // ALT: previous room on path found by A* search.
+    unsigned int* searchStamp; // ALT: number of query that set searchDist of the room.
+    unsigned int searchCount; // ALT: number of queries so far.
+    int* heap; // ALT: priority queue of A* search, pairs of key and room.
+    long heapCap; // ALT: number of pairs that fit in heap.
+    size_t bytes; // Memory used by the index, without A* search arrays.
+    double buildTime; // Time of building in seconds, 0 if loaded with the game.
+} routeIndex_t;
+
+// Routing index of a game and state of its construction in background.
+typedef struct routing {
+    int mode; // Kind of index requested with -r option.
+    routeIndex_t* index; // Finished index, or NULL while it is not ready.
+    pthread_t builder; // Thread building the index.
+    bool building; // Whether builder was started and not joined yet.
+    bool cancel; // Asks builder to stop.
+    bool unreported; // Builder finished the index and the thread running commands has not printed it yet.
+    int firstRoom; // Room the first landmark search starts from, current room when building started.
+} routing_t;
+
+// Distances from every room to the nearest of a set of source rooms, kept up to date as rooms join and leave the set.
+typedef struct distanceField {
+    int* dist; // Distance from every room to its nearest source, INT_MAX if no source can be reached.
+    int* source; // Nearest source of every room, the room itself for sources, -1 if no source can be reached.
+} distanceField_t;
+
+// Distance fields answering hint, built at its first use in a game and then updated by every change of items.
+typedef struct hints {
+    distanceField_t misplaced; // Sources are rooms with a misplaced item lying in them.
+    distanceField_t free; // Sources are rooms with an empty slot.
+    distanceField_t dest; // Source is room destRoom.
+    int destRoom; // Room of the held item dest was last found for, -1 before the first one.
+    int* queue; // Queue of searches, one entry for every room.
+    int* region; // Rooms of the source that left the set, during update.
+    uint64_t* seeds; // Rooms of region with their distances from outside of it in high bits, sorted, during update.
+} hints_t;
+
+// Topologies of maps made by generate-random-map.
+enum topology {
+    TOPOLOGY_DENSE, // Every pair of rooms is connected with probability 1/2.
+    TOPOLOGY_TREE, // Random spanning tree plus random extra edges.
+    TOPOLOGY_GNP, // Random spanning tree plus Erdos-Renyi random graph.
+    TOPOLOGY_GRID, // Square grid filled row by row.
+    TOPOLOGY_SMALL_WORLD // Ring lattice with some edges moved to random rooms, the ring itself is kept.
+};
+
+// Passes of sparse map generation.
+enum mapGenPass {
+    MAPGEN_COUNT, // Count degrees of rooms.
+    MAPGEN_FILL, // Store neighbors of rooms.
+    MAPGEN_SORT // Sort neighbor lists and remove repeated edges.
+};
+
+// Parallel shuffle of an array. Chunks are shuffled separately and then merged in pairs, level by level,
+// as in MergeShuffle, so the result is a uniform permutation that depends only on seed.
+typedef struct shuffle {
+    int* values; // Shuffled array.
+    long len; // Number of elements.
+    uint64_t seed; // Seed of the shuffle, every chunk and merge has its own generator stream derived from it.
+    int level; // Current level, 0 shuffles chunks, level l merges pairs of blocks of SHUFFLE_CHUNK << (l-1) elements.
+    long taskCount; // Number of chunks or merges at current level.
+    long nextTask; // Next chunk or merge to do, taken by threads atomically.
+} shuffle_t;
+
+// Sparse map being generated, shared by threads of the generator. Edges are made twice from the same
+// generator streams, first to count them and then to store them, so no edge list is kept in memory.
+typedef struct mapGen {
+    int topology; // Topology of the map.
+    int n; // Number of rooms.
+    int degree; // Requested average number of neighbors.
+    int width; // Width of TOPOLOGY_GRID.
+    double logQ; // log(1-p) of TOPOLOGY_GNP, where p is probability of an edge.
+    uint64_t seed; // Seed of the map, chunk c uses generator seeded with seed+c.
+    int chunkCount; // Number of chunks of MAPGEN_CHUNK_ROOMS rooms.
+    int threadCount; // Number of threads of the generator.
+    int nextChunk; // Next chunk to process, taken by threads atomically.
+    int pass; // Current mapGenPass.
+    long* offsets; // Degrees of rooms shifted by one, then row starts, in the mapped map file.
+    int* neighbors; // Neighbor lists in the mapped map file.
+    int* rowLen; // Number of distinct neighbors of every room.
+} mapGen_t;
+
+// Location of one section in a map or save file, size 0 means the section is absent.
+typedef struct saveSection {
+    uint64_t offset; // Byte offset from start of file, multiple of 8.
+    uint64_t size; // Size in bytes.
+} saveSection_t;
+
+// Header at the start of map and save files. All values are stored in native byte order,
+// so the file can be mapped and used in place.
+typedef struct saveHeader {
+    char magic[8]; // SAVE_MAGIC.
+    uint32_t version; // SAVE_VERSION.
+    int32_t roomCount; // Number of rooms on the map.
+    int32_t itemCount; // Number of items, 0 in map files.
+    int32_t movesCount; // Number of moves made by player.
+    int32_t itemHeld; // Number of item held by a player or -1.
+    int32_t currentRoom; // Number of currently visited room.
+    uint64_t sessionId; // Session of the journal that continues this save, 0 if there is none.
+    uint64_t journalSeq; // Number of the first journal event not included in this save.
+    uint64_t liveWrites; // Changes of a live game file started plus finished, odd while a change is being made.
+    uint64_t itemSeed; // Seed items were placed with at the start of the game.
+    saveSection_t sections[MAX_SECTIONS]; // Indexed by saveSectionId.
+} saveHeader_t;
+
+// Commands of the main menu, games and server sessions.
+enum commandId {
+    CMD_UNKNOWN, CMD_MOVE_TO, CMD_PICK_UP, CMD_DROP, CMD_SWAP, CMD_SAVE, CMD_FIND_PATH, CMD_QUIT, CMD_EXIT, CMD_SEED,
+    CMD_GENERATE_RANDOM_MAP, CMD_MAP_FROM_DIR_TREE, CMD_LOAD_GAME, CMD_START_GAME, CMD_CONVERT_SAVE, CMD_STATS,
+    CMD_ANALYZE_MAP, CMD_SOLVE, CMD_SELF_PLAY, CMD_HINT, CMD_MULTIPLAYER, CMD_JOIN_GAME, CMD_COUNT // Number of commandId values.
+};
+
+// State of xoshiro256** pseudorandom generator.
+typedef struct rng {
+    uint64_t s[4]; // Generator state, never all zero.
+} rng_t;
+
+// Text written by the game, collected in memory and sent in large blocks.
+typedef struct outBuffer {
+    char* data; // Text not sent yet.
+    size_t len; // Number of bytes in data.
+    size_t cap; // Number of bytes that fit in data.
+    int fd; // Descriptor OutFlush writes to, -1 if the owner sends the text itself.
+    char* proper; // Last list of properly placed items added to data, parts of it are reused while they do not change.
+    uint64_t* properWords; // Words of properRoom the list in proper was formatted from.
+    uint32_t* properEnds; // End of text of every word in proper.
+    size_t properCap; // Number of bytes that fit in proper.
+    int properCount; // Number of words in properWords.
+} outBuffer_t;
+
+// Input of commands, read in large blocks and split into lines in place.
+typedef struct lineReader {
+    FILE* file; // Stream read with fread if it has no descriptor, like fmemopen streams.
+    int fd; // Descriptor of file, read directly so that a pipe or terminal gives whatever is available, or -1.
+    char* buf; // Block of input, bytes from start to end are not handed out yet.
+    size_t start; // First byte not handed out.
+    size_t end; // End of data in buf.
+    bool eof; // End of input was reached.
+} lineReader_t;
+
 // A structure containing game data.
 typedef struct gameArgs {
-    bool** graph; // Game map.
-    bool* properRoom; // // Array containing information which items are in their destination rooms.
+    graph_t graph; // Game map.
+    uint64_t* properRoom; // Bitset containing information which items are in their destination rooms.
+    int misplacedCount; // Number of items which are not in their destination rooms, including held item.
+    uint64_t itemSeed; // Seed items were placed with at the start of the game.
     int movesCount; // Number of moves made by player.
     int roomCount; // Number of rooms on the map.
     int itemHeld; // Number of item held by a player or -1 if player does not hold any item.
     int currentRoom; // Number of currently visited room.
     int saveCount; // Number of manual game saves.
+    unsigned long version; // Seqlock of player state and item arrays, odd while a change is in progress.
+    unsigned int metricsTicks[CMD_COUNT]; // Number of commands of every kind in the game, counting which ones are timed.
     pthread_mutex_t* mutex; // Mutex for synchronization.
     sigset_t* mask; // Signal mask.
     int* items; // Array containing current location of every item.
     int* itemDest; // Array containing destination location of every item.
     int* itemsInRoom; // Array containing number of items in every room.
+    int* roomSlots; // Array containing two slots for every room with numbers of items in it, empty slots are -1 and come last.
     char* autosavePath; // Path for autosave.
+    void* mapping; // Mapped map or save file that arrays above may point into, or NULL.
+    size_t mappingSize; // Size of the mapping in bytes.
+    void* arena; // Single allocation item arrays of new games are carved from, kept for the next game, or NULL.
+    size_t arenaSize; // Size of the arena in bytes.
+    routing_t routing; // Routing index used by find-path --route.
+    hints_t* hints; // Distance fields of hint, or NULL before its first use in the game.
+    struct walkPool* walkPool; // Threads doing random walks of find-path, or NULL before first use.
+    struct journal* journal; // Journal of the running game, or NULL.
+    pthread_t autosaveThread; // Thread writing journal and snapshots.
+    pthread_t signalThread; // Thread waiting for SIGUSR1.
+    bool liveMode; // Keep the game in autosave file mapped shared instead of journal and snapshots (-l).
+    struct saveHeader* live; // Header of the live game file the game is kept in, or NULL.
+    int liveTimer; // Timer of flushes of the live game file.
+    bool gameThreads; // Autosave and signal handling threads are running.
+    bool headless; // Commands come from a script and rooms are not printed after every command (--headless).
+    bool session; // Game of a server session, its worker serves other clients too, so long commands are refused or capped.
+    lineReader_t* input; // Commands, read from stdin or the script.
+    FILE* record; // Stream every command is copied to so the session can be replayed (--record), or NULL.
+    rng_t swapRng; // Generator choosing items swapped after SIGUSR1.
+    outBuffer_t* output; // Messages of the game, written to stdout once per block of input or sent to the client of a server session.
 } gameArgs_t;
 
-// Structure passed to threads executing FindPath (finding path between two rooms)
-typedef struct findPathArgs { 
+// Names of commands by commandId, as shown by stats.
+const char* commandNames[CMD_COUNT] = {
+    "unknown", "move-to", "pick-up", "drop", "#swap", "save", "find-path", "quit", "exit", "seed",
+    "generate-random-map", "map-from-dir-tree", "load-game", "start-game", "convert-save", "stats",
+    "analyze-map", "solve", "self-play", "hint", "multiplayer", "join-game"
+};
+
+// Histogram of values with relative error below 1/HISTOGRAM_SUB, like HdrHistogram: values below HISTOGRAM_SUB
+// get a bucket each, larger ones share HISTOGRAM_SUB buckets per power of two. Updated with relaxed atomic operations.
+typedef struct histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS]; // Number of values in every bucket.
+    uint64_t count; // Number of values.
+    uint64_t sum; // Sum of values.
+    uint64_t max; // Largest value.
+} histogram_t;
+
+// Runtime metrics of the whole process, shown by stats and written to stderr on SIGUSR2. Times are in nanoseconds.
+typedef struct metrics {
+    uint64_t commands[CMD_COUNT]; // Number of game commands of every kind.
+    histogram_t commandTimes[CMD_COUNT]; // Time of every METRICS_SAMPLE-th game command of the kind, without waiting for the mutex.
+    uint64_t locks; // Number of times the mutex of a game was locked by LockGame.
+    uint64_t lockWaits; // Number of times LockGame found the mutex locked by another thread.
+    histogram_t lockWaitTimes; // Time of waits for the mutex.
+    histogram_t snapshotTimes; // Time of autosave snapshots, including snapshots of server sessions.
+    histogram_t journalTimes; // Time of journal writes, including fdatasync.
+    histogram_t liveSyncTimes; // Time of flushes of live game files.
+    uint64_t autosaveBytes; // Bytes written by snapshots and journal writes.
+    histogram_t saveTimes; // Time of save commands.
+    uint64_t saveBytes; // Bytes written by save commands.
+    histogram_t loadTimes; // Time of loading saves, including journal replay.
+    uint64_t findPaths; // Number of find-path commands that searched.
+    uint64_t pathsFound; // Number of them that found a route.
+    histogram_t pathLengths; // Lengths of found routes.
+    histogram_t walkLengths; // Steps of random walks of find-path, including walks given up as too long.
+} metrics_t;
+
+metrics_t metrics; // Metrics of the process.
+
+// Results of GameCommand.
+enum commandResult {
+    COMMAND_DONE, // Command was handled and the game goes on.
+    COMMAND_FINISHED, // All items reached their rooms and the game ended.
+    COMMAND_QUIT // Player quit the game.
+};
+
+// Kinds of events written to the journal.
+enum journalEvent {
+    EVENT_MOVE, // Player moved to room a.
+    EVENT_PICK_UP, // Player picked up item a.
+    EVENT_DROP, // Player dropped item a.
+    EVENT_SWAP // Items a and b swapped rooms after SIGUSR1.
+};
+
+// One event in a journal file, fixed size so a torn write at the end of the file is easy to find.
+typedef struct journalRecord {
+    uint64_t seq; // Number of the event, counted from start of the session.
+    int32_t type; // journalEvent.
+    int32_t movesCount; // Number of moves after the event.
+    int32_t a; // Room or item, see journalEvent.
+    int32_t b; // Second item of EVENT_SWAP, otherwise -1.
+    uint32_t check; // Checksum of the fields above.
+    uint32_t padding; // Zero.
+} journalRecord_t;
+
+// Header at the start of journal files, followed by records with consecutive numbers.
+typedef struct journalHeader {
+    char magic[8]; // JOURNAL_MAGIC.
+    uint64_t sessionId; // Session of the game, same as in the save the journal continues.
+    uint64_t firstSeq; // Number of the first record in the file.
+} journalHeader_t;
+
+// Journal of a running game. Events are added by threads changing the game and written
+// in batches by the autosave thread, which also owns the file.
+typedef struct journal {
+    char path[MAX_PATH+8]; // Autosave path with .journal appended.
+    int fd; // Journal file, -1 before it is created.
+    uint64_t sessionId; // Random number identifying this session.
+    uint64_t nextSeq; // Number of the next event, changed under mutex of the game.
+    uint64_t firstSeq; // Number of the first record in the file.
+    uint64_t writtenSeq; // Number of the record after the last one written to the file.
+    pthread_mutex_t mutex; // Protects fields below.
+    pthread_cond_t wake; // Signaled when a batch is full or the journal is stopped.
+    journalRecord_t* pending; // Events waiting to be written.
+    int pendingLen; // Number of events in pending.
+    int pendingCap; // Number of events that fit in pending.
+    journalRecord_t* writing; // Second buffer, swapped with pending by the autosave thread.
+    int writingCap; // Number of events that fit in writing.
+    bool stop; // Asks the autosave thread to write remaining events and end.
+} journal_t;
+
+struct walkWorker;
+
+// Pool of threads doing random walks of find-path, created once per game.
+typedef struct walkPool {
     gameArgs_t* args; // Current game status.
-    int x; // Number of destination room for a path.
-} findPathArgs_t;
+    int threadCount; // Number of threads in the pool.
+    pthread_t* threads; // Threads of the pool.
+    struct walkWorker* workers; // Data of every thread.
+    pthread_mutex_t mutex; // Protects fields below up to quit.
+    pthread_cond_t start; // Signaled when a new job is posted.
+    pthread_cond_t finished; // Signaled when all threads finished current job.
+    unsigned long job; // Number of current job.
+    int running; // Number of threads still working on current job.
+    bool quit; // Asks threads to end.
+    uint64_t seed; // Seed of the pool, every walk gets its own generator stream derived from it.
+    int walkCount; // Number of walks in current job.
+    int nextWalk; // Next walk to do, taken by threads atomically.
+    int startRoom; // Room where walks start.
+    int target; // Room where walks should end.
+    uint64_t best; // Length of the best walk so far (upper 32 bits) and its number, UINT64_MAX if none.
+} walkPool_t;
+
+// Data of one thread of the random walk pool, reused by all walks.
+typedef struct walkWorker {
+    walkPool_t* pool; // Pool of the thread.
+    rng_t rng; // Generator of current walk.
+    int* path; // Rooms of current walk.
+    int* bestPath; // Rooms of the best walk found by this thread in current job.
+    uint64_t bestKey; // Length and number of bestPath as in walkPool_t best, UINT64_MAX if none.
+    int* setRooms; // Open addressing set of rooms of current walk.
+    unsigned int* setStamp; // Slot of setRooms is used if its stamp equals stamp.
+    unsigned int stamp; // Number of current walk of this thread.
+} walkWorker_t;
 
 // Structure returned from FindPath (finding path between two rooms)
 typedef struct findPathReturnArgs { 
@@ -55,544 +447,5106 @@ typedef struct findPathReturnArgs {
     bool ok; // Information if found path ends in destination room.
 } findPathReturnArgs_t;
 
-// Structure modified by nftw function called by MapFromDirTree (creating map from a directory tree).
-typedef struct nftwArgs { 
-    int level[MAX_PATH]; // Depth of every found directory.
-    int len; // Number of found directories.
-} nftwArgs_t;
+// Structure passed to threads filling next-hop table of routing index.
+typedef struct routeTableArgs {
+    gameArgs_t* args; // Current game status.
+    routeIndex_t* index; // Index being built.
+    int nextRoom; // Next destination room to process, taken by threads atomically.
+} routeTableArgs_t;
+
+// Map analysis shared by threads of analyze-map.
+typedef struct mapAnalysis {
+    bitGraph_t* bits; // Adjacency rows of dense map, NULL if graph is given.
+    graph_t* graph; // Neighbor lists of sparse map, NULL if bits are given.
+    int roomCount; // Number of rooms.
+    double degree; // Average number of neighbors of a room.
+    int nextSource; // Next room to search from, taken by threads atomically.
+    int* eccentricity; // Largest distance from every room to a room reachable from it.
+    int distanceFd; // File the distance matrix is written to, -1 if it is not written.
+} mapAnalysis_t;
+
+// Thread of analyze-map with its share of the results.
+typedef struct analyzeWorker {
+    mapAnalysis_t* analysis; // Shared part of the analysis.
+    pthread_t thread; // Thread of the worker.
+    long* distanceCounts; // Number of ordered pairs of rooms at every distance found by the thread.
+    int components; // Number of connected components whose lowest room was searched from by the thread.
+} analyzeWorker_t;
+
+// Kinds of rooms and items breadth-first search of solve looks for.
+enum solveTarget {
+    TARGET_ROOM, // The given room.
+    TARGET_FREE_ROOM, // Room with an empty slot, other than the given room.
+    TARGET_DELIVERY, // Misplaced item whose destination has an empty slot.
+    TARGET_BLOCKER // Misplaced item in a room which is destination of another misplaced item.
+};
+
+// Carry of one item in a plan found by solve: the player walks to the item and picks it up (unless the item is
+// already held), then walks to room and drops it there.
+typedef struct carry {
+    int item; // Item carried.
+    int room; // Room the item is dropped in, its destination or a free room it waits in.
+    int total; // Number of commands of the plan up to and including this carry.
+} carry_t;
+
+// Search for a short plan finishing the game, shared by threads of solve.
+typedef struct solver {
+    graph_t* graph; // Game map.
+    int roomCount; // Number of rooms on the map.
+    int itemCount; // Number of items.
+    int* items; // Location of every item when solve started, -1 for held item.
+    int* itemDest; // Destination room of every item.
+    int currentRoom; // Room of the player when solve started.
+    int itemHeld; // Item held when solve started or -1.
+    int misplacedCount; // Number of misplaced items when solve started, including held item.
+    int* destItems; // Two slots for every room with misplaced items that must reach it, empty slots are -1.
+    int nextRoom; // Next room to find distances of items from, taken by threads atomically.
+    int roomsDone; // Number of rooms distances of items were found from.
+    long distanceSum; // Sum of distances of misplaced items from their rooms found so far.
+    int lowerBound; // Least number of commands of any plan, with distances of items once all are found.
+    uint64_t end; // End of time budget in MonotonicNs time.
+    bool stop; // Asks threads to stop, set at the end of time budget or when a plan reaches lowerBound.
+    pthread_mutex_t mutex; // Protects best plan.
+    pthread_cond_t changed; // Signaled when stop is set.
+    carry_t* best; // Shortest plan found so far.
+    int bestLen; // Number of carries of best plan, -1 if none was found yet.
+    int bestTotal; // Number of commands of best plan, INT_MAX if none was found yet.
+    long plans; // Number of plans built, including ones given up as not shorter than best.
+} solver_t;
+
+// Thread of solve with its own copy of the game and search arrays.
+typedef struct solveWorker {
+    solver_t* solver; // Shared part of the search.
+    pthread_t thread; // Thread of the worker.
+    rng_t rng; // Generator of random choices of plans.
+    bool greedy; // The next plan is the plain greedy one.
+    int* items; // Location of every item in the plan built, -1 for held item.
+    int* roomSlots; // Two slots for every room with numbers of items in it, empty slots are -1 and come last.
+    int* itemsInRoom; // Number of items in every room.
+    int* wanted; // Number of misplaced items with destination in every room.
+    int misplacedCount; // Number of misplaced items, including held item.
+    int currentRoom; // Room of the player.
+    int itemHeld; // Item held by the player or -1.
+    carry_t* plan; // Carries of the plan built.
+    int len; // Number of carries in plan.
+    int cap; // Number of carries that fit in plan.
+    int* dist; // Distance of rooms found by the last search from its start.
+    int* parent; // Previous room on shortest path from start of the last search.
+    unsigned int* stamp; // Number of search that set dist and parent of the room.
+    unsigned int searchCount; // Number of searches so far.
+    int* queue; // Queue of breadth-first search.
+} solveWorker_t;
+
+// Batch of games played by self-play, shared by its threads.
+typedef struct selfPlay {
+    graph_t* graph; // Map of every game, NULL if every game gets a new dense map.
+    int roomCount; // Number of rooms of every map.
+    int gameCount; // Number of games to play.
+    uint64_t seed; // Seed maps, items and start rooms of the games are derived from.
+    int nextGame; // Next game to play, taken by threads atomically.
+    int* moves; // Number of moves of every game, -1 if the agent could not finish it.
+} selfPlay_t;
+
+// Thread of self-play with the game, map and agent it reuses for all its games.
+typedef struct selfPlayWorker {
+    selfPlay_t* batch; // Shared part of self-play.
+    pthread_t thread; // Thread of the worker.
+    gameArgs_t args; // Game played, with arrays for the rooms of the batch.
+    bitGraph_t bits; // Adjacency rows of the generated map, unused if the batch has a map.
+    long neighborCap; // Number of neighbors that fit in the generated map.
+    int* slots; // Slots shuffled when items are placed, in the arena of args.
+    solver_t solver; // Game planned by the agent, pointing into args.
+    solveWorker_t agent; // Greedy agent of solve.
+    uint64_t mapNs; // Time spent generating maps, in nanoseconds.
+    uint64_t itemsNs; // Time spent placing items, in nanoseconds.
+    uint64_t playNs; // Time spent planning and playing games, in nanoseconds.
+} selfPlayWorker_t;
+
+// Items of a map shared by players acting at the same time, both slots of a room in one word changed with compare-and-swap.
+typedef struct world {
+    graph_t* graph; // Map, only read.
+    int roomCount; // Number of rooms.
+    int itemCount; // Number of items.
+    int* itemDest; // Destination of every item, only read.
+    uint64_t* slots; // Items in slots of every room, slot k in bits 32k to 32k+31, empty slots are -1 and come last.
+    int misplacedCount; // Number of items which are not in their destination rooms, including held ones, changed atomically.
+    pthread_mutex_t* global; // Mutex every action is taken under, like commands of a single game, or NULL.
+    uint64_t end; // Time the players stop, in nanoseconds.
+} world_t;
+
+// Player of a shared map, with its own thread.
+typedef struct player {
+    world_t* world; // Map and items shared with other players.
+    pthread_t thread; // Thread of the player.
+    rng_t rng; // Generator of choices of the player.
+    int room; // Room of the player.
+    int held; // Item held by the player or -1.
+    long moves; // Number of moves.
+    long pickUps; // Number of items picked up.
+    long drops; // Number of items dropped.
+    long conflicts; // Number of pick-ups and drops that failed because another player changed the room first.
+} player_t;
+
+struct bfsWorker;
+
+// Shared state of threads searching for the shortest path with bidirectional breadth-first search.
+// Side 0 of the search starts in current room, side 1 in destination room.
+typedef struct bfsShared {
+    graph_t* graph; // Game map.
+    int roomCount; // Number of rooms on the map.
+    int threadCount; // Number of searching threads.
+    struct bfsWorker* workers; // Data of every searching thread.
+    int* dist[2]; // Distance of every room from start of each side, -1 if not reached yet.
+    int* parent[2]; // Previous room on the way back to start of each side.
+    int* frontier[2]; // Rooms reached in the last level of each side.
+    int frontierLen[2]; // Number of rooms in frontier.
+    long frontierEdges[2]; // Sum of degrees of rooms in frontier.
+    long visitedEdges[2]; // Sum of degrees of all rooms reached by each side.
+    int level[2]; // Distance of frontier rooms from start of each side.
+    bool bottomUp[2]; // Whether next level of the side is expanded bottom-up.
+    int side; // Side expanded in current level.
+    int* next; // Rooms reached in current level, filled by all threads.
+    int nextLen; // Number of rooms in next.
+    long nextEdges; // Sum of degrees of rooms in next.
+    int meet; // Room on the shortest path reached from both sides, or -1.
+    bool done; // Set when search is over.
+    pthread_barrier_t barrier; // Barrier separating levels.
+    pthread_mutex_t gate; // Protects open.
+    pthread_cond_t opened; // Signaled when open is set.
+    bool open; // All threads that could be created are running and threadCount is final.
+} bfsShared_t;
+
+// Data of one thread searching for the shortest path.
+typedef struct bfsWorker {
+    bfsShared_t* shared; // State shared by all threads.
+    int index; // Number of thread, decides which part of every level it expands.
+    int* found; // Rooms reached by this thread in current level.
+    int foundLen; // Number of rooms in found.
+    int foundCap; // Number of rooms that fit in found.
+    long foundEdges; // Sum of degrees of rooms in found.
+    int meet; // Room reached from both sides with the shortest total distance, or -1.
+    long meetLen; // Length of path through meet.
+} bfsWorker_t;
 
-nftwArgs_t nftwArgs; // A global variable essential to return data from nftw.
+// Directory entry returned by getdents64.
+typedef struct linuxDirent64 {
+    uint64_t d_ino; // Inode number.
+    int64_t d_off; // Offset of the next entry.
+    unsigned short d_reclen; // Size of this entry.
+    unsigned char d_type; // File type, DT_UNKNOWN if the filesystem does not provide it.
+    char d_name[]; // Name, terminated with zero.
+} linuxDirent64_t;
+
+// Open directory of the directory tree walker, shared by tasks of its subdirectories, which are opened relative
+// to it. Closed when the last of them has been opened.
+typedef struct dirHandle {
+    int fd; // Descriptor of the directory.
+    int refs; // Number of tasks and readers using fd, changed atomically.
+} dirHandle_t;
+
+// Directory waiting to be read by the directory tree walker.
+typedef struct dirTask {
+    dirHandle_t* parent; // Directory containing this one.
+    char* name; // Name of the directory in parent.
+    int room; // Room of the directory.
+} dirTask_t;
+
+struct dirWalk;
+
+// Data of one thread of the directory tree walker.
+typedef struct dirWalker {
+    struct dirWalk* walk; // Walk the thread belongs to.
+    pthread_mutex_t mutex; // Protects the fields below up to cap.
+    dirTask_t* tasks; // Directories to read, tasks[first] .. tasks[first+len-1]. The thread takes
+                      // them from the end, idle threads steal them from the start.
+    long first; // Index of the first task.
+    long len; // Number of tasks.
+    long cap; // Number of tasks that fit in tasks.
+    edgeList_t edges; // Edges between directories and their subdirectories found by this thread.
+} dirWalker_t;
+
+// Parallel walk of a directory tree, every directory becomes a room.
+typedef struct dirWalk {
+    int threadCount; // Number of threads.
+    dirWalker_t* walkers; // Data of every thread.
+    int roomCount; // Number of directories found, incremented atomically.
+    long pending; // Number of directories found but not read yet, the walk ends when it drops to 0.
+    long queued; // Number of tasks waiting in tasks of all threads, changed atomically.
+    int idle; // Number of threads waiting for tasks, changed atomically.
+    pthread_mutex_t mutex; // Protects waiting of idle threads.
+    pthread_cond_t wake; // Signaled when a task is added while a thread is idle, and when the walk ends.
+} dirWalk_t;
+
+struct serverWorker;
+
+// Game on a map played by all sessions of the game server that joined it, items are in a world changed by compare-and-swap.
+typedef struct sharedGame {
+    world_t world; // Items of the game, changed by players of the sessions without any lock.
+    gameArgs_t game; // Map and destinations of items, only read while the game is played.
+    char* path; // Resolved path of the map, sessions joining the same path get the same game.
+    int players; // Number of sessions in the game, changed under gamesMutex of the server.
+    bool listed; // The game is in the list of the server and new sessions join it, finished games are not.
+    struct sharedGame* next; // Next game in the list of the server.
+} sharedGame_t;
+
+// Game session of one client of the game server.
+typedef struct session {
+    gameArgs_t args; // Game of the session, without autosave and signal handling threads.
+    pthread_mutex_t mutex; // Mutex of the game, uncontended since only the owning worker uses the session.
+    uint64_t id; // Number of the session, id % workerCount is the owning worker.
+    struct serverWorker* worker; // Worker serving the client.
+    struct session* tableNext; // Next session in the same bucket of the session table.
+    int fd; // Client socket.
+    bool playing; // A game is started or loaded.
+    char in[MAX_PATH]; // Bytes received from the client and not handled yet.
+    int inLen; // Number of bytes in in.
+    outBuffer_t output; // Replies waiting to be sent to the client.
+    size_t outSent; // Number of bytes of output already sent.
+    bool sending; // Client is watched for room in the socket instead of input, until output is sent.
+    char autosavePath[MAX_PATH+32]; // Backup path of the server with the number of the session appended.
+    uint64_t autosaveTick; // Tick of the timer wheel the game is autosaved at, 0 if none.
+    int autosaveMoves; // Moves count at last save of the game, to skip autosaves of idle games.
+    int autosaveSaves; // Number of save commands at last autosave, a save postpones the autosave like in a single game.
+    sharedGame_t* shared; // Shared game the session joined, or NULL.
+    player_t player; // Player of the session in the shared game.
+} session_t;
+
+// Autosave due at some tick of the timer wheel.
+typedef struct wheelEntry {
+    uint64_t id; // Number of the session.
+    uint64_t tick; // Tick it was scheduled for, stale if the session got another one since.
+} wheelEntry_t;
+
+// List of autosaves due, in a slot of the timer wheel or waiting for a worker.
+typedef struct wheelList {
+    wheelEntry_t* entries; // Autosaves in the list.
+    int len; // Number of autosaves.
+    int cap; // Number of autosaves that fit in entries.
+} wheelList_t;
+
+// Thread of the game server with its own epoll instance, clients and shard of the session table.
+typedef struct serverWorker {
+    struct server* server; // Server of the worker.
+    int index; // Number of the worker.
+    int epollFd; // Epoll instance watching the listening socket, clients of the worker and wakeFd.
+    int wakeFd; // Eventfd signaled when autosaves are due or the server stops.
+    pthread_t thread; // Thread of the worker.
+    session_t** buckets; // Session table of the worker, chained by tableNext.
+    int bucketCount; // Number of buckets, a power of 2.
+    int sessionCount; // Number of sessions of the worker.
+    uint64_t nextSeq; // Number of the next session of the worker, divided by workerCount.
+    walkPool_t* walkPool; // Random walk threads of find-path shared by games of the worker, or NULL before first use.
+    pthread_mutex_t dueMutex; // Protects due.
+    wheelList_t due; // Autosaves handed to the worker by the timer thread.
+} serverWorker_t;
+
+// Save of the game of a session waiting for the saver thread of the game server.
+typedef struct saveJob {
+    gameArgs_t game; // Game with its own copies of item arrays, and owning the rest of it if release is set.
+    char path[MAX_PATH+32]; // Autosave path of the session.
+    bool write; // The game is written to path, otherwise it is only freed.
+    bool release; // The game has ended and is freed after it is written.
+    struct saveJob* next; // Next job in the queue.
+} saveJob_t;
+
+// Game server hosting many sessions over a Unix domain socket.
+typedef struct server {
+    gameArgs_t* args; // Settings of the server, copied to every session.
+    int listenFd; // Listening socket.
+    int workerCount; // Number of workers.
+    serverWorker_t* workers; // Data of every worker.
+    bool stop; // Asks workers to close all sessions and end.
+    int timerFd; // Timer ticking the timer wheel every second.
+    pthread_t timerThread; // Thread moving due autosaves from the timer wheel to workers.
+    pthread_mutex_t wheelMutex; // Protects fields below.
+    wheelList_t wheel[WHEEL_SLOTS]; // Autosaves due at every tick, tick t is in slot t % WHEEL_SLOTS.
+    uint64_t tick; // Number of ticks of the timer wheel so far.
+    pthread_t saverThread; // Thread writing games of sessions to disk, so that workers never wait for it.
+    pthread_mutex_t saveMutex; // Protects fields below.
+    pthread_cond_t saveWake; // Signaled when a save is queued or the server stops.
+    saveJob_t* saveFirst; // Queue of saves, oldest first, NULL if it is empty.
+    saveJob_t* saveLast; // Newest save in the queue.
+    bool saveStop; // Saver ends when the queue is empty.
+    pthread_mutex_t gamesMutex; // Protects games and counts of players of shared games.
+    sharedGame_t* games; // Shared games sessions can join, NULL if there are none.
+} server_t;
 
 // Prints a proper way to execute program. 
 void usage() { 
-    perror("USAGE: ./main -b backup-path\n");
+    perror("USAGE: ./main [-b backup-path] [-l] [-r none|table|alt|auto] [--headless script] [--seed n] [--record path]\n"
+           "       ./main [-b backup-path] [-r none|table|alt|auto] --server socket-path [--workers n]\n");
     exit(EXIT_FAILURE);
 }
 
-// Creates and returns undirected graph with n vertices and random edges between them, which becomes game map.
-bool** CreateGraph(int n) { 
-    bool** graph = (bool **) malloc(sizeof(bool *) * n);
-    if(!graph) ERR("malloc");
-    int i,j;
-    for(i=0;i<n;i++) {
-        graph[i] = (bool*)malloc(sizeof(bool)*n);
-        if(!graph[i]) ERR("malloc");
+// Appends edge between rooms a and b to the list.
+void AddEdge(edgeList_t* edges, int a, int b) {
+    if(edges->len == edges->cap) {
+        edges->cap = edges->cap ? 2*edges->cap : 1024;
+        edges->ends = (int*)realloc(edges->ends,sizeof(int)*2*edges->cap);
+        if(!edges->ends) ERR("realloc");
     }
-    for(i=0;i<n-1;i++) {
-        int count = 0; // We need to ensure the graph is connected.
-        while(count == 0) {
-            for(j=i+1;j<n;j++) {
-                int num = rand()%2;
-                if(num == 1) {
-                    graph[i][j] = true;
-                    graph[j][i] = true;
-                    count++;
-                }
-                else {
-                    graph[i][j] = false;
-                    graph[j][i] = false;
-                }
-            }
-        }
+    edges->ends[2*edges->len] = a;
+    edges->ends[2*edges->len+1] = b;
+    edges->len++;
+}
+
+// Comparator for sorting neighbor lists.
+int CompareInts(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Builds graph with n vertices from a list of undirected edges (every edge listed once).
+graph_t BuildGraph(int n, edgeList_t* edges) {
+    graph_t graph;
+    long i;
+    graph.offsets = (long*)calloc(n+1,sizeof(long));
+    graph.neighbors = (int*)malloc(sizeof(int)*(2*edges->len+1));
+    if(!graph.offsets || !graph.neighbors) ERR("malloc");
+    for(i=0;i<edges->len;i++) { // Counting degrees, shifted by one so prefix sums give row starts.
+        graph.offsets[edges->ends[2*i]+1]++;
+        graph.offsets[edges->ends[2*i+1]+1]++;
+    }
+    for(i=0;i<n;i++) graph.offsets[i+1] += graph.offsets[i];
+    long* fill = (long*)malloc(sizeof(long)*(n+1));
+    if(!fill) ERR("malloc");
+    memcpy(fill,graph.offsets,sizeof(long)*(n+1));
+    for(i=0;i<edges->len;i++) {
+        int a = edges->ends[2*i], b = edges->ends[2*i+1];
+        graph.neighbors[fill[a]++] = b;
+        graph.neighbors[fill[b]++] = a;
+    }
+    free(fill);
+    for(i=0;i<n;i++) {
+        qsort(graph.neighbors+graph.offsets[i],graph.offsets[i+1]-graph.offsets[i],sizeof(int),CompareInts);
     }
     return graph;
 }
 
-// Saves graph with n vertices to a file.
-void SaveGraph(bool** graph, int n, char* path) {
-    int out,i,j;
-    if((out=open(path,O_WRONLY|O_CREAT|O_TRUNC,0777))<0)ERR("open");
-    for(i=0;i<n;i++) {
-        for(j=0;j<n;j++) {
-            dprintf(out,"%d",graph[i][j]);
-        }
+// Frees memory used by graph.
+void FreeGraph(graph_t* graph) {
+    free(graph->offsets);
+    free(graph->neighbors);
+}
+
+// Returns number of rooms adjacent to room v.
+int Degree(graph_t* graph, int v) {
+    return graph->offsets[v+1] - graph->offsets[v];
+}
+
+// Checks if rooms a and b are connected, using binary search in neighbor list of a.
+bool IsNeighbor(graph_t* graph, int a, int b) {
+    long lo = graph->offsets[a], hi = graph->offsets[a+1];
+    while(lo < hi) {
+        long mid = lo + (hi-lo)/2;
+        if(graph->neighbors[mid] == b) return true;
+        if(graph->neighbors[mid] < b) lo = mid+1;
+        else hi = mid;
     }
-    if(close(out)) ERR("close");
+    return false;
 }
 
-// Reads map from file into args structure.
-void ReadGraph(gameArgs_t* args, char* path) {
-    int in;
+// Builds graph with n vertices from text adjacency matrix of '0' and '1' characters.
+graph_t GraphFromMatrix(char* buf, int n) {
+    graph_t graph;
     int i,j;
-    if((in=open(path,O_RDONLY))<0)ERR("open");
-    char buf [MAX_PATH] = "";
-    args->roomCount = (int) sqrt(read(in,buf,MAX_GRAPH));
-    args->graph = (bool**) malloc(sizeof(bool*) * args->roomCount);
-    if(!args->graph) ERR("malloc");
-    for(i=0;i<args->roomCount;i++) {
-        args->graph[i] = (bool*) malloc(sizeof(bool));
-        if(!args->graph[i]) ERR("malloc");
-        for(j=0;j<args->roomCount;j++) {
-            if(buf[i*args->roomCount+j] == '0') args->graph[i][j] = false;
-            else args->graph[i][j] = true;
+    long count = 0;
+    for(i=0;i<n*n;i++) {
+        if(buf[i] != '0') count++;
+    }
+    graph.offsets = (long*)malloc(sizeof(long)*(n+1));
+    graph.neighbors = (int*)malloc(sizeof(int)*(count+1));
+    if(!graph.offsets || !graph.neighbors) ERR("malloc");
+    count = 0;
+    for(i=0;i<n;i++) { // Rows of the matrix are already sorted neighbor lists.
+        graph.offsets[i] = count;
+        for(j=0;j<n;j++) {
+            if(buf[i*n+j] != '0') graph.neighbors[count++] = j;
         }
     }
-    if(close(in)) ERR("close");
+    graph.offsets[n] = count;
+    return graph;
+}
+
+// Checks if bit i of bitset is set.
+bool TestBit(uint64_t* bits, int i) {
+    return (bits[i/64] >> (i%64)) & 1;
+}
+
+// Sets bit i of bitset to value.
+void AssignBit(uint64_t* bits, int i, bool value) {
+    if(value) bits[i/64] |= (uint64_t)1 << (i%64);
+    else bits[i/64] &= ~((uint64_t)1 << (i%64));
+}
+
+// Returns mask of bits of the last word of a bitset with n bits that belong to it.
+uint64_t TailMask(int n) {
+    return n%64 ? ((uint64_t)1 << (n%64))-1 : ~(uint64_t)0;
+}
+
+// Checks that adjacency rows of bits have no bits past the last room and no room is its own neighbor.
+bool ValidBits(bitGraph_t* bits) {
+    int i, n = bits->roomCount;
+    for(i=0;i<n;i++) {
+        uint64_t* row = bits->rows+i*bits->words;
+        if(TestBit(row,i) || (row[bits->words-1] & ~TailMask(n))) return false;
+    }
+    return true;
 }
 
-// Preparing new game.
-void OrganizeItems(gameArgs_t* args) { 
+// Checks that offsets of graph with n rooms start at 0 and never decrease and every row is increasing rooms, as IsNeighbor needs.
+bool ValidGraph(graph_t* graph, int n) {
     int i;
-    int numberOfItems = 3*args->roomCount/2;
-    args->properRoom = (bool*) malloc(sizeof(bool)*numberOfItems);
-    args->movesCount = 0;
-    args->saveCount = 0;
-    args->items = (int*) malloc(sizeof(int)*numberOfItems);
-    args->itemsInRoom = (int*) malloc(sizeof(int)*args->roomCount);
-    args->itemDest = (int*) malloc(sizeof(int)*numberOfItems);
-    int* destsInRoom = (int*)malloc(sizeof(int)*args->roomCount);
-    args->itemHeld = -1;
-    args->currentRoom = rand()%args->roomCount;
-    if(!args->items || !args->itemsInRoom || !args->itemDest || !destsInRoom || !args->properRoom) ERR("malloc");
-    for(i=0;i<args->roomCount;i++) {
-        args->itemsInRoom[i] = 0;
-        destsInRoom[i] = 0;
+    long j;
+    if(graph->offsets[0] != 0) return false;
+    for(i=0;i<n;i++) {
+        if(graph->offsets[i+1] < graph->offsets[i]) return false;
     }
-    for(i=0;i<numberOfItems;i++) { // Assigning start location to items.
-        bool placed = false;
-        args->properRoom[i] = false;
-        while(!placed) {
-            int roomNumber = rand()%args->roomCount;
-            if(args->itemsInRoom[roomNumber] < 2) {
-                args->items[i] = roomNumber;
-                args->itemsInRoom[roomNumber]++;
-                placed = true;
-            }
+    for(i=0;i<n;i++) {
+        for(j=graph->offsets[i];j<graph->offsets[i+1];j++) {
+            if((unsigned int)graph->neighbors[j] >= (unsigned int)n) return false;
+            if(j > graph->offsets[i] && graph->neighbors[j] <= graph->neighbors[j-1]) return false;
         }
     }
-    for(i=0;i<numberOfItems;i++) { // Assigning destination rooms to items.
-        bool placed = false;
-        while(!placed) {
-            int destRoomNumber = rand()%args->roomCount;
-            if(destsInRoom[destRoomNumber] < 2 && destRoomNumber != args->items[i]) {
-                args->itemDest[i] = destRoomNumber;
-                destsInRoom[destRoomNumber]++;
-                placed = true;
-            }
+    return true;
+}
+
+// Builds neighbor lists of graph stored as adjacency rows in graph, growing its neighbors beyond *cap only if needed.
+void FillGraphFromBits(bitGraph_t* bits, graph_t* graph, long* cap) {
+    int i, n = bits->roomCount;
+    long w, count = 0;
+    for(w=0;w<n*bits->words;w++) count += __builtin_popcountll(bits->rows[w]);
+    if(count+1 > *cap) {
+        *cap = count+1;
+        free(graph->neighbors);
+        graph->neighbors = (int*)malloc(sizeof(int)*(*cap));
+        if(!graph->neighbors) ERR("malloc");
+    }
+    count = 0;
+    for(i=0;i<n;i++) { // Bits of a row are already a sorted neighbor list.
+        uint64_t* row = bits->rows+i*bits->words;
+        graph->offsets[i] = count;
+        for(w=0;w<bits->words;w++) {
+            for(uint64_t word=row[w];word;word&=word-1) graph->neighbors[count++] = w*64+__builtin_ctzll(word);
         }
     }
-    free(destsInRoom);
+    graph->offsets[n] = count;
 }
 
-// Prints rooms currently available to move into.
-void PrintAvailableRooms(gameArgs_t* args) {
-    printf("Current room is %d. Available rooms are: ", args->currentRoom);
-    for(int i=0;i<args->roomCount;i++) {
-        if(args->graph[args->currentRoom][i]) printf("%d ",i);
-    }
-    printf("\n");
+// Builds neighbor lists of graph stored as adjacency rows.
+graph_t GraphFromBits(bitGraph_t* bits) {
+    graph_t graph = {NULL,NULL};
+    long cap = 0;
+    graph.offsets = (long*)malloc(sizeof(long)*(bits->roomCount+1));
+    if(!graph.offsets) ERR("malloc");
+    FillGraphFromBits(bits,&graph,&cap);
+    return graph;
 }
 
-// Prints basic information about current game.
-void PrintItemsInRoom(gameArgs_t* args) {
-    printf("Items in this room: ");
+// Builds adjacency rows of graph with n vertices stored as neighbor lists.
+bitGraph_t BitsFromGraph(graph_t* graph, int n) {
+    bitGraph_t bits;
     int i;
-    for(i=0;i<3*args->roomCount/2;i++) {
-        if(args->items[i] == args->currentRoom && i != args->itemHeld) printf("%d ",i);
+    bits.roomCount = n;
+    bits.words = BITSET_WORDS(n);
+    bits.rows = (uint64_t*)calloc(n*bits.words+1,sizeof(uint64_t));
+    if(!bits.rows) ERR("calloc");
+    for(i=0;i<n;i++) {
+        for(long j=graph->offsets[i];j<graph->offsets[i+1];j++) AssignBit(bits.rows+i*bits.words,graph->neighbors[j],true);
     }
-    printf("\nProperly placed items are: ");
-    for(i=0;i<3*args->roomCount/2;i++) {
-        if(args->properRoom[i]) printf("%d ",i);
+    return bits;
+}
+
+// Transposes 64x64 bit matrix, where bit c of block[r] is entry in row r and column c, swapping ever smaller quarters.
+void Transpose64(uint64_t* block) {
+    int j, k;
+    uint64_t m = 0x00000000ffffffffULL;
+    for(j=32;j;j>>=1,m^=m<<j) {
+        for(k=0;k<64;k=((k|j)+1) & ~j) {
+            uint64_t t = ((block[k] >> j) ^ block[k|j]) & m;
+            block[k] ^= t << j;
+            block[k|j] ^= t;
+        }
     }
-    printf("\n");
-    if(args->itemHeld == -1) printf("You can pick up an item.");
-    else printf("You are carrying item %d to room %d.",args->itemHeld,args->itemDest[args->itemHeld]);
-    printf(" Moves count: %d\n",args->movesCount);
 }
 
-// Checks if the game had finished.
-bool CheckIfFinished(gameArgs_t* args) {
-    int i;
-    for(i=0;i<3*args->roomCount/2;i++) {
-        if(args->properRoom[i] == false) return false;
+// Fills item counts, per-room item slots and bitset of properly placed items of args from location of items.
+// Returns false if some room holds more than two items.
+bool FillRoomIndex(gameArgs_t* args) {
+    int i, numberOfItems = 3*args->roomCount/2;
+    for(i=0;i<args->roomCount;i++) {
+        args->itemsInRoom[i] = 0;
+        args->roomSlots[2*i] = args->roomSlots[2*i+1] = -1;
+    }
+    memset(args->properRoom,0,sizeof(uint64_t)*BITSET_WORDS(numberOfItems));
+    args->misplacedCount = numberOfItems;
+    for(i=0;i<numberOfItems;i++) {
+        int room = args->items[i];
+        if(room < 0 || room >= args->roomCount) continue;
+        if(args->itemsInRoom[room] == 2) return false;
+        args->roomSlots[2*room+args->itemsInRoom[room]++] = i;
+        if(room == args->itemDest[i]) {
+            AssignBit(args->properRoom,i,true);
+            args->misplacedCount--;
+        }
     }
     return true;
 }
 
-// Saves game data to file pointed to by path.
-void SaveGame(gameArgs_t* args, char* path) {
-    int out,i;
+// Allocates per-room item slots and bitset of properly placed items of args and fills them from location
+// of items, used for saves which do not store them. Returns false if some room holds more than two items.
+bool RebuildRoomIndex(gameArgs_t* args) {
     int numberOfItems = 3*args->roomCount/2;
-    SaveGraph(args->graph,args->roomCount,path);
-    if((out=open(path,O_WRONLY|O_CREAT|O_APPEND,0777))<0)ERR("open");
-    dprintf(out," ");
+    args->roomSlots = (int*)malloc(sizeof(int)*2*args->roomCount);
+    args->properRoom = (uint64_t*)calloc(BITSET_WORDS(numberOfItems),sizeof(uint64_t));
+    if(!args->roomSlots || !args->properRoom) ERR("malloc");
+    return FillRoomIndex(args);
+}
+
+// Checks that player state of args is in range and every item lies in a room and has a room as destination,
+// except the item held, which has no location.
+bool ValidGame(gameArgs_t* args) {
+    int i, n = args->roomCount, numberOfItems = 3*n/2;
+    if(args->currentRoom < 0 || args->currentRoom >= n || args->itemHeld < -1 || args->itemHeld >= numberOfItems) return false;
     for(i=0;i<numberOfItems;i++) {
-        dprintf(out,"%d",args->properRoom[i]);
+        if(args->items[i] < -1 || args->items[i] >= n || (args->items[i] == -1) != (i == args->itemHeld)) return false;
+        if(args->itemDest[i] < 0 || args->itemDest[i] >= n) return false;
     }
-    dprintf(out," ");
-    dprintf(out, "%d ",args->movesCount);
-    dprintf(out,"%d ",args->roomCount);
-    dprintf(out,"%d ",args->itemHeld);
-    dprintf(out,"%d ",args->currentRoom);
-    for(i=0;i<numberOfItems;i++) {
-        dprintf(out,"%d ",args->items[i]);
+    return true;
+}
+
+// Checks that item counts, per-room item slots and bitset of properly placed items of a valid game taken from
+// a save agree with location of items, and counts misplaced items.
+bool ValidRoomIndex(gameArgs_t* args) {
+    int i, k, placed = 0, n = args->roomCount, numberOfItems = 3*n/2;
+    for(i=0;i<n;i++) {
+        int count = args->itemsInRoom[i], *slots = &args->roomSlots[2*i];
+        if(count < 0 || count > 2 || (count == 2 && slots[0] == slots[1])) return false;
+        for(k=0;k<2;k++) {
+            if(k >= count ? slots[k] != -1 : slots[k] < 0 || slots[k] >= numberOfItems || args->items[slots[k]] != i) return false;
+        }
+        placed += count;
     }
+    if(placed != numberOfItems-(args->itemHeld != -1)) return false; // Every item in a room is in one of its slots.
+    args->misplacedCount = numberOfItems;
     for(i=0;i<numberOfItems;i++) {
-        dprintf(out,"%d ",args->itemDest[i]);
+        bool proper = args->items[i] == args->itemDest[i];
+        if(TestBit(args->properRoom,i) != proper) return false;
+        args->misplacedCount -= proper;
     }
-    for(i=0;i<args->roomCount;i++) {
-        dprintf(out,"%d ",args->itemsInRoom[i]);
+    return !(args->properRoom[BITSET_WORDS(numberOfItems)-1] & ~TailMask(numberOfItems));
+}
+
+// Rounds size up to a multiple of 8, so every section of a save file starts aligned.
+#define ALIGN8(size) (((size)+7) & ~(uint64_t)7)
+
+// Results of mapping a map or save file.
+enum loadResult {
+    LOAD_OK, // File is in binary format and its header is valid.
+    LOAD_LEGACY, // File does not start with SAVE_MAGIC, so it may be in the old text format.
+    LOAD_BAD // File is in binary format, but it is damaged or has unknown version.
+};
+
+// Writes count bytes from buf to fd, repeating write until everything is written. Returns false if write fails.
+bool TryWriteAll(int fd, const void* buf, size_t count) {
+    const char* pos = buf;
+    while(count > 0) {
+        ssize_t written = write(fd,pos,count);
+        if(written < 0 && errno == EINTR) continue;
+        if(written < 0) return false;
+        pos += written;
+        count -= written;
     }
+    return true;
+}
+
+// Writes count bytes from buf to fd with TryWriteAll, ending the program if it fails.
+void WriteAll(int fd, const void* buf, size_t count) {
+    if(!TryWriteAll(fd,buf,count)) ERR("write");
+}
+
+// Makes room for count more bytes in out.
+void OutReserve(outBuffer_t* out, size_t count) {
+    if(out->len+count <= out->cap) return;
+    while(out->len+count > out->cap) out->cap = out->cap ? 2*out->cap : 65536;
+    if(!(out->data = (char*)realloc(out->data,out->cap))) ERR("realloc");
 }
 
-// Reads numbers from char array pointed to by buf at bufPosition.
-int ReadValue(int* bufPosition, char* buf) {
-    (*bufPosition)++;
-    int movesCount;
-    if(buf[(*bufPosition)+1] != ' ') { // If a number is 2-digit or -1
-        if(buf[*bufPosition] == '-') movesCount = -1;
-        else movesCount = 10*buf[*bufPosition]+buf[(*bufPosition)+1];
-        (*bufPosition)+=2;
+// Adds formatted text to out.
+void OutPrintf(outBuffer_t* out, const char* format, ...) {
+    va_list ap;
+    OutReserve(out,256);
+    va_start(ap,format);
+    int len = vsnprintf(out->data+out->len,out->cap-out->len,format,ap);
+    va_end(ap);
+    if(len < 0) ERR("vsnprintf");
+    if((size_t)len >= out->cap-out->len) { // Did not fit.
+        OutReserve(out,len+1);
+        va_start(ap,format);
+        vsnprintf(out->data+out->len,out->cap-out->len,format,ap);
+        va_end(ap);
     }
-    else { // If a number is 1-digit
-        movesCount = buf[*bufPosition];
-        (*bufPosition)++;
+    out->len += len;
+}
+
+// Adds text to out.
+void OutText(outBuffer_t* out, const char* text) {
+    size_t len = strlen(text);
+    OutReserve(out,len);
+    memcpy(out->data+out->len,text,len);
+    out->len += len;
+}
+
+// Writes decimal value followed by separator at pos, which must have room for 12 bytes. Returns end of the text.
+char* FormatInt(char* pos, int value, char separator) {
+    static const char pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    unsigned int magnitude = value < 0 ? -(unsigned int)value : (unsigned int)value, rest;
+    if(value < 0) *pos++ = '-';
+    for(rest=magnitude;rest >= 10;rest /= 10) pos++; // Digits are written from the last one.
+    char* end = pos+1;
+    while(magnitude >= 100) { // Two digits per division.
+        pos -= 2;
+        memcpy(pos+1,pairs+2*(magnitude%100),2);
+        magnitude /= 100;
     }
-    return movesCount;
+    if(magnitude >= 10) memcpy(pos-1,pairs+2*magnitude,2);
+    else *pos = '0'+magnitude;
+    *end = separator;
+    return end+1;
 }
 
-// Loads game data from file pointed to by path.
-void LoadGame(gameArgs_t* args, char* path) {
-    int in,i,j;
-    int bufPosition = 0;
-    if((in=open(path,O_RDONLY))<0)ERR("open");
-    char buf[MAX_PATH] = "";
-    read(in,buf,MAX_PATH);
-    if(close(in)) ERR("close");
-    for(i=0;i<MAX_PATH;i++) {
-        if(buf[i] == ' ') break;
-        bufPosition++;
+// Adds decimal value followed by separator to out.
+void OutInt(outBuffer_t* out, int value, char separator) {
+    OutReserve(out,12);
+    out->len = FormatInt(out->data+out->len,value,separator)-out->data;
+}
+
+// Writes text of out to its descriptor.
+void OutFlush(outBuffer_t* out) {
+    if(out->fd == STDOUT_FILENO) fflush(stdout); // Text printed by the main menu comes first.
+    WriteAll(out->fd,out->data,out->len);
+    out->len = 0;
+}
+
+// Frees memory of out.
+void OutFree(outBuffer_t* out) {
+    free(out->data);
+    free(out->proper);
+    free(out->properWords);
+    free(out->properEnds);
+}
+
+// Returns time of the monotonic clock in nanoseconds.
+uint64_t MonotonicNs() {
+    struct timespec now;
+    if(clock_gettime(CLOCK_MONOTONIC,&now)) ERR("clock_gettime");
+    return (uint64_t)now.tv_sec*1000000000u+now.tv_nsec;
+}
+
+// Returns bucket of value in a histogram.
+int HistogramBucket(uint64_t value) {
+    if(value < HISTOGRAM_SUB) return value;
+    int exponent = 63-__builtin_clzll(value); // At least HISTOGRAM_SUB_BITS.
+    return (exponent-HISTOGRAM_SUB_BITS+1)*HISTOGRAM_SUB+(int)(value >> (exponent-HISTOGRAM_SUB_BITS))-HISTOGRAM_SUB;
+}
+
+// Returns largest value that falls into bucket of a histogram.
+uint64_t HistogramValue(int bucket) {
+    if(bucket < HISTOGRAM_SUB) return bucket;
+    int shift = bucket/HISTOGRAM_SUB-1;
+    uint64_t low = (uint64_t)(bucket%HISTOGRAM_SUB+HISTOGRAM_SUB) << shift;
+    return low+(((uint64_t)1 << shift)-1);
+}
+
+// Adds value to histogram, from any thread.
+void HistogramAdd(histogram_t* histogram, uint64_t value) {
+    __atomic_fetch_add(&histogram->buckets[HistogramBucket(value)],1,__ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count,1,__ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum,value,__ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max,__ATOMIC_RELAXED);
+    while(value > max && !__atomic_compare_exchange_n(&histogram->max,&max,value,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+// Adds histogram to out as a JSON object with number of values, mean, percentiles and maximum. Values added
+// meanwhile by other threads may be counted in some fields and not in others.
+void OutHistogram(outBuffer_t* out, histogram_t* histogram) {
+    const double ps[] = {50,90,99,99.9};
+    uint64_t count = __atomic_load_n(&histogram->count,__ATOMIC_RELAXED), max = __atomic_load_n(&histogram->max,__ATOMIC_RELAXED);
+    uint64_t seen = 0;
+    int i, bucket = 0;
+    OutPrintf(out,"{\"count\":%llu,\"mean\":%.0f",(unsigned long long)count,count ? (double)__atomic_load_n(&histogram->sum,__ATOMIC_RELAXED)/count : 0.0);
+    for(i=0;i<(int)(sizeof(ps)/sizeof(ps[0]));i++) {
+        uint64_t rank = (uint64_t)ceil(ps[i]/100*count);
+        while(bucket < HISTOGRAM_BUCKETS && seen+__atomic_load_n(&histogram->buckets[bucket],__ATOMIC_RELAXED) < rank) {
+            seen += __atomic_load_n(&histogram->buckets[bucket++],__ATOMIC_RELAXED);
+        }
+        uint64_t value = bucket < HISTOGRAM_BUCKETS && count ? HistogramValue(bucket) : max;
+        OutPrintf(out,",\"p%g\":%llu",ps[i],(unsigned long long)(value < max ? value : max));
     }
-    args->saveCount = 0;
-    args->roomCount = sqrt(bufPosition);
-    int numberOfItems = 3*args->roomCount/2;
-    args->graph = (bool**)malloc(sizeof(bool*)*args->roomCount);
-    args->properRoom = (bool*)malloc(sizeof(bool)*numberOfItems);
-    args->items = (int*) malloc(sizeof(int)*numberOfItems);
-    args->itemsInRoom = (int*) malloc(sizeof(int)*args->roomCount);
-    args->itemDest = (int*) malloc(sizeof(int)*numberOfItems);
-    if(!args->graph || !args->properRoom || !args->items || !args->itemsInRoom || !args->itemDest) ERR("malloc");
-    for(i=0;i<args->roomCount;i++) {
-        args->graph[i] = (bool*) malloc(sizeof(bool));
-        if(!args->graph[i]) ERR("malloc");
-        for(j=0;j<args->roomCount;j++) {
-            if(buf[i*args->roomCount+j] == '0') args->graph[i][j] = false;
-            else args->graph[i][j] = true;
+    OutPrintf(out,",\"max\":%llu}",(unsigned long long)max);
+}
+
+// Prepares in for reading commands from file.
+void InitReader(lineReader_t* in, FILE* file) {
+    memset(in,0,sizeof(*in));
+    in->file = file;
+    in->fd = fileno(file);
+    if(!(in->buf = (char*)malloc(INPUT_BLOCK))) ERR("malloc");
+}
+
+// Returns next line of input without its newline, valid until the next call, or NULL at end; flushes output before reading more.
+char* ReadLine(lineReader_t* in, outBuffer_t* out) {
+    while(1) {
+        char* line = in->buf+in->start;
+        char* newline = memchr(line,'\n',in->end-in->start);
+        if(newline || (in->eof && in->start < in->end) || in->end-in->start == INPUT_BLOCK-1) {
+            if(!newline) newline = in->buf+in->end; // Last line without newline or line longer than a block.
+            *newline = '\0';
+            in->start = newline-in->buf+(newline < in->buf+in->end);
+            if(out && out->len >= OUTPUT_BLOCK) OutFlush(out); // Replies to a long batch are sent while it runs.
+            return line;
         }
+        if(in->eof) return NULL;
+        memmove(in->buf,line,in->end-in->start);
+        in->end -= in->start;
+        in->start = 0;
+        if(out && out->len > 0) OutFlush(out);
+        else fflush(stdout);
+        ssize_t count = in->fd >= 0 ? read(in->fd,in->buf+in->end,INPUT_BLOCK-1-in->end) : (ssize_t)fread(in->buf+in->end,1,INPUT_BLOCK-1-in->end,in->file);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0) ERR("read");
+        if(count == 0) in->eof = true;
+        in->end += count;
     }
-    bufPosition++;
-    for(i=0;i<MAX_PATH;i++) {
-        if(buf[i] >= 48) buf[i]-=48;
+}
+
+// Checks if paths a and b name the same existing file.
+bool SameFile(const char* a, const char* b) {
+    struct stat stA,stB;
+    return stat(a,&stA) == 0 && stat(b,&stB) == 0 && stA.st_dev == stB.st_dev && stA.st_ino == stB.st_ino;
+}
+
+// Flushes the directory containing path, so a file renamed into it survives a crash. Returns false if it fails.
+bool SyncDirectory(const char* path) {
+    char dir[MAX_PATH+8];
+    strncpy(dir,path,sizeof(dir)-1);
+    dir[sizeof(dir)-1] = '\0';
+    int fd = open(dirname(dir),O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    if(close(fd)) ERR("close");
+    return ok;
+}
+
+// Writes header and sections given by data to path through a temporary file. Returns size of the file, or 0 with errno set.
+uint64_t WriteSaveFile(char* path, saveHeader_t* header, void* data[MAX_SECTIONS]) {
+    static const char padding[8] = "";
+    char tmpPath[MAX_PATH+8];
+    int out,i;
+    uint64_t offset = ALIGN8(sizeof(saveHeader_t));
+    memcpy(header->magic,SAVE_MAGIC,sizeof(header->magic));
+    header->version = SAVE_VERSION;
+    for(i=0;i<MAX_SECTIONS;i++) {
+        header->sections[i].offset = header->sections[i].size ? offset : 0;
+        offset += ALIGN8(header->sections[i].size);
     }
-    for(i=0;i<numberOfItems;i++) {
-        args->properRoom[i] = buf[bufPosition];
-        bufPosition++;
-    }
-    args->movesCount = ReadValue(&bufPosition,buf);
-    args->roomCount = ReadValue(&bufPosition,buf);
-    args->itemHeld = ReadValue(&bufPosition,buf);
-    args->currentRoom = ReadValue(&bufPosition,buf);
-    for(i=0;i<numberOfItems;i++) args->items[i] = ReadValue(&bufPosition,buf);
-    for(i=0;i<numberOfItems;i++) args->itemDest[i] = ReadValue(&bufPosition,buf);
-    for(i=0;i<args->roomCount;i++) args->itemsInRoom[i] = ReadValue(&bufPosition,buf);
-}
-
-// Function passed to threads executing FindPath.
-void* FindingPath(void* pVoid) {
-    findPathArgs_t* findArgs = pVoid;
-    int roomCount = findArgs->args->roomCount;
-    int currentRoom = findArgs->args->currentRoom;
-    findPathReturnArgs_t* returnArgs = (findPathReturnArgs_t*)malloc(sizeof(findPathReturnArgs_t)*roomCount);
-    if(!returnArgs) ERR("malloc");
-    returnArgs->path = (int*)malloc(sizeof(int)*roomCount);
-    if(!returnArgs->path) ERR("malloc");
-    returnArgs->path[0] = currentRoom;
-    returnArgs->len = 0;
-    int i,j;
-    for(i=1;i<roomCount;i++) returnArgs->path[i] = -1;
-    int maxSteps = 1000;
-    for(i=0;i<maxSteps;i++) {
-        if(returnArgs->path[returnArgs->len] == findArgs->x) break;
-        int num = rand()%roomCount;
-        if(findArgs->args->graph[currentRoom][num]) {
-            for(j=0;j<=returnArgs->len;j++) {
-                if(returnArgs->path[j] == num) break;
-                if(j == returnArgs->len) {
-                    returnArgs->len++;
-                    returnArgs->path[returnArgs->len] = num;
-                    currentRoom = num;
-                }
-            }
-        }
+    snprintf(tmpPath,sizeof(tmpPath),"%s.tmp",path);
+    if((out=open(tmpPath,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0777))<0) return 0;
+    bool ok = TryWriteAll(out,header,sizeof(saveHeader_t));
+    for(i=0;ok && i<MAX_SECTIONS;i++) {
+        uint64_t size = header->sections[i].size;
+        if(size == 0) continue;
+        ok = TryWriteAll(out,data[i],size) && TryWriteAll(out,padding,ALIGN8(size)-size);
     }
-    returnArgs->ok = (returnArgs->path[returnArgs->len] == findArgs->x);
-    return returnArgs;
+    ok = ok && fdatasync(out) == 0;
+    if(close(out)) ok = false;
+    if(!ok || rename(tmpPath,path)) { // The old file stays whole and mapped until the new one is flushed.
+        int error = errno;
+        unlink(tmpPath);
+        errno = error;
+        return 0;
+    }
+    return SyncDirectory(path) ? offset : 0;
 }
 
-// Tries to find shortest path to room x using k threads (this solution is far from optimal, but it was required to do it that way)
-findPathReturnArgs_t* FindPath(gameArgs_t* args, int k, int x) {
-    pthread_t* pthreads = (pthread_t*)malloc(sizeof(pthread_t)*k);
-    if(!pthreads) ERR("malloc");
-    findPathArgs_t findPathArgs;
-    void* res;
-    findPathArgs.args = args;
-    findPathArgs.x = x;
-    findPathReturnArgs_t* returnArgs1 = (findPathReturnArgs_t*)malloc(sizeof(findPathReturnArgs_t));
-    if(!returnArgs1) ERR("malloc");
-    returnArgs1->path = (int*)malloc(sizeof(int)*(args->roomCount+1));
-    if(!returnArgs1->path) ERR("malloc");
-    int i;
-    int pathLength = args->roomCount+1;
-    for(i=0;i<k;i++) {
-        if(pthread_create(&pthreads[i],NULL,FindingPath,&findPathArgs)) ERR("pthread_create");
+// Maps map or save file at path writable into args->mapping, shared with the file if shared is set, and checks its header.
+int MapSaveFile(gameArgs_t* args, char* path, saveHeader_t** header, bool shared) {
+    int in,i;
+    struct stat st;
+    char magic[sizeof(SAVE_MAGIC)] = "";
+    // Any path a client of the server sends is only a bad file, not blocking it if it is a pipe.
+    if((in=open(path,(shared ? O_RDWR : O_RDONLY)|O_NONBLOCK|O_CLOEXEC))<0) return LOAD_BAD;
+    if(fstat(in,&st) || !S_ISREG(st.st_mode)) {
+        if(close(in)) ERR("close");
+        return LOAD_BAD;
     }
-    for(i=0;i<k;i++) {
-        if(pthread_join(pthreads[i],&res)) ERR("pthread_join");
-        findPathReturnArgs_t* returnArgs = res;
-        if(returnArgs->ok) {
-            if(returnArgs->len < pathLength) returnArgs1 = returnArgs;
-        }
+    if(pread(in,magic,sizeof(magic),0) != sizeof(magic) || memcmp(magic,SAVE_MAGIC,sizeof(magic)) != 0) {
+        if(close(in)) ERR("close");
+        return LOAD_LEGACY;
     }
-    free(pthreads);
-    return returnArgs1;
+    if(st.st_size < (off_t)sizeof(saveHeader_t)) {
+        if(close(in)) ERR("close");
+        return LOAD_BAD;
+    }
+    void* mapping = mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,shared ? MAP_SHARED : MAP_PRIVATE,in,0);
+    if(close(in)) ERR("close");
+    if(mapping == MAP_FAILED) return LOAD_BAD;
+    args->mapping = mapping;
+    args->mappingSize = st.st_size;
+    *header = mapping;
+    if((*header)->version != SAVE_VERSION || (*header)->roomCount < 0 || (*header)->itemCount < 0) return LOAD_BAD;
+    for(i=0;i<MAX_SECTIONS;i++) {
+        saveSection_t* section = &(*header)->sections[i];
+        if(section->offset % 8 != 0 || section->offset > args->mappingSize
+           || section->size > args->mappingSize - section->offset) return LOAD_BAD;
+    }
+    return LOAD_OK;
 }
 
-// Frees dynamically allocated memory.
-void FreeMemory(gameArgs_t *args) {
-    int i;
-    for(i=0;i<args->roomCount;i++) free(args->graph[i]);
-    free(args->graph);
-    free(args->items);
-    free(args->itemDest);
-    free(args->properRoom);
-    free(args->itemsInRoom);
-    pthread_mutex_unlock(args->mutex);
+// Returns pointer to section id of the mapped file or NULL if the section does not have expected size.
+void* SectionData(gameArgs_t* args, saveHeader_t* header, int id, uint64_t size) {
+    if(header->sections[id].size != size) return NULL;
+    return (char*)args->mapping + header->sections[id].offset;
 }
 
-// Main game function.
-void Play(gameArgs_t* args) {
-    char text[MAX_PATH] = "", *cmd, *arg1, *arg2;
-    PrintAvailableRooms(args);
-    PrintItemsInRoom(args);
-    while(1) {
-        fgets(text,MAX_PATH,stdin);
-        cmd = strtok(text," ");
-        if(cmd[strlen(cmd)-1] == '\n') cmd[strlen(cmd)-1] = '\0'; // fgets leaves \n, we need to deal with it
-        arg1 = strtok(NULL," ");
-        if(arg1 && arg1[strlen(arg1)-1] == '\n') arg1[strlen(arg1)-1] = '\0';
-        arg2 = strtok(NULL, " ");
-        if(arg2 && arg2[strlen(arg2)-1] == '\n') arg2[strlen(arg2)-1] = '\0';
-        pthread_mutex_lock(args->mutex);
-        if(strcmp(cmd,"quit") == 0) { // quit
-            FreeMemory(args);
-            return;
+// Frees memory pointed to by ptr, unless it lies inside the mapped file or the arena of args.
+void FreeUnlessBorrowed(gameArgs_t* args, void* ptr) {
+    char *mapping = args->mapping, *arena = args->arena;
+    if(mapping && (char*)ptr >= mapping && (char*)ptr < mapping+args->mappingSize) return;
+    if(arena && (char*)ptr >= arena && (char*)ptr < arena+args->arenaSize) return;
+    free(ptr);
+}
+
+// Points item arrays of args into its arena, grown only if too small. Returns scratch array of 2*roomCount ints after them.
+int* ArenaItemArrays(gameArgs_t* args) {
+    int n = args->roomCount, numberOfItems = 3*n/2;
+    size_t words = BITSET_WORDS(numberOfItems), size = sizeof(uint64_t)*words+sizeof(int)*(2*(size_t)numberOfItems+5*(size_t)n);
+    if(size > args->arenaSize) {
+        free(args->arena);
+        args->arena = malloc(size);
+        if(!args->arena) ERR("malloc");
+        args->arenaSize = size;
+    }
+    args->properRoom = args->arena; // Words of the bitset come first, so all arrays stay aligned.
+    args->items = (int*)(args->properRoom+words);
+    args->itemDest = args->items+numberOfItems;
+    args->itemsInRoom = args->itemDest+numberOfItems;
+    args->roomSlots = args->itemsInRoom+n;
+    return args->roomSlots+2*n;
+}
+
+// Returns the number of misplaced items lying in room.
+int MisplacedIn(gameArgs_t* args, int room) {
+    int i, count = 0;
+    for(i=0;i<args->itemsInRoom[room];i++) count += args->itemDest[args->roomSlots[2*room+i]] != room;
+    return count;
+}
+
+// Finds distances of field from scratch with breadth-first search from sources, which are the first count rooms
+// in the queue of hints.
+void BuildField(gameArgs_t* args, distanceField_t* field, int count) {
+    graph_t* graph = &args->graph;
+    int i, head = 0, tail = count, *queue = args->hints->queue;
+    for(i=0;i<args->roomCount;i++) {
+        field->dist[i] = INT_MAX;
+        field->source[i] = -1;
+    }
+    for(i=0;i<count;i++) {
+        field->dist[queue[i]] = 0;
+        field->source[queue[i]] = queue[i];
+    }
+    while(head < tail) {
+        int v = queue[head++];
+        for(long j=graph->offsets[v];j<graph->offsets[v+1];j++) {
+            int u = graph->neighbors[j];
+            if(field->dist[u] != INT_MAX) continue;
+            field->dist[u] = field->dist[v]+1;
+            field->source[u] = field->source[v];
+            queue[tail++] = u;
         }
-        if(strcmp(cmd,"move-to") == 0 && arg1) { // move-to
-            int tmp = atoi(arg1);
-            if(args->graph[args->currentRoom][tmp]) args->currentRoom = tmp;
-            else printf("Bad room number\n");
+    }
+}
+
+// Adds room to sources of field. Distances only get shorter, so search from room visits only rooms that end up
+// nearer to it than to any other source.
+void AddSource(gameArgs_t* args, distanceField_t* field, int room) {
+    graph_t* graph = &args->graph;
+    int head = 0, tail = 0, *queue = args->hints->queue;
+    field->dist[room] = 0;
+    field->source[room] = room;
+    queue[tail++] = room;
+    while(head < tail) {
+        int v = queue[head++];
+        for(long j=graph->offsets[v];j<graph->offsets[v+1];j++) {
+            int u = graph->neighbors[j];
+            if(field->dist[u] <= field->dist[v]+1) continue;
+            field->dist[u] = field->dist[v]+1;
+            field->source[u] = room;
+            queue[tail++] = u;
         }
-        else if(strcmp(cmd,"pick-up") == 0 && arg1) { // pick-up
-            int tmp = atoi(arg1);
-            if(args->itemHeld == -1 && args->items[tmp] == args->currentRoom) {
-                args->itemHeld = tmp;
-                args->items[args->itemHeld] = -1;
-                args->itemsInRoom[args->currentRoom]--;
-            }
+    }
+}
+
+int CompareSeeds(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y)-(x < y);
+}
+
+// Removes room from sources of field, recomputing distances only of the rooms that were labeled with it.
+void RemoveSource(gameArgs_t* args, distanceField_t* field, int room) {
+    graph_t* graph = &args->graph;
+    hints_t* hints = args->hints;
+    int i, count = 0, head = 0, tail = 0, seedCount = 0, next = 0;
+    hints->region[count++] = room;
+    field->source[room] = -2; // Marks rooms of the region until they get distances again.
+    for(i=0;i<count;i++) {
+        int v = hints->region[i];
+        for(long j=graph->offsets[v];j<graph->offsets[v+1];j++) {
+            int u = graph->neighbors[j];
+            if(field->source[u] != room) continue;
+            field->source[u] = -2;
+            hints->region[count++] = u;
         }
-        else if(strcmp(cmd,"drop") == 0 && arg1) { // drop
-            int tmp = atoi(arg1);
-            if(tmp == args->itemHeld && args->itemHeld != -1 && args->itemsInRoom[args->currentRoom] <= 1) {
-                args->items[tmp] = args->currentRoom;
-                args->itemsInRoom[args->currentRoom]++;
-                args->itemHeld = -1;
-                if(args->items[tmp] == args->itemDest[tmp]) args->properRoom[tmp] = true;
-                else args->properRoom[tmp] = false;
-                if(CheckIfFinished(args)) {
-                    printf("Finished game with %d moves\n",args->movesCount);
-                    FreeMemory(args);
-                    return;
-                }
-            }
+    }
+    for(i=0;i<count;i++) field->dist[hints->region[i]] = INT_MAX;
+    for(i=0;i<count;i++) { // Distances through rooms outside of the region.
+        int v = hints->region[i];
+        for(long j=graph->offsets[v];j<graph->offsets[v+1];j++) {
+            int u = graph->neighbors[j];
+            if(field->source[u] < 0 || field->dist[u]+1 >= field->dist[v]) continue;
+            field->dist[v] = field->dist[u]+1;
+            field->source[v] = field->source[u];
         }
-        else if(strcmp(cmd,"save") == 0 && arg1) { // save
-            SaveGame(args,arg1);
-            args->saveCount++;
+        if(field->dist[v] != INT_MAX) hints->seeds[seedCount++] = (uint64_t)field->dist[v] << 32 | v;
+    }
+    qsort(hints->seeds,seedCount,sizeof(uint64_t),CompareSeeds);
+    while(next < seedCount || head < tail) {
+        int v;
+        if(head == tail || (next < seedCount && (int)(hints->seeds[next] >> 32) <= field->dist[hints->queue[head]])) {
+            v = (int)(hints->seeds[next] & 0xffffffff);
+            if(field->dist[v] < (int)(hints->seeds[next++] >> 32)) continue; // Got shorter through the queue, done there.
         }
-        else if(strcmp(cmd,"find-path") == 0 && arg1 && arg2) { // find-path
-            int k = atoi(arg1);
-            int x = atoi(arg2);
-            int i;
-            findPathReturnArgs_t* returnArgs = FindPath(args,k,x);
-            if(!returnArgs->ok) printf("Couldn't find path\n");
-            else {
-                for(i=0;i<=returnArgs->len;i++) printf("%d ",returnArgs->path[i]);
-            }
-            free(returnArgs);
-            printf("\n");
+        else v = hints->queue[head++];
+        for(long j=graph->offsets[v];j<graph->offsets[v+1];j++) {
+            int u = graph->neighbors[j];
+            if(field->dist[u] <= field->dist[v]+1) continue;
+            field->dist[u] = field->dist[v]+1;
+            field->source[u] = field->source[v];
+            hints->queue[tail++] = u;
         }
-        args->movesCount++; // every command adds to the score, even if it's invalid
-        pthread_mutex_unlock(args->mutex);
-        PrintAvailableRooms(args);
-        PrintItemsInRoom(args);
+    }
+    for(i=0;i<count;i++) {
+        if(field->source[hints->region[i]] == -2) field->source[hints->region[i]] = -1; // No source left to reach.
     }
 }
 
-// Suspends thread for a given time in milliseconds.
-void msleep(unsigned int milisec) {
-    time_t sec= (int)(milisec/1000);
-    milisec = milisec - (sec*1000);
-    struct timespec req= {0};
-    req.tv_sec = sec;
-    req.tv_nsec = milisec * 1000000L;
-    if(nanosleep(&req,&req)) ERR("nanosleep");
+// Updates distance fields of hint, if they are built, after items of room changed.
+void UpdateHints(gameArgs_t* args, int room) {
+    hints_t* hints = args->hints;
+    if(!hints) return;
+    bool misplaced = MisplacedIn(args,room) > 0, free = args->itemsInRoom[room] < 2;
+    if(misplaced != (hints->misplaced.source[room] == room)) {
+        if(misplaced) AddSource(args,&hints->misplaced,room);
+        else RemoveSource(args,&hints->misplaced,room);
+    }
+    if(free != (hints->free.source[room] == room)) {
+        if(free) AddSource(args,&hints->free,room);
+        else RemoveSource(args,&hints->free,room);
+    }
 }
 
-// Function passed to autosave thread, saves game data after a minute passed from last save.
-void* autosaveWork(void* args) {
-    gameArgs_t* args1 = args;
-    struct timespec start,current;
-    int currSaveCount = args1->saveCount;
-    if (clock_gettime(CLOCK_REALTIME, &start)) ERR("clock_gettime");
-    while(1) {
-        do {
-            msleep(1000);
-            if(currSaveCount != args1->saveCount) {
-                if (clock_gettime(CLOCK_REALTIME, &start)) ERR("clock_gettime");
-                currSaveCount = args1->saveCount;
-            }
-            else if (clock_gettime(CLOCK_REALTIME, &current)) ERR("clock_gettime");
-        } while (ELAPSED(start,current) < 60.0);
-        pthread_mutex_lock(args1->mutex);
-        printf("\nAutosaving to %s\n",args1->autosavePath);
-        SaveGame(args1,args1->autosavePath);
-        pthread_mutex_unlock(args1->mutex);
-        if (clock_gettime(CLOCK_REALTIME, &start)) ERR("clock_gettime");
+// Allocates distance fields of hint for the game in args and finds them from scratch.
+void BuildHints(gameArgs_t* args) {
+    int i, count, n = args->roomCount;
+    hints_t* hints = (hints_t*)malloc(sizeof(hints_t));
+    if(!hints) ERR("malloc");
+    distanceField_t* fields[3] = {&hints->misplaced,&hints->free,&hints->dest};
+    for(i=0;i<3;i++) {
+        fields[i]->dist = (int*)malloc(sizeof(int)*n);
+        fields[i]->source = (int*)malloc(sizeof(int)*n);
+        if(!fields[i]->dist || !fields[i]->source) ERR("malloc");
+    }
+    hints->queue = (int*)malloc(sizeof(int)*n);
+    hints->region = (int*)malloc(sizeof(int)*n);
+    hints->seeds = (uint64_t*)malloc(sizeof(uint64_t)*n);
+    if(!hints->queue || !hints->region || !hints->seeds) ERR("malloc");
+    hints->destRoom = -1;
+    args->hints = hints;
+    for(i=0,count=0;i<n;i++) {
+        if(MisplacedIn(args,i) > 0) hints->queue[count++] = i;
     }
+    BuildField(args,&hints->misplaced,count);
+    for(i=0,count=0;i<n;i++) {
+        if(args->itemsInRoom[i] < 2) hints->queue[count++] = i;
+    }
+    BuildField(args,&hints->free,count);
 }
 
-// Argument of nftw called from MapFromDirTree.
-int walk(const char *name, const struct stat *s, int type, struct FTW *f) {
-    if(type == FTW_D) {
-        nftwArgs.level[nftwArgs.len] = f->level;
-        nftwArgs.len++;
-    }
-    return 0;
+// Frees distance fields of hint of args, if any.
+void FreeHints(gameArgs_t* args) {
+    hints_t* hints = args->hints;
+    if(!hints) return;
+    free(hints->misplaced.dist);
+    free(hints->misplaced.source);
+    free(hints->free.dist);
+    free(hints->free.source);
+    free(hints->dest.dist);
+    free(hints->dest.source);
+    free(hints->queue);
+    free(hints->region);
+    free(hints->seeds);
+    free(hints);
+    args->hints = NULL;
 }
 
-// Creates map from directory tree represented by NnftwArgs.
-bool** MapFromDirTree(nftwArgs_t* NnftwArgs) {
-    int i,j;
-    bool** graph = (bool**)malloc(sizeof(bool*) * NnftwArgs->len);
-    if(!graph) ERR("malloc");
-    for(i=0;i<NnftwArgs->len;i++) {
-        graph[i] = (bool*)malloc(sizeof(bool)*NnftwArgs->len);
-        if(!graph[i]) ERR("malloc");
-    }
-    for(i=0;i<NnftwArgs->len;i++) {
-        for(j=0;j<NnftwArgs->len;j++) graph[i][j] = false;
-    }
-    int LastOfLevel[MAX_FD];
-    LastOfLevel[0] = 0;
-    int currLevel = 0;
-    for(i=1;i<NnftwArgs->len;i++) {
-        if(NnftwArgs->level[i] != currLevel) currLevel = NnftwArgs->level[i];
-        LastOfLevel[currLevel] = i;
-        graph[LastOfLevel[currLevel-1]][i] = true;
-        graph[i][LastOfLevel[currLevel-1]] = true;
+// Adds hint for the player of game in args to out: nearest misplaced item, nearest empty slot and distance to held item's room.
+void PrintHint(gameArgs_t* args, outBuffer_t* out) {
+    if(!args->hints) BuildHints(args);
+    hints_t* hints = args->hints;
+    int i, v = args->currentRoom, room = hints->misplaced.source[v];
+    if(room < 0) OutText(out,"No misplaced item can be reached");
+    else {
+        for(i=0;args->itemDest[args->roomSlots[2*room+i]] == room;i++);
+        OutPrintf(out,"Nearest misplaced item is %d in room %d, %d moves away",args->roomSlots[2*room+i],room,hints->misplaced.dist[v]);
     }
-    return graph;
+    room = hints->free.source[v];
+    if(room < 0) OutText(out,". No room with an empty slot can be reached");
+    else OutPrintf(out,". Nearest room with an empty slot is %d, %d moves away",room,hints->free.dist[v]);
+    if(args->itemHeld != -1) {
+        int dest = args->itemDest[args->itemHeld];
+        if(hints->destRoom != dest) { // The map does not change, so the field stays right for later items with the same room.
+            hints->queue[0] = dest;
+            BuildField(args,&hints->dest,1);
+            hints->destRoom = dest;
+        }
+        if(hints->dest.dist[v] == INT_MAX) OutPrintf(out,". Room %d of held item cannot be reached",dest);
+        else OutPrintf(out,". Room %d of held item is %d moves away",dest,hints->dest.dist[v]);
+    }
+    OutText(out,"\n");
 }
 
-// Function passed to thread waiting for SIGUSR1, after receiving SIGUSR1 swaps rooms between two items.
-void* signalHandling(void* pVoid) {
+// Frees map and item arrays of args, whether they were allocated or point into the mapped file.
+void ReleaseGame(gameArgs_t* args) {
+    FreeUnlessBorrowed(args,args->graph.offsets);
+    FreeUnlessBorrowed(args,args->graph.neighbors);
+    FreeUnlessBorrowed(args,args->items);
+    FreeUnlessBorrowed(args,args->itemDest);
+    FreeUnlessBorrowed(args,args->properRoom);
+    FreeUnlessBorrowed(args,args->itemsInRoom);
+    FreeUnlessBorrowed(args,args->roomSlots);
+    if(args->mapping && munmap(args->mapping,args->mappingSize)) ERR("munmap");
+    args->mapping = NULL;
+    args->live = NULL;
+    FreeHints(args);
+}
+
+// Prepares args for reading a map or save file, so that ReleaseGame is safe whatever gets loaded.
+void ClearGame(gameArgs_t* args) {
+    args->graph.offsets = NULL;
+    args->graph.neighbors = NULL;
+    args->items = NULL;
+    args->itemDest = NULL;
+    args->properRoom = NULL;
+    args->itemsInRoom = NULL;
+    args->roomSlots = NULL;
+    args->mapping = NULL;
+    args->live = NULL;
+    args->routing.index = NULL;
+    args->hints = NULL;
+}
+
+// Points graph of args into sections of the mapped file. Returns false if the sections are inconsistent.
+// Dense maps stored as adjacency rows get neighbor lists built in memory.
+bool GraphFromSave(gameArgs_t* args, saveHeader_t* header) {
+    int n = header->roomCount;
+    if(header->sections[SECTION_ADJACENCY].size) {
+        bitGraph_t bits = {n,BITSET_WORDS(n),NULL};
+        bits.rows = SectionData(args,header,SECTION_ADJACENCY,sizeof(uint64_t)*n*bits.words);
+        if(!bits.rows || !ValidBits(&bits)) return false;
+        args->roomCount = n;
+        args->graph = GraphFromBits(&bits);
+        return true;
+    }
+    long* offsets = SectionData(args,header,SECTION_OFFSETS,sizeof(long)*(n+1));
+    if(!offsets || offsets[0] != 0 || offsets[n] < 0) return false;
+    int* neighbors = SectionData(args,header,SECTION_NEIGHBORS,sizeof(int)*offsets[n]);
+    graph_t graph = {offsets,neighbors};
+    if(!neighbors || !ValidGraph(&graph,n)) return false;
+    args->roomCount = n;
+    args->graph = graph;
+    return true;
+}
+
+// Reads whole file pointed to by path into a NUL-terminated buffer and stores its length in len.
+// Returns NULL if the file cannot be read.
+char* ReadWholeFile(char* path, long* len) {
+    int in;
+    struct stat st;
+    if((in=open(path,O_RDONLY|O_NONBLOCK|O_CLOEXEC))<0) return NULL;
+    if(fstat(in,&st) || !S_ISREG(st.st_mode)) {
+        if(close(in)) ERR("close");
+        return NULL;
+    }
+    char* buf = (char*)malloc(st.st_size+1);
+    if(!buf) ERR("malloc");
+    *len = 0;
+    while(*len < st.st_size) {
+        ssize_t count = read(in,buf+*len,st.st_size-*len);
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) break; // Read error or file truncated meanwhile, the rest is not parsed.
+        *len += count;
+    }
+    buf[*len] = '\0';
+    if(close(in)) ERR("close");
+    return buf;
+}
+
+// Parses count whitespace separated numbers at *pos into values. Returns false if there are fewer numbers.
+bool ParseInts(char** pos, int* values, int count) {
+    int i;
+    for(i=0;i<count;i++) {
+        char* end;
+        values[i] = (int)strtol(*pos,&end,10);
+        if(end == *pos) return false;
+        *pos = end;
+    }
+    return true;
+}
+
+// Reads map and, if withItems is set, game of a file in the old text format. Returns 1 with game, 0 with map only, -1 if malformed.
+int ReadLegacyFile(gameArgs_t* args, char* path, bool withItems) {
+    long len, matrixLen = 0;
+    int i, header[4];
+    char* buf = ReadWholeFile(path,&len);
+    ClearGame(args);
+    if(!buf) return -1;
+    while(matrixLen < len && (buf[matrixLen] == '0' || buf[matrixLen] == '1')) matrixLen++;
+    int n = (int)sqrt(matrixLen);
+    if((long)n*n != matrixLen || n == 0) { // Also files in binary format, starting with SAVE_MAGIC.
+        free(buf);
+        return -1;
+    }
+    args->roomCount = n;
+    args->graph = GraphFromMatrix(buf,n);
+    if(!withItems || buf[matrixLen] != ' ') {
+        free(buf);
+        return 0;
+    }
+    int numberOfItems = 3*n/2;
+    args->items = (int*)malloc(sizeof(int)*numberOfItems);
+    args->itemDest = (int*)malloc(sizeof(int)*numberOfItems);
+    args->itemsInRoom = (int*)malloc(sizeof(int)*n);
+    if(!args->items || !args->itemDest || !args->itemsInRoom) ERR("malloc");
+    char* pos = buf+matrixLen+1;
+    bool ok = len-(matrixLen+1) >= numberOfItems;
+    for(i=0;ok && i<numberOfItems;i++) ok = pos[i] == '0' || pos[i] == '1'; // Placement is found again from item locations.
+    pos += numberOfItems;
+    ok = ok && ParseInts(&pos,header,4) && header[1] == n
+         && ParseInts(&pos,args->items,numberOfItems)
+         && ParseInts(&pos,args->itemDest,numberOfItems)
+         && ParseInts(&pos,args->itemsInRoom,n);
+    free(buf);
+    if(ok) {
+        args->movesCount = header[0];
+        args->itemHeld = header[2];
+        args->currentRoom = header[3];
+        args->saveCount = 0;
+        ok = ValidGame(args) && RebuildRoomIndex(args);
+    }
+    if(!ok) {
+        ReleaseGame(args);
+        return -1;
+    }
+    return 1;
+}
+
+// Saves map stored as adjacency rows to a file. Returns false if the file cannot be written.
+bool SaveBits(bitGraph_t* bits, char* path) {
+    saveHeader_t header;
+    void* data[MAX_SECTIONS];
+    memset(&header,0,sizeof(header));
+    header.roomCount = bits->roomCount;
+    header.movesCount = 0;
+    header.itemHeld = -1;
+    header.sections[SECTION_ADJACENCY].size = sizeof(uint64_t)*bits->roomCount*bits->words;
+    data[SECTION_ADJACENCY] = bits->rows;
+    return WriteSaveFile(path,&header,data) > 0;
+}
+
+// Saves graph with n vertices to a file, as adjacency rows if they are smaller. Returns false if it cannot be written.
+bool SaveGraph(graph_t* graph, int n, char* path) {
+    saveHeader_t header;
+    void* data[MAX_SECTIONS];
+    if(n > 0 && sizeof(uint64_t)*n*BITSET_WORDS(n) < sizeof(long)*(n+1)+sizeof(int)*graph->offsets[n]) {
+        bitGraph_t bits = BitsFromGraph(graph,n);
+        bool ok = SaveBits(&bits,path);
+        free(bits.rows);
+        return ok;
+    }
+    memset(&header,0,sizeof(header));
+    header.roomCount = n;
+    header.movesCount = 0;
+    header.itemHeld = -1;
+    header.sections[SECTION_OFFSETS].size = sizeof(long)*(n+1);
+    header.sections[SECTION_NEIGHBORS].size = sizeof(int)*graph->offsets[n];
+    data[SECTION_OFFSETS] = graph->offsets;
+    data[SECTION_NEIGHBORS] = graph->neighbors;
+    return WriteSaveFile(path,&header,data) > 0;
+}
+
+// Reads map from file into args structure. Returns false if the file is not a valid map.
+bool ReadGraph(gameArgs_t* args, char* path) {
+    saveHeader_t* header;
+    ClearGame(args);
+    int result = MapSaveFile(args,path,&header,false);
+    if(result == LOAD_LEGACY) return ReadLegacyFile(args,path,false) == 0;
+    if(result == LOAD_BAD || !GraphFromSave(args,header)) {
+        ReleaseGame(args);
+        return false;
+    }
+    return true;
+}
+
+// Reads map for analyze-map into bits if it is stored as adjacency rows, otherwise into args->graph. Returns false if it is not valid.
+bool ReadMapBits(gameArgs_t* args, char* path, bitGraph_t* bits) {
+    saveHeader_t* header;
+    ClearGame(args);
+    int result = MapSaveFile(args,path,&header,false);
+    bool ok;
+    bits->rows = NULL;
+    if(result == LOAD_LEGACY) ok = ReadLegacyFile(args,path,false) == 0;
+    else if(result == LOAD_OK && header->sections[SECTION_ADJACENCY].size) {
+        args->roomCount = bits->roomCount = header->roomCount;
+        bits->words = BITSET_WORDS(bits->roomCount);
+        bits->rows = SectionData(args,header,SECTION_ADJACENCY,sizeof(uint64_t)*bits->roomCount*bits->words);
+        ok = bits->rows && ValidBits(bits);
+    }
+    else ok = result == LOAD_OK && GraphFromSave(args,header);
+    if(!ok || args->roomCount < 1 || args->roomCount > ANALYZE_MAX_ROOMS) {
+        ReleaseGame(args);
+        return false;
+    }
+    return true;
+}
+
+// Updates bit of item in properRoom and count of misplaced items after the item was moved.
+void UpdatePlacement(gameArgs_t* args, int item) {
+    bool proper = args->items[item] == args->itemDest[item];
+    if(TestBit(args->properRoom,item) == proper) return;
+    AssignBit(args->properRoom,item,proper);
+    args->misplacedCount += proper ? -1 : 1;
+}
+
+// Puts item into a free slot of room.
+void PlaceItem(gameArgs_t* args, int item, int room) {
+    args->items[item] = room;
+    args->roomSlots[2*room+(args->roomSlots[2*room] != -1)] = item;
+    args->itemsInRoom[room]++;
+    UpdatePlacement(args,item);
+    UpdateHints(args,room);
+}
+
+// Takes item out of its room.
+void RemoveItem(gameArgs_t* args, int item) {
+    int room = args->items[item];
+    int* slots = &args->roomSlots[2*room];
+    if(slots[0] == item) {
+        slots[0] = slots[1];
+        slots[1] = -1;
+    }
+    else slots[1] = -1;
+    args->itemsInRoom[room]--;
+    args->items[item] = -1;
+    UpdatePlacement(args,item);
+    UpdateHints(args,room);
+}
+
+// Swaps rooms of items a and b, none of which may be held by the player.
+void SwapItems(gameArgs_t* args, int a, int b) {
+    int roomA = args->items[a], roomB = args->items[b];
+    hints_t* hints = args->hints;
+    args->hints = NULL; // Rooms end up as full as before, hints are updated once for the final state.
+    RemoveItem(args,a);
+    RemoveItem(args,b);
+    PlaceItem(args,a,roomB);
+    PlaceItem(args,b,roomA);
+    args->hints = hints;
+    UpdateHints(args,roomA);
+    UpdateHints(args,roomB);
+}
+
+// Marks start of a change of the game under its mutex, so that readers without the mutex retry.
+void BeginChange(gameArgs_t* args) {
+    __atomic_store_n(&args->version,args->version+1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // Version is odd before any change is visible.
+    if(!args->live) return;
+    __atomic_fetch_add(&args->live->liveWrites,1,__ATOMIC_SEQ_CST); // Live game file is marked as being changed.
+}
+
+// Marks end of a change of the game: copies player state to header of the live game file and makes version even.
+void EndChange(gameArgs_t* args) {
+    saveHeader_t* header = args->live;
+    if(header) {
+        header->movesCount = args->movesCount;
+        header->itemHeld = args->itemHeld;
+        header->currentRoom = args->currentRoom;
+        __atomic_fetch_add(&header->liveWrites,1,__ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&args->version,args->version+1,__ATOMIC_RELEASE);
+}
+
+// Locks mutex of the game, counting the lock and the time spent waiting if another thread holds it.
+void LockGame(gameArgs_t* args) {
+    __atomic_fetch_add(&metrics.locks,1,__ATOMIC_RELAXED);
+    if(pthread_mutex_trylock(args->mutex) == 0) return; // Free, as it is most of the time, the clock is not read.
+    uint64_t start = MonotonicNs();
+    pthread_mutex_lock(args->mutex);
+    __atomic_fetch_add(&metrics.lockWaits,1,__ATOMIC_RELAXED);
+    HistogramAdd(&metrics.lockWaitTimes,MonotonicNs()-start);
+}
+
+// Starts reading the game without its mutex and returns version to pass to ReadRetry. Waits while a change is in progress.
+unsigned long ReadBegin(gameArgs_t* args) {
+    unsigned long version;
+    while((version = __atomic_load_n(&args->version,__ATOMIC_ACQUIRE)) % 2 == 1) sched_yield();
+    return version;
+}
+
+// Returns true if the game changed since ReadBegin returned version, so what was read may be torn and must be read again.
+bool ReadRetry(gameArgs_t* args, unsigned long version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); // Reads of the game happen before version is checked again.
+    return __atomic_load_n(&args->version,__ATOMIC_RELAXED) != version;
+}
+
+// Adds numbers of items set in the count words of bitset proper to out. Most commands change no word or one,
+// so text of words equal to those of the previous call is copied from it instead of being formatted again.
+void OutProperItems(outBuffer_t* out, uint64_t* proper, int count) {
+    size_t start = out->len;
+    uint32_t from = 0;
+    int i;
+    bool changed = false;
+    if(count != out->properCount) {
+        out->properWords = (uint64_t*)realloc(out->properWords,sizeof(uint64_t)*(count ? count : 1));
+        out->properEnds = (uint32_t*)realloc(out->properEnds,sizeof(uint32_t)*(count ? count : 1));
+        if(!out->properWords || !out->properEnds) ERR("realloc");
+        memset(out->properWords,0,sizeof(uint64_t)*count); // Text of a word without items is empty.
+        memset(out->properEnds,0,sizeof(uint32_t)*count);
+        out->properCount = count;
+    }
+    if(count > 0 && memcmp(proper,out->properWords,sizeof(uint64_t)*count) == 0) { // Nothing changed, usually.
+        OutReserve(out,out->properEnds[count-1]);
+        memcpy(out->data+out->len,out->proper,out->properEnds[count-1]);
+        out->len += out->properEnds[count-1];
+        return;
+    }
+    for(i=0;i<count;i++) {
+        uint64_t word = proper[i]; // Read once, the game may change meanwhile.
+        uint32_t end = out->properEnds[i];
+        if(word == out->properWords[i]) {
+            if(end > from) { // Most words of a game in progress hold no items.
+                OutReserve(out,end-from);
+                memcpy(out->data+out->len,out->proper+from,end-from);
+                out->len += end-from;
+            }
+        }
+        else {
+            out->properWords[i] = word;
+            changed = true;
+            while(word) {
+                OutInt(out,64*i+__builtin_ctzll(word),' ');
+                word &= word-1;
+            }
+        }
+        from = end;
+        out->properEnds[i] = out->len-start;
+    }
+    if(!changed) return;
+    if(out->len-start > out->properCap) {
+        out->properCap = 2*(out->len-start);
+        if(!(out->proper = (char*)realloc(out->proper,out->properCap))) ERR("realloc");
+    }
+    memcpy(out->proper,out->data+start,out->len-start);
+}
+
+// Prints rooms currently available to move into.
+void PrintAvailableRooms(gameArgs_t* args, outBuffer_t* out) {
+    long first = args->graph.offsets[args->currentRoom], last = args->graph.offsets[args->currentRoom+1];
+    OutReserve(out,64+12*(last-first)); // Whole line is written without checking room for every number.
+    char* pos = FORMAT_TEXT(out->data+out->len,"Current room is ");
+    pos = FormatInt(pos,args->currentRoom,'.');
+    pos = FORMAT_TEXT(pos," Available rooms are: ");
+    for(long i=first;i<last;i++) pos = FormatInt(pos,args->graph.neighbors[i],' ');
+    *pos++ = '\n';
+    out->len = pos-out->data;
+}
+
+// Prints basic information about current game.
+void PrintItemsInRoom(gameArgs_t* args, outBuffer_t* out) {
+    int i, *slots = &args->roomSlots[2*args->currentRoom];
+    OutReserve(out,128);
+    char* pos = FORMAT_TEXT(out->data+out->len,"Items in this room: ");
+    if(slots[1] != -1 && slots[1] < slots[0]) {
+        pos = FormatInt(pos,slots[1],' ');
+        pos = FormatInt(pos,slots[0],' ');
+    }
+    else {
+        for(i=0;i<2 && slots[i] != -1;i++) pos = FormatInt(pos,slots[i],' ');
+    }
+    pos = FORMAT_TEXT(pos,"\nProperly placed items are: ");
+    out->len = pos-out->data;
+    OutProperItems(out,args->properRoom,BITSET_WORDS(3*args->roomCount/2));
+    OutReserve(out,128);
+    pos = FORMAT_TEXT(out->data+out->len,"\n");
+    if(args->itemHeld == -1) pos = FORMAT_TEXT(pos,"You can pick up an item.");
+    else {
+        pos = FORMAT_TEXT(pos,"You are carrying item ");
+        pos = FormatInt(pos,args->itemHeld,' ');
+        pos = FORMAT_TEXT(pos,"to room ");
+        pos = FormatInt(pos,args->itemDest[args->itemHeld],'.');
+    }
+    pos = FORMAT_TEXT(pos," Moves count: ");
+    pos = FormatInt(pos,args->movesCount,'\n');
+    out->len = pos-out->data;
+}
+
+// Prints rooms available to move into and items of the game to out without its mutex, under the seqlock.
+void PrintGameState(gameArgs_t* args, outBuffer_t* out) {
+    size_t start = out->len;
+    unsigned long version;
+    if(!args->gameThreads) { // Only the caller changes the game.
+        PrintAvailableRooms(args,out);
+        PrintItemsInRoom(args,out);
+        return;
+    }
+    do {
+        version = ReadBegin(args);
+        out->len = start;
+        PrintAvailableRooms(args,out);
+        PrintItemsInRoom(args,out);
+    } while(ReadRetry(args,version));
+}
+
+// Checks if the game had finished.
+bool CheckIfFinished(gameArgs_t* args) {
+    return args->misplacedCount == 0;
+}
+
+// Writes snapshot of the game continued by journal session sessionId from event journalSeq, returns bytes written or 0.
+uint64_t WriteGame(gameArgs_t* args, char* path, uint64_t sessionId, uint64_t journalSeq) {
+    saveHeader_t header;
+    void* data[MAX_SECTIONS];
+    int numberOfItems = 3*args->roomCount/2;
+    memset(&header,0,sizeof(header));
+    header.roomCount = args->roomCount;
+    header.itemCount = numberOfItems;
+    header.movesCount = args->movesCount;
+    header.itemHeld = args->itemHeld;
+    header.currentRoom = args->currentRoom;
+    header.sessionId = sessionId;
+    header.journalSeq = journalSeq;
+    header.itemSeed = args->itemSeed;
+    header.sections[SECTION_OFFSETS].size = sizeof(long)*(args->roomCount+1);
+    header.sections[SECTION_NEIGHBORS].size = sizeof(int)*args->graph.offsets[args->roomCount];
+    header.sections[SECTION_PROPER_BITS].size = sizeof(uint64_t)*BITSET_WORDS(numberOfItems);
+    header.sections[SECTION_ROOM_SLOTS].size = sizeof(int)*2*args->roomCount;
+    header.sections[SECTION_ITEMS].size = sizeof(int)*numberOfItems;
+    header.sections[SECTION_ITEM_DEST].size = sizeof(int)*numberOfItems;
+    header.sections[SECTION_ITEMS_IN_ROOM].size = sizeof(int)*args->roomCount;
+    data[SECTION_OFFSETS] = args->graph.offsets;
+    data[SECTION_NEIGHBORS] = args->graph.neighbors;
+    data[SECTION_PROPER_BITS] = args->properRoom;
+    data[SECTION_ROOM_SLOTS] = args->roomSlots;
+    data[SECTION_ITEMS] = args->items;
+    data[SECTION_ITEM_DEST] = args->itemDest;
+    data[SECTION_ITEMS_IN_ROOM] = args->itemsInRoom;
+    routeIndex_t* index = __atomic_load_n(&args->routing.index,__ATOMIC_ACQUIRE);
+    if(index && index->mode == ROUTE_TABLE) {
+        header.sections[SECTION_NEXT_HOP].size = index->bytes;
+        data[SECTION_NEXT_HOP] = index->nextHop;
+    }
+    else if(index) {
+        header.sections[SECTION_LANDMARKS].size = index->bytes;
+        data[SECTION_LANDMARKS] = index->landmarkDist;
+    }
+    return WriteSaveFile(path,&header,data);
+}
+
+// Writes changed pages of the live game file to disk.
+void SyncLive(gameArgs_t* args) {
+    if(msync(args->mapping,args->mappingSize,MS_SYNC)) ERR("msync");
+}
+
+// Saves game data to path, continued by the journal or only flushed in live mode. Returns false if it cannot be written.
+bool SaveGame(gameArgs_t* args, char* path) {
+    uint64_t start = MonotonicNs(), bytes = 0;
+    bool live = args->live && SameFile(path,args->autosavePath);
+    if(live) SyncLive(args);
+    else if(args->journal) bytes = WriteGame(args,path,args->journal->sessionId,args->journal->nextSeq);
+    else bytes = WriteGame(args,path,0,0);
+    HistogramAdd(&metrics.saveTimes,MonotonicNs()-start);
+    __atomic_fetch_add(&metrics.saveBytes,bytes,__ATOMIC_RELAXED);
+    return live || bytes > 0;
+}
+
+// Checks that next hops of table are rooms or NO_HOP with every room its own next hop, or landmark distances are in range.
+bool ValidRouteIndex(uint16_t* nextHop, int* landmarkDist, int n) {
+    long i, x;
+    if(nextHop) {
+        for(i=0;i<(long)n*n;i++) {
+            if(nextHop[i] >= n && nextHop[i] != NO_HOP) return false;
+        }
+        for(x=0;x<n;x++) {
+            if(nextHop[x*n+x] != x) return false;
+        }
+        return true;
+    }
+    for(i=0;i<(long)ALT_LANDMARKS*n;i++) {
+        if(landmarkDist[i] < -1 || landmarkDist[i] >= n) return false;
+    }
+    return true;
+}
+
+// Points routing index of args into sections of the mapped save file, if the save contains a valid one.
+void RouteIndexFromSave(gameArgs_t* args, saveHeader_t* header) {
+    int n = args->roomCount;
+    uint16_t* nextHop = SectionData(args,header,SECTION_NEXT_HOP,sizeof(uint16_t)*n*(uint64_t)n);
+    int* landmarkDist = SectionData(args,header,SECTION_LANDMARKS,sizeof(int)*ALT_LANDMARKS*(uint64_t)n);
+    if(args->routing.mode == ROUTE_NONE || n == 0 || (!nextHop && !landmarkDist)) return;
+    if(!ValidRouteIndex(nextHop,landmarkDist,n)) return; // Built again like for a save without index.
+    routeIndex_t* index = (routeIndex_t*)calloc(1,sizeof(routeIndex_t));
+    if(!index) ERR("calloc");
+    index->roomCount = n;
+    index->mode = nextHop ? ROUTE_TABLE : ROUTE_ALT;
+    index->nextHop = nextHop;
+    index->landmarkDist = nextHop ? NULL : landmarkDist;
+    index->bytes = nextHop ? sizeof(uint16_t)*n*(size_t)n : sizeof(int)*ALT_LANDMARKS*(size_t)n;
+    args->routing.index = index;
+}
+
+// Returns FNV-1a checksum of a journal record, computed over all fields before check.
+uint32_t JournalChecksum(const journalRecord_t* record) {
+    const unsigned char* bytes = (const unsigned char*)record;
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for(i=0;i<offsetof(journalRecord_t,check);i++) hash = (hash ^ bytes[i])*16777619u;
+    return hash;
+}
+
+// Applies one journal event to the game. Returns false if the event is not a valid move in current state.
+bool ApplyEvent(gameArgs_t* args, const journalRecord_t* record) {
+    int numberOfItems = 3*args->roomCount/2, a = record->a, b = record->b;
+    switch(record->type) {
+    case EVENT_MOVE:
+        if(a < 0 || a >= args->roomCount || !IsNeighbor(&args->graph,args->currentRoom,a)) return false;
+        args->currentRoom = a;
+        break;
+    case EVENT_PICK_UP:
+        if(args->itemHeld != -1 || a < 0 || a >= numberOfItems || args->items[a] != args->currentRoom) return false;
+        args->itemHeld = a;
+        RemoveItem(args,a);
+        break;
+    case EVENT_DROP:
+        if(a != args->itemHeld || a == -1 || args->itemsInRoom[args->currentRoom] > 1) return false;
+        PlaceItem(args,a,args->currentRoom);
+        args->itemHeld = -1;
+        break;
+    case EVENT_SWAP:
+        if(a < 0 || b < 0 || a >= numberOfItems || b >= numberOfItems || a == b || a == args->itemHeld || b == args->itemHeld) return false;
+        SwapItems(args,a,b);
+        break;
+    default:
+        return false;
+    }
+    args->movesCount = record->movesCount;
+    return true;
+}
+
+// Replays events of journal path.journal made after the save was written. Replay stops at the first
+// damaged, missing or invalid record, which is where the game was when it crashed. Returns number of events replayed.
+int ReplayJournal(gameArgs_t* args, char* path, saveHeader_t* header) {
+    char journalPath[MAX_PATH+8];
+    journalHeader_t journalHeader;
+    journalRecord_t record;
+    int count = 0;
+    if(header->sessionId == 0 || snprintf(journalPath,sizeof(journalPath),"%s.journal",path) >= (int)sizeof(journalPath)) return 0;
+    int fd = open(journalPath,O_RDONLY);
+    if(fd < 0) return 0;
+    uint64_t seq = header->journalSeq;
+    if(read(fd,&journalHeader,sizeof(journalHeader)) == sizeof(journalHeader) &&
+       memcmp(journalHeader.magic,JOURNAL_MAGIC,sizeof(journalHeader.magic)) == 0 &&
+       journalHeader.sessionId == header->sessionId && journalHeader.firstSeq <= seq) {
+        off_t offset = sizeof(journalHeader)+(seq-journalHeader.firstSeq)*sizeof(journalRecord_t);
+        while(pread(fd,&record,sizeof(record),offset) == sizeof(record)) {
+            if(record.seq != seq || record.check != JournalChecksum(&record) || !ApplyEvent(args,&record)) break;
+            offset += sizeof(record);
+            seq++;
+            count++;
+        }
+    }
+    if(close(fd)) ERR("close");
+    return count;
+}
+
+// Repairs a live game file left in the middle of a change by a crash of the process. Returns false if it cannot be repaired.
+bool RepairLiveGame(gameArgs_t* args) {
+    // Pages reach the disk only through msync, in no guaranteed order, so this covers a crash of the process, not a power loss.
+    int i, room = 0, unplaced = 0, numberOfItems = 3*args->roomCount/2, held = args->live->itemHeld;
+    if(args->currentRoom < 0 || args->currentRoom >= args->roomCount) return false;
+    if(held < -1 || held >= numberOfItems || (held != -1 && args->items[held] != -1)) held = -1;
+    int* counts = (int*)calloc(args->roomCount,sizeof(int));
+    if(!counts) ERR("calloc");
+    for(i=0;i<numberOfItems;i++) {
+        if(args->items[i] < -1 || args->items[i] >= args->roomCount || (args->items[i] != -1 && ++counts[args->items[i]] > 2)) {
+            free(counts);
+            return false;
+        }
+        unplaced += args->items[i] == -1 && i != held;
+    }
+    for(i=0;i<numberOfItems;i++) {
+        if(args->items[i] != -1 || i == held) continue;
+        if(held == -1 && unplaced == 1) { // Crash during pick-up, the item counts as held.
+            held = i;
+            continue;
+        }
+        while(counts[room] == 2) room++; // Crash during an item swap left items out of rooms, the map has slots for them.
+        args->items[i] = room;
+        counts[room]++;
+    }
+    free(counts);
+    args->itemHeld = held;
+    if(!FillRoomIndex(args)) return false;
+    args->live->itemHeld = args->itemHeld;
+    args->live->liveWrites++;
+    return true;
+}
+
+// Loads game from binary or old text save at path, kept in the autosave file in live mode. Returns false if it is not valid.
+bool LoadGameFile(gameArgs_t* args, char* path) {
+    saveHeader_t* header;
+    bool shared = args->liveMode && SameFile(path,args->autosavePath);
+    ClearGame(args);
+    int result = MapSaveFile(args,path,&header,shared);
+    if(result == LOAD_LEGACY) {
+        result = ReadLegacyFile(args,path,true);
+        if(result == 0) ReleaseGame(args);
+        return result == 1;
+    }
+    if(result == LOAD_BAD || !GraphFromSave(args,header) || header->itemCount != 3*header->roomCount/2) {
+        ReleaseGame(args);
+        return false;
+    }
+    int numberOfItems = header->itemCount;
+    args->items = SectionData(args,header,SECTION_ITEMS,sizeof(int)*numberOfItems);
+    args->itemDest = SectionData(args,header,SECTION_ITEM_DEST,sizeof(int)*numberOfItems);
+    args->itemsInRoom = SectionData(args,header,SECTION_ITEMS_IN_ROOM,sizeof(int)*args->roomCount);
+    if(!args->items || !args->itemDest || !args->itemsInRoom) {
+        ReleaseGame(args);
+        return false;
+    }
+    args->properRoom = SectionData(args,header,SECTION_PROPER_BITS,sizeof(uint64_t)*BITSET_WORDS(numberOfItems));
+    args->roomSlots = SectionData(args,header,SECTION_ROOM_SLOTS,sizeof(int)*2*args->roomCount);
+    bool indexSaved = args->properRoom && args->roomSlots; // Not by an older version.
+    args->movesCount = header->movesCount;
+    args->itemHeld = header->itemHeld;
+    args->currentRoom = header->currentRoom;
+    args->itemSeed = header->itemSeed;
+    args->saveCount = 0;
+    bool ok = true;
+    if(shared && indexSaved) {
+        args->live = header;
+        if(header->liveWrites % 2 == 1) ok = RepairLiveGame(args);
+    }
+    if(!ok || !ValidGame(args) || !(indexSaved ? ValidRoomIndex(args) : RebuildRoomIndex(args))) {
+        ReleaseGame(args);
+        return false;
+    }
+    RouteIndexFromSave(args,header);
+    int replayed = ReplayJournal(args,path,header);
+    if(replayed > 0) printf("Replayed %d events from journal\n",replayed);
+    return true;
+}
+
+// Loads game data from file pointed to by path with LoadGameFile and counts the time in metrics.
+bool LoadGame(gameArgs_t* args, char* path) {
+    uint64_t start = MonotonicNs();
+    bool ok = LoadGameFile(args,path);
+    HistogramAdd(&metrics.loadTimes,MonotonicNs()-start);
+    return ok;
+}
+
+// Returns number of processors available, used as default number of threads.
+int ProcessorCount() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+// Returns next number of xoshiro256** generator.
+uint64_t RngNext(rng_t* rng) {
+    uint64_t* s = rng->s;
+    uint64_t result = s[1]*5;
+    result = ((result << 7) | (result >> 57))*9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+// Seeds generator, expanding seed with splitmix64 so that close seeds give unrelated sequences.
+void RngSeed(rng_t* rng, uint64_t seed) {
+    int i;
+    for(i=0;i<4;i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}
+
+// Returns random number from 0 to bound-1, using multiplication instead of slow modulo.
+uint32_t RngBelow(rng_t* rng, uint32_t bound) {
+    return (uint32_t)(((RngNext(rng) >> 32)*bound) >> 32);
+}
+
+// Returns uniformly distributed number in [0,1).
+double RngUniform(rng_t* rng) {
+    return (RngNext(rng) >> 11)*0x1.0p-53;
+}
+
+// Does one task of current level of shuffle: Fisher-Yates shuffle of a chunk at level 0, otherwise random merge of two blocks.
+void ShuffleTask(shuffle_t* shuffle, long task) {
+    rng_t rng;
+    int* a = shuffle->values;
+    long width = (long)SHUFFLE_CHUNK << shuffle->level;
+    long start = task*width, end = start+width < shuffle->len ? start+width : shuffle->len;
+    long i = start, j = start+width/2, tmp;
+    uint64_t bits = 0;
+    int bitCount = 0;
+    RngSeed(&rng,shuffle->seed+((uint64_t)shuffle->level << 40)+task);
+    if(shuffle->level == 0) {
+        for(i=end-1;i>start;i--) {
+            long k = start+RngBelow(&rng,i-start+1);
+            tmp = a[i]; a[i] = a[k]; a[k] = tmp;
+        }
+        return;
+    }
+    if(j >= end) return; // Last block has no pair.
+    while(1) {
+        if(bitCount == 0) {
+            bits = RngNext(&rng);
+            bitCount = 64;
+        }
+        bool right = bits & 1;
+        bits >>= 1;
+        bitCount--;
+        if(right) {
+            if(j == end) break;
+            tmp = a[i]; a[i] = a[j]; a[j] = tmp;
+            j++;
+        }
+        else if(i == j) break;
+        i++;
+    }
+    for(;i<end;i++) {
+        long k = start+RngBelow(&rng,i-start+1);
+        tmp = a[i]; a[i] = a[k]; a[k] = tmp;
+    }
+}
+
+// Function passed to threads of shuffle, takes tasks of current level one by one.
+void* ShuffleWork(void* pVoid) {
+    shuffle_t* shuffle = pVoid;
+    long task;
+    while((task = __atomic_fetch_add(&shuffle->nextTask,1,__ATOMIC_RELAXED)) < shuffle->taskCount) ShuffleTask(shuffle,task);
+    return NULL;
+}
+
+// Shuffles len values in place with one thread for every processor, the calling thread being one of them, so
+// shuffles of a single chunk start no threads. The result depends only on seed.
+void ParallelShuffle(int* values, long len, uint64_t seed) {
+    shuffle_t shuffle = {values,len,seed,0,0,0};
+    int i, threadCount = ProcessorCount();
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t)*threadCount);
+    if(!threads) ERR("malloc");
+    for(shuffle.level=0;shuffle.level == 0 || ((long)SHUFFLE_CHUNK << (shuffle.level-1)) < len;shuffle.level++) {
+        long width = (long)SHUFFLE_CHUNK << shuffle.level;
+        int count;
+        shuffle.taskCount = (len+width-1)/width;
+        shuffle.nextTask = 0;
+        count = shuffle.taskCount < threadCount ? shuffle.taskCount : threadCount;
+        for(i=1;i<count;i++) {
+            if(pthread_create(&threads[i],NULL,ShuffleWork,&shuffle)) ERR("pthread_create");
+        }
+        ShuffleWork(&shuffle);
+        for(i=1;i<count;i++) {
+            if(pthread_join(threads[i],NULL)) ERR("pthread_join");
+        }
+    }
+    free(threads);
+}
+
+// Places items of a new game on the map of args by shuffling the room slots in slots, with the player in room start.
+void PlaceItems(gameArgs_t* args, int* slots, uint64_t seed, int start) {
+    rng_t rng;
+    long i,t;
+    int n = args->roomCount, numberOfItems = 3*n/2;
+    args->itemSeed = seed;
+    args->misplacedCount = numberOfItems;
+    args->movesCount = 0;
+    args->saveCount = 0;
+    args->itemHeld = -1;
+    args->currentRoom = start;
+    memset(args->properRoom,0,sizeof(uint64_t)*BITSET_WORDS(numberOfItems));
+    memset(args->itemsInRoom,0,sizeof(int)*n);
+    for(i=0;i<2*n;i++) {
+        slots[i] = i;
+        args->roomSlots[i] = -1;
+    }
+    ParallelShuffle(slots,2*n,seed);
+    for(i=0;i<numberOfItems;i++) { // Assigning start location to items, slots of a room are filled in order.
+        int room = slots[i]/2;
+        args->items[i] = room;
+        args->roomSlots[2*room+args->itemsInRoom[room]++] = i;
+    }
+    for(i=0;i<2*n;i++) slots[i] = i;
+    ParallelShuffle(slots,2*n,seed+1);
+    RngSeed(&rng,seed+2);
+    for(i=0;i<numberOfItems;i++) { // Moving destinations equal to start rooms to another slot, there is always one.
+        if(slots[i]/2 != args->items[i]) continue;
+        long first = RngBelow(&rng,2*n);
+        for(t=0;t<2*n;t++) {
+            long k = (first+t)%(2*n);
+            if(slots[k]/2 != args->items[i] && (k >= numberOfItems || slots[i]/2 != args->items[k])) {
+                int tmp = slots[i]; slots[i] = slots[k]; slots[k] = tmp;
+                break;
+            }
+        }
+    }
+    for(i=0;i<numberOfItems;i++) args->itemDest[i] = slots[i]/2;
+}
+
+// Preparing new game, with items placed from a random seed in a random room and arrays taken from the arena.
+// Returns false if the map has less than two rooms, where no item can have a destination other than its start.
+bool OrganizeItems(gameArgs_t* args) {
+    int n = args->roomCount;
+    if(n < 2) return false;
+    uint64_t seed = ((uint64_t)rand() << 32) ^ rand();
+    PlaceItems(args,ArenaItemArrays(args),seed,rand()%n);
+    return true;
+}
+
+// Adds room to set of rooms visited by current walk of worker. Returns false if it was already there.
+bool WalkSetInsert(walkWorker_t* worker, int room) {
+    uint32_t mask = (1u << WALK_SET_BITS)-1;
+    uint32_t slot = ((uint32_t)room*0x9e3779b1u) >> (32-WALK_SET_BITS);
+    while(worker->setStamp[slot] == worker->stamp) {
+        if(worker->setRooms[slot] == room) return false;
+        slot = (slot+1) & mask;
+    }
+    worker->setStamp[slot] = worker->stamp;
+    worker->setRooms[slot] = room;
+    return true;
+}
+
+// Does random walk number walk of current job of the pool from startRoom, ending at target or once it cannot beat the best walk.
+void RandomWalk(walkWorker_t* worker, int walk) {
+    walkPool_t* pool = worker->pool;
+    graph_t* graph = &pool->args->graph;
+    int step, len = 0, room = pool->startRoom;
+    RngSeed(&worker->rng,pool->seed+((uint64_t)pool->job << 32)+walk); // Result does not depend on which thread does the walk.
+    if(++worker->stamp == 0) { // Stamps wrapped around, slots would look used by an old walk.
+        memset(worker->setStamp,0,sizeof(unsigned int) << WALK_SET_BITS);
+        worker->stamp = 1;
+    }
+    WalkSetInsert(worker,room);
+    worker->path[0] = room;
+    for(step=0;step<WALK_MAX_STEPS && room != pool->target;step++) {
+        if((uint64_t)len >= __atomic_load_n(&pool->best,__ATOMIC_RELAXED) >> 32) break; // Cannot be shorter than the best walk.
+        int degree = Degree(graph,room);
+        if(degree == 0) break;
+        int next = graph->neighbors[graph->offsets[room]+RngBelow(&worker->rng,degree)];
+        if(!WalkSetInsert(worker,next)) continue;
+        worker->path[++len] = next;
+        room = next;
+    }
+    HistogramAdd(&metrics.walkLengths,step);
+    if(room != pool->target) return;
+    uint64_t key = ((uint64_t)len << 32) | (uint32_t)walk; // Shorter walks win, ties go to lower walk number.
+    uint64_t best = __atomic_load_n(&pool->best,__ATOMIC_RELAXED);
+    while(key < best && !__atomic_compare_exchange_n(&pool->best,&best,key,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+    if(key < worker->bestKey) {
+        worker->bestKey = key;
+        memcpy(worker->bestPath,worker->path,sizeof(int)*(len+1));
+    }
+}
+
+// Function passed to threads of the random walk pool, waits for jobs from FindPath and takes walks of every job one by one.
+void* WalkWork(void* pVoid) {
+    walkWorker_t* worker = pVoid;
+    walkPool_t* pool = worker->pool;
+    unsigned long job = 0;
+    while(1) {
+        pthread_mutex_lock(&pool->mutex);
+        while(pool->job == job && !pool->quit) pthread_cond_wait(&pool->start,&pool->mutex);
+        if(pool->quit) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+        job = pool->job;
+        pthread_mutex_unlock(&pool->mutex);
+        worker->bestKey = UINT64_MAX;
+        int walk;
+        while((walk = __atomic_fetch_add(&pool->nextWalk,1,__ATOMIC_RELAXED)) < pool->walkCount) RandomWalk(worker,walk);
+        pthread_mutex_lock(&pool->mutex);
+        if(--pool->running == 0) pthread_cond_signal(&pool->finished);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+// Creates pool of threads doing random walks for game args, one for every processor, with walks seeded from seed.
+walkPool_t* CreateWalkPool(gameArgs_t* args, uint64_t seed) {
+    int i;
+    walkPool_t* pool = (walkPool_t*)calloc(1,sizeof(walkPool_t));
+    if(!pool) ERR("calloc");
+    pool->args = args;
+    pool->seed = seed;
+    pool->threadCount = ProcessorCount();
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t)*pool->threadCount);
+    pool->workers = (walkWorker_t*)calloc(pool->threadCount,sizeof(walkWorker_t));
+    if(!pool->threads || !pool->workers) ERR("malloc");
+    if(pthread_mutex_init(&pool->mutex,NULL)) ERR("pthread_mutex_init");
+    if(pthread_cond_init(&pool->start,NULL) || pthread_cond_init(&pool->finished,NULL)) ERR("pthread_cond_init");
+    for(i=0;i<pool->threadCount;i++) {
+        walkWorker_t* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->path = (int*)malloc(sizeof(int)*(WALK_MAX_STEPS+1));
+        worker->bestPath = (int*)malloc(sizeof(int)*(WALK_MAX_STEPS+1));
+        worker->setRooms = (int*)malloc(sizeof(int) << WALK_SET_BITS);
+        worker->setStamp = (unsigned int*)calloc(1 << WALK_SET_BITS,sizeof(unsigned int));
+        if(!worker->path || !worker->bestPath || !worker->setRooms || !worker->setStamp) ERR("malloc");
+        if(pthread_create(&pool->threads[i],NULL,WalkWork,worker)) ERR("pthread_create");
+    }
+    return pool;
+}
+
+// Stops threads of the pool and frees it.
+void DestroyWalkPool(walkPool_t* pool) {
+    int i;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for(i=0;i<pool->threadCount;i++) {
+        if(pthread_join(pool->threads[i],NULL)) ERR("pthread_join");
+        free(pool->workers[i].path);
+        free(pool->workers[i].bestPath);
+        free(pool->workers[i].setRooms);
+        free(pool->workers[i].setStamp);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finished);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+// Frees path returned from FindPath or FindExactPath.
+void FreePath(findPathReturnArgs_t* returnArgs) {
+    free(returnArgs->path);
+    free(returnArgs);
+}
+
+// Tries to find shortest path to room x with k random walks (this solution is far from optimal, but it was required to do it that way).
+// Walks are done by threads of the pool of the game, which is created on first use.
+findPathReturnArgs_t* FindPath(gameArgs_t* args, int k, int x) {
+    int i;
+    if(!args->walkPool) args->walkPool = CreateWalkPool(args,((uint64_t)rand() << 32) ^ rand());
+    walkPool_t* pool = args->walkPool;
+    pthread_mutex_lock(&pool->mutex);
+    pool->args = args; // A pool of the game server is shared by games of one worker.
+    pool->walkCount = k;
+    pool->nextWalk = 0;
+    pool->startRoom = args->currentRoom;
+    pool->target = x;
+    pool->best = UINT64_MAX;
+    pool->running = pool->threadCount;
+    pool->job++;
+    pthread_cond_broadcast(&pool->start);
+    while(pool->running > 0) pthread_cond_wait(&pool->finished,&pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    findPathReturnArgs_t* returnArgs = (findPathReturnArgs_t*)malloc(sizeof(findPathReturnArgs_t));
+    if(!returnArgs) ERR("malloc");
+    walkWorker_t* best = NULL;
+    for(i=0;i<pool->threadCount;i++) {
+        if(pool->workers[i].bestKey != UINT64_MAX && (!best || pool->workers[i].bestKey < best->bestKey)) best = &pool->workers[i];
+    }
+    returnArgs->ok = best != NULL;
+    returnArgs->len = best ? best->bestKey >> 32 : 0;
+    returnArgs->path = (int*)malloc(sizeof(int)*(returnArgs->len+1));
+    if(!returnArgs->path) ERR("malloc");
+    if(best) memcpy(returnArgs->path,best->bestPath,sizeof(int)*(returnArgs->len+1));
+    return returnArgs;
+}
+
+// Records that worker reached room v in current level. otherDist is distance of v from the other side, or -1.
+void FoundRoom(bfsWorker_t* worker, int v, int otherDist) {
+    bfsShared_t* shared = worker->shared;
+    if(worker->foundLen == worker->foundCap) {
+        worker->foundCap = worker->foundCap ? 2*worker->foundCap : 1024;
+        worker->found = (int*)realloc(worker->found,sizeof(int)*worker->foundCap);
+        if(!worker->found) ERR("realloc");
+    }
+    worker->found[worker->foundLen++] = v;
+    worker->foundEdges += shared->graph->offsets[v+1]-shared->graph->offsets[v];
+    if(otherDist != -1) {
+        long len = shared->level[shared->side]+1+otherDist;
+        if(worker->meet == -1 || len < worker->meetLen) {
+            worker->meet = v;
+            worker->meetLen = len;
+        }
+    }
+}
+
+// Expands the part of current level assigned to worker, top-down or bottom-up, and appends reached rooms to the next frontier.
+void ExpandLevel(bfsWorker_t* worker) {
+    bfsShared_t* shared = worker->shared;
+    graph_t* graph = shared->graph;
+    int side = shared->side, level = shared->level[side];
+    int* dist = shared->dist[side];
+    int* other = shared->dist[1-side];
+    int* parent = shared->parent[side];
+    int i,from,to;
+    long j;
+    worker->foundLen = 0;
+    worker->foundEdges = 0;
+    worker->meet = -1;
+    if(!shared->bottomUp[side]) {
+        from = (long)shared->frontierLen[side]*worker->index/shared->threadCount;
+        to = (long)shared->frontierLen[side]*(worker->index+1)/shared->threadCount;
+    }
+    else {
+        from = (long)shared->roomCount*worker->index/shared->threadCount;
+        to = (long)shared->roomCount*(worker->index+1)/shared->threadCount;
+    }
+    for(i=from;i<to;i++) {
+        int u = -1, v = -1;
+        if(!shared->bottomUp[side]) {
+            u = shared->frontier[side][i];
+            for(j=graph->offsets[u];j<graph->offsets[u+1];j++) {
+                int expected = -1;
+                v = graph->neighbors[j];
+                if(__atomic_load_n(&dist[v],__ATOMIC_RELAXED) != -1) continue;
+                if(!__atomic_compare_exchange_n(&dist[v],&expected,level+1,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) continue;
+                parent[v] = u;
+                FoundRoom(worker,v,other[v]);
+            }
+        }
+        else if(__atomic_load_n(&dist[i],__ATOMIC_RELAXED) == -1) {
+            v = i;
+            for(j=graph->offsets[v];j<graph->offsets[v+1];j++) {
+                u = graph->neighbors[j];
+                if(__atomic_load_n(&dist[u],__ATOMIC_RELAXED) != level) continue;
+                __atomic_store_n(&dist[v],level+1,__ATOMIC_RELAXED);
+                parent[v] = u;
+                FoundRoom(worker,v,other[v]);
+                break;
+            }
+        }
+    }
+    int position = __atomic_fetch_add(&shared->nextLen,worker->foundLen,__ATOMIC_RELAXED);
+    if(worker->foundLen) memcpy(shared->next+position,worker->found,sizeof(int)*worker->foundLen);
+    __atomic_fetch_add(&shared->nextEdges,worker->foundEdges,__ATOMIC_RELAXED);
+}
+
+// Finishes a level after all threads expanded their parts: checks if both sides met and chooses
+// which side to expand next and in which direction. Called by one thread only.
+void FinishLevel(bfsShared_t* shared) {
+    int i, side = shared->side;
+    long meetLen = -1;
+    shared->level[side]++;
+    for(i=0;i<shared->threadCount;i++) { // Every meeting found in the first level in which sides meet is a path, the shortest of them is optimal.
+        bfsWorker_t* worker = &shared->workers[i];
+        if(worker->meet != -1 && (meetLen == -1 || worker->meetLen < meetLen)) {
+            meetLen = worker->meetLen;
+            shared->meet = worker->meet;
+        }
+    }
+    if(shared->meet != -1 || shared->nextLen == 0) {
+        shared->done = true;
+        return;
+    }
+    int* tmp = shared->frontier[side];
+    shared->frontier[side] = shared->next;
+    shared->next = tmp;
+    shared->frontierLen[side] = shared->nextLen;
+    shared->frontierEdges[side] = shared->nextEdges;
+    shared->visitedEdges[side] += shared->nextEdges;
+    shared->nextLen = 0;
+    shared->nextEdges = 0;
+    side = shared->side = shared->frontierEdges[0] <= shared->frontierEdges[1] ? 0 : 1;
+    long unvisitedEdges = shared->graph->offsets[shared->roomCount] - shared->visitedEdges[side];
+    if(!shared->bottomUp[side] && shared->frontierEdges[side]*BFS_ALPHA > unvisitedEdges) shared->bottomUp[side] = true;
+    else if(shared->bottomUp[side] && (long)shared->frontierLen[side]*BFS_BETA < shared->roomCount) shared->bottomUp[side] = false;
+}
+
+// Function passed to threads executing FindExactPath, expands levels until both sides of the search meet.
+void* ExactPathWork(void* pVoid) {
+    bfsWorker_t* worker = pVoid;
+    bfsShared_t* shared = worker->shared;
+    pthread_mutex_lock(&shared->gate);
+    while(!shared->open) pthread_cond_wait(&shared->opened,&shared->gate);
+    pthread_mutex_unlock(&shared->gate);
+    while(1) {
+        int result = pthread_barrier_wait(&shared->barrier);
+        if(result != 0 && result != PTHREAD_BARRIER_SERIAL_THREAD) ERR("pthread_barrier_wait");
+        if(shared->done) break;
+        ExpandLevel(worker);
+        result = pthread_barrier_wait(&shared->barrier);
+        if(result == PTHREAD_BARRIER_SERIAL_THREAD) FinishLevel(shared);
+        else if(result != 0) ERR("pthread_barrier_wait");
+    }
+    return NULL;
+}
+
+// Prepares shared state of a breadth-first search on graph with n rooms, run at the same time from room
+// from and from room to. If to is -1, the search visits all rooms reachable from room from.
+void InitBfs(bfsShared_t* shared, graph_t* graph, int n, int from, int to) {
+    int i;
+    memset(shared,0,sizeof(bfsShared_t));
+    shared->graph = graph;
+    shared->roomCount = n;
+    shared->meet = -1;
+    for(i=0;i<2;i++) {
+        shared->dist[i] = (int*)malloc(sizeof(int)*n);
+        shared->parent[i] = (int*)malloc(sizeof(int)*n);
+        shared->frontier[i] = (int*)malloc(sizeof(int)*n);
+        if(!shared->dist[i] || !shared->parent[i] || !shared->frontier[i]) ERR("malloc");
+        memset(shared->dist[i],-1,sizeof(int)*n);
+    }
+    shared->next = (int*)malloc(sizeof(int)*n);
+    if(!shared->next) ERR("malloc");
+    int ends[2] = {from,to};
+    for(i=0;i<2;i++) {
+        if(ends[i] == -1) { // Side without rooms is never chosen for expansion.
+            shared->frontierEdges[i] = LONG_MAX;
+            continue;
+        }
+        shared->dist[i][ends[i]] = 0;
+        shared->parent[i][ends[i]] = -1;
+        shared->frontier[i][0] = ends[i];
+        shared->frontierLen[i] = 1;
+        shared->frontierEdges[i] = shared->visitedEdges[i] = Degree(graph,ends[i]);
+    }
+    if(from == to) shared->meet = to;
+}
+
+// Runs search prepared by InitBfs with up to k threads until it ends. Returns false if no thread could be started.
+bool RunBfs(bfsShared_t* shared, int k) {
+    int i;
+    if(shared->meet != -1) return true;
+    shared->workers = (bfsWorker_t*)calloc(k,sizeof(bfsWorker_t));
+    pthread_t* pthreads = (pthread_t*)malloc(sizeof(pthread_t)*k);
+    if(!shared->workers || !pthreads) {
+        free(shared->workers);
+        free(pthreads);
+        return false;
+    }
+    if(pthread_mutex_init(&shared->gate,NULL)) ERR("pthread_mutex_init");
+    if(pthread_cond_init(&shared->opened,NULL)) ERR("pthread_cond_init");
+    for(i=0;i<k;i++) {
+        shared->workers[i].shared = shared;
+        shared->workers[i].index = i;
+        if(pthread_create(&pthreads[i],NULL,ExactPathWork,&shared->workers[i])) break; // Levels are split between the threads that started.
+    }
+    shared->threadCount = i;
+    shared->done = i == 0;
+    if(pthread_barrier_init(&shared->barrier,NULL,i ? i : 1)) ERR("pthread_barrier_init");
+    pthread_mutex_lock(&shared->gate);
+    shared->open = true;
+    pthread_cond_broadcast(&shared->opened);
+    pthread_mutex_unlock(&shared->gate);
+    for(i=0;i<shared->threadCount;i++) {
+        if(pthread_join(pthreads[i],NULL)) ERR("pthread_join");
+        free(shared->workers[i].found);
+    }
+    if(pthread_barrier_destroy(&shared->barrier)) ERR("pthread_barrier_destroy");
+    pthread_mutex_destroy(&shared->gate);
+    pthread_cond_destroy(&shared->opened);
+    free(shared->workers);
+    free(pthreads);
+    return shared->threadCount > 0;
+}
+
+// Frees memory of a search.
+void FreeBfs(bfsShared_t* shared) {
+    int i;
+    for(i=0;i<2;i++) {
+        free(shared->dist[i]);
+        free(shared->parent[i]);
+        free(shared->frontier[i]);
+    }
+    free(shared->next);
+}
+
+// Finds shortest path to room x with bidirectional breadth-first search on k threads. Returns NULL if they cannot start.
+findPathReturnArgs_t* FindExactPath(gameArgs_t* args, int k, int x) {
+    bfsShared_t shared;
+    int i;
+    InitBfs(&shared,&args->graph,args->roomCount,args->currentRoom,x);
+    if(!RunBfs(&shared,k)) {
+        FreeBfs(&shared);
+        return NULL;
+    }
+    findPathReturnArgs_t* returnArgs = (findPathReturnArgs_t*)malloc(sizeof(findPathReturnArgs_t));
+    if(!returnArgs) ERR("malloc");
+    returnArgs->ok = shared.meet != -1;
+    returnArgs->len = returnArgs->ok ? shared.dist[0][shared.meet]+shared.dist[1][shared.meet] : 0;
+    returnArgs->path = (int*)malloc(sizeof(int)*(returnArgs->len+1));
+    if(!returnArgs->path) ERR("malloc");
+    if(returnArgs->ok) {
+        int room = shared.meet;
+        for(i=shared.dist[0][shared.meet];i>=0;i--,room=shared.parent[0][room]) returnArgs->path[i] = room;
+        room = shared.meet;
+        for(i=shared.dist[0][shared.meet];i<=returnArgs->len;i++,room=shared.parent[1][room]) returnArgs->path[i] = room;
+    }
+    FreeBfs(&shared);
+    return returnArgs;
+}
+
+// Frees routing index, whether its arrays were built or point into the mapped save file.
+void FreeRouteIndex(gameArgs_t* args, routeIndex_t* index) {
+    FreeUnlessBorrowed(args,index->nextHop);
+    FreeUnlessBorrowed(args,index->landmarkDist);
+    free(index->searchDist);
+    free(index->searchParent);
+    free(index->searchStamp);
+    free(index->heap);
+    free(index);
+}
+
+// Function passed to threads filling next-hop table. Every thread takes destination rooms one by one and
+// runs breadth-first search from them, parent of a room in the search tree is the next hop towards destination.
+void* RouteTableWork(void* pVoid) {
+    routeTableArgs_t* tableArgs = pVoid;
+    gameArgs_t* args = tableArgs->args;
+    graph_t* graph = &args->graph;
+    int n = args->roomCount;
+    int* queue = (int*)malloc(sizeof(int)*n);
+    if(!queue) ERR("malloc");
+    while(!__atomic_load_n(&args->routing.cancel,__ATOMIC_RELAXED)) {
+        int x = __atomic_fetch_add(&tableArgs->nextRoom,1,__ATOMIC_RELAXED);
+        if(x >= n) break;
+        uint16_t* row = tableArgs->index->nextHop+(long)x*n;
+        int head = 0, tail = 0;
+        memset(row,0xff,sizeof(uint16_t)*n);
+        row[x] = x;
+        queue[tail++] = x;
+        while(head < tail) {
+            int u = queue[head++];
+            for(long j=graph->offsets[u];j<graph->offsets[u+1];j++) {
+                int v = graph->neighbors[j];
+                if(row[v] != NO_HOP) continue;
+                row[v] = u;
+                queue[tail++] = v;
+            }
+        }
+    }
+    free(queue);
+    return NULL;
+}
+
+// Fills next-hop table of index using threadCount threads.
+void BuildRouteTable(gameArgs_t* args, routeIndex_t* index, int threadCount) {
+    int i, n = args->roomCount;
+    routeTableArgs_t tableArgs = {args,index,0};
+    pthread_t* pthreads = (pthread_t*)malloc(sizeof(pthread_t)*threadCount);
+    index->bytes = sizeof(uint16_t)*n*(size_t)n;
+    index->nextHop = (uint16_t*)malloc(index->bytes);
+    if(!pthreads || !index->nextHop) ERR("malloc");
+    for(i=0;i<threadCount;i++) {
+        if(pthread_create(&pthreads[i],NULL,RouteTableWork,&tableArgs)) ERR("pthread_create");
+    }
+    for(i=0;i<threadCount;i++) {
+        if(pthread_join(pthreads[i],NULL)) ERR("pthread_join");
+    }
+    free(pthreads);
+}
+
+// Fills landmark distances of index, choosing every landmark as the room farthest from those chosen before.
+void BuildLandmarks(gameArgs_t* args, routeIndex_t* index, int threadCount) {
+    int i,l, n = args->roomCount;
+    bfsShared_t shared;
+    index->bytes = sizeof(int)*ALT_LANDMARKS*(size_t)n;
+    index->landmarkDist = (int*)malloc(index->bytes);
+    int* minDist = (int*)malloc(sizeof(int)*n);
+    if(!index->landmarkDist || !minDist) ERR("malloc");
+    InitBfs(&shared,&args->graph,n,args->routing.firstRoom,-1); // Player may move meanwhile.
+    if(!RunBfs(&shared,threadCount)) __atomic_store_n(&args->routing.cancel,true,__ATOMIC_RELAXED); // No index, find-path --route stays exact.
+    memcpy(minDist,shared.dist[0],sizeof(int)*n);
+    FreeBfs(&shared);
+    for(l=0;l<ALT_LANDMARKS && !__atomic_load_n(&args->routing.cancel,__ATOMIC_RELAXED);l++) {
+        int landmark = 0;
+        for(i=1;i<n;i++) {
+            if(minDist[landmark] == -1) break;
+            if(minDist[i] == -1 || minDist[i] > minDist[landmark]) landmark = i;
+        }
+        int* dist = index->landmarkDist+(long)l*n;
+        InitBfs(&shared,&args->graph,n,landmark,-1);
+        if(!RunBfs(&shared,threadCount)) __atomic_store_n(&args->routing.cancel,true,__ATOMIC_RELAXED);
+        memcpy(dist,shared.dist[0],sizeof(int)*n);
+        FreeBfs(&shared);
+        for(i=0;i<n;i++) {
+            if(l == 0 || minDist[i] == -1 || (dist[i] != -1 && dist[i] < minDist[i])) minDist[i] = dist[i];
+        }
+    }
+    free(minDist);
+}
+
+// Function passed to thread building routing index in background, while the player is already playing.
+void* RouteBuildWork(void* pVoid) {
+    gameArgs_t* args = pVoid;
+    struct timespec start,end;
+    int threadCount = ProcessorCount();
+    if (clock_gettime(CLOCK_MONOTONIC, &start)) ERR("clock_gettime");
+    routeIndex_t* index = (routeIndex_t*)calloc(1,sizeof(routeIndex_t));
+    if(!index) ERR("calloc");
+    index->roomCount = args->roomCount;
+    index->mode = args->routing.mode;
+    if(index->mode == ROUTE_AUTO) index->mode = args->roomCount <= ROUTE_TABLE_MAX_ROOMS ? ROUTE_TABLE : ROUTE_ALT;
+    if(index->mode == ROUTE_TABLE && args->roomCount >= NO_HOP) index->mode = ROUTE_ALT; // Room numbers would not fit in the table.
+    if(index->mode == ROUTE_TABLE) BuildRouteTable(args,index,threadCount);
+    else BuildLandmarks(args,index,threadCount);
+    if(__atomic_load_n(&args->routing.cancel,__ATOMIC_RELAXED)) {
+        FreeRouteIndex(args,index);
+        return NULL;
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end)) ERR("clock_gettime");
+    index->buildTime = ELAPSED(start,end);
+    __atomic_store_n(&args->routing.index,index,__ATOMIC_RELEASE);
+    __atomic_store_n(&args->routing.unreported,true,__ATOMIC_RELEASE); // Output of the game belongs to the thread running commands.
+    return NULL;
+}
+
+// Starts building routing index in background, unless it is disabled or was loaded with the game.
+void StartRouting(gameArgs_t* args) {
+    if(args->routing.mode == ROUTE_NONE || args->routing.index || args->roomCount == 0) return;
+    args->routing.cancel = false;
+    args->routing.unreported = false;
+    args->routing.building = true;
+    args->routing.firstRoom = args->currentRoom;
+    if(pthread_create(&args->routing.builder,NULL,RouteBuildWork,args)) ERR("pthread_create");
+}
+
+// Adds time of building and size of routing index to output of the game once the builder finished it.
+void ReportRouting(gameArgs_t* args) {
+    if(!__atomic_exchange_n(&args->routing.unreported,false,__ATOMIC_ACQUIRE)) return;
+    routeIndex_t* index = args->routing.index;
+    OutPrintf(args->output,"Routing index (%s) built in %.3f s, %zu bytes\n",index->mode == ROUTE_TABLE ? "table" : "alt",index->buildTime,index->bytes);
+}
+
+// Stops building routing index, keeping it if it is already built.
+void CancelRouting(gameArgs_t* args) {
+    if(!args->routing.building) return;
+    __atomic_store_n(&args->routing.cancel,true,__ATOMIC_RELAXED);
+    if(pthread_join(args->routing.builder,NULL)) ERR("pthread_join");
+    args->routing.building = false;
+}
+
+// Stops building routing index and frees it.
+void StopRouting(gameArgs_t* args) {
+    CancelRouting(args);
+    if(args->routing.index) FreeRouteIndex(args,args->routing.index);
+    args->routing.index = NULL;
+}
+
+// Returns lower bound of distance between rooms v and x given by landmarks, or -1 if they are not connected.
+int LandmarkBound(routeIndex_t* index, int v, int x) {
+    int l, bound = 0;
+    for(l=0;l<ALT_LANDMARKS;l++) {
+        int* dist = index->landmarkDist+(long)l*index->roomCount;
+        if((dist[v] == -1) != (dist[x] == -1)) return -1;
+        int diff = dist[v] > dist[x] ? dist[v]-dist[x] : dist[x]-dist[v];
+        if(diff > bound) bound = diff;
+    }
+    return bound;
+}
+
+// Adds room with key to the A* priority queue of index.
+void HeapPush(routeIndex_t* index, long* heapLen, int key, int room) {
+    if(*heapLen == index->heapCap) {
+        index->heapCap = index->heapCap ? 2*index->heapCap : 1024;
+        index->heap = (int*)realloc(index->heap,sizeof(int)*2*index->heapCap);
+        if(!index->heap) ERR("realloc");
+    }
+    long i = (*heapLen)++;
+    while(i > 0 && index->heap[2*((i-1)/2)] > key) {
+        index->heap[2*i] = index->heap[2*((i-1)/2)];
+        index->heap[2*i+1] = index->heap[2*((i-1)/2)+1];
+        i = (i-1)/2;
+    }
+    index->heap[2*i] = key;
+    index->heap[2*i+1] = room;
+}
+
+// Removes room with the smallest key from the A* priority queue of index and returns it, storing its key in key.
+int HeapPop(routeIndex_t* index, long* heapLen, int* key) {
+    int* heap = index->heap;
+    int room = heap[1];
+    *key = heap[0];
+    long i = 0, len = --(*heapLen);
+    int lastKey = heap[2*len], lastRoom = heap[2*len+1];
+    while(2*i+1 < len) {
+        long child = 2*i+1;
+        if(child+1 < len && heap[2*(child+1)] < heap[2*child]) child++;
+        if(heap[2*child] >= lastKey) break;
+        heap[2*i] = heap[2*child];
+        heap[2*i+1] = heap[2*child+1];
+        i = child;
+    }
+    heap[2*i] = lastKey;
+    heap[2*i+1] = lastRoom;
+    return room;
+}
+
+// Finds shortest path from current room to room x with A* search guided by landmark bounds.
+// Returns length of the path or -1 if x is unreachable, path can be read back through searchParent.
+int LandmarkSearch(gameArgs_t* args, routeIndex_t* index, int x) {
+    graph_t* graph = &args->graph;
+    int n = args->roomCount, key, start = args->currentRoom;
+    long heapLen = 0;
+    if(!index->searchDist) {
+        index->searchDist = (int*)malloc(sizeof(int)*n);
+        index->searchParent = (int*)malloc(sizeof(int)*n);
+        index->searchStamp = (unsigned int*)calloc(n,sizeof(unsigned int));
+        if(!index->searchDist || !index->searchParent || !index->searchStamp) ERR("malloc");
+    }
+    if(LandmarkBound(index,start,x) == -1) return -1;
+    if(++index->searchCount == 0) { // Stamps wrapped around, rooms would look visited by an old query.
+        memset(index->searchStamp,0,sizeof(unsigned int)*n);
+        index->searchCount = 1;
+    }
+    unsigned int stamp = index->searchCount;
+    index->searchDist[start] = 0;
+    index->searchParent[start] = -1;
+    index->searchStamp[start] = stamp;
+    HeapPush(index,&heapLen,LandmarkBound(index,start,x),start);
+    while(heapLen > 0) {
+        int u = HeapPop(index,&heapLen,&key);
+        if(u == x) return index->searchDist[x];
+        if(key != index->searchDist[u]+LandmarkBound(index,u,x)) continue; // Outdated entry.
+        for(long j=graph->offsets[u];j<graph->offsets[u+1];j++) {
+            int v = graph->neighbors[j];
+            int dist = index->searchDist[u]+1;
+            if(index->searchStamp[v] == stamp && index->searchDist[v] <= dist) continue;
+            index->searchStamp[v] = stamp;
+            index->searchDist[v] = dist;
+            index->searchParent[v] = u;
+            HeapPush(index,&heapLen,dist+LandmarkBound(index,v,x),v);
+        }
+    }
+    return -1;
+}
+
+// Finds shortest path from current room to room x using routing index. If the index is not ready yet,
+// falls back to exact search with one thread for every processor.
+findPathReturnArgs_t* FindRoutedPath(gameArgs_t* args, int x) {
+    routeIndex_t* index = __atomic_load_n(&args->routing.index,__ATOMIC_ACQUIRE);
+    if(!index) return FindExactPath(args,ProcessorCount(),x);
+    findPathReturnArgs_t* returnArgs = (findPathReturnArgs_t*)malloc(sizeof(findPathReturnArgs_t));
+    if(!returnArgs) ERR("malloc");
+    int i, room, n = args->roomCount, start = args->currentRoom;
+    if(index->mode == ROUTE_TABLE) {
+        uint16_t* row = index->nextHop+(long)x*n;
+        returnArgs->ok = row[start] != NO_HOP;
+        returnArgs->len = 0;
+        for(room=start;returnArgs->ok && room!=x;room=row[room]) { // Every hop is checked, a loop in the table ends after n steps.
+            returnArgs->ok = row[room] != NO_HOP && IsNeighbor(&args->graph,room,row[room]) && ++returnArgs->len < n;
+        }
+        if(!returnArgs->ok) returnArgs->len = 0;
+        returnArgs->path = (int*)malloc(sizeof(int)*(returnArgs->len+1));
+        if(!returnArgs->path) ERR("malloc");
+        for(i=0,room=start;i<=returnArgs->len;i++,room=row[room]) returnArgs->path[i] = room;
+    }
+    else {
+        int len = LandmarkSearch(args,index,x);
+        returnArgs->ok = len != -1;
+        returnArgs->len = returnArgs->ok ? len : 0;
+        returnArgs->path = (int*)malloc(sizeof(int)*(returnArgs->len+1));
+        if(!returnArgs->path) ERR("malloc");
+        returnArgs->path[0] = start;
+        for(i=returnArgs->len,room=x;returnArgs->ok && i>=0;i--,room=index->searchParent[room]) returnArgs->path[i] = room;
+    }
+    return returnArgs;
+}
+
+// Adds room v or the items in it to found if they are the target, up to cap. Returns the number found after v.
+int SolveFound(solveWorker_t* worker, int v, int target, int room, int* found, int count, int cap) {
+    int i;
+    if(target == TARGET_ROOM && v == room) found[count++] = v;
+    else if(target == TARGET_FREE_ROOM && v != room && worker->itemsInRoom[v] < 2) found[count++] = v;
+    else if(target == TARGET_DELIVERY || target == TARGET_BLOCKER) {
+        for(i=0;i<worker->itemsInRoom[v] && count < cap;i++) {
+            int item = worker->roomSlots[2*v+i], dest = worker->solver->itemDest[item];
+            if(dest != v && (target == TARGET_DELIVERY ? worker->itemsInRoom[dest] < 2 : worker->wanted[v] > 0)) found[count++] = item;
+        }
+    }
+    return count;
+}
+
+// Finds up to cap nearest rooms or items of kind target from room from in the state of worker. Returns how many were found.
+int SolveSearch(solveWorker_t* worker, int from, int target, int room, int* found, int cap) {
+    solver_t* solver = worker->solver;
+    graph_t* graph = solver->graph;
+    int head = 0, tail = 0, count;
+    if(++worker->searchCount == 0) { // Stamps wrapped around, rooms would look visited by an old search.
+        memset(worker->stamp,0,sizeof(unsigned int)*solver->roomCount);
+        worker->searchCount = 1;
+    }
+    unsigned int stamp = worker->searchCount;
+    worker->dist[from] = 0;
+    worker->parent[from] = -1;
+    worker->stamp[from] = stamp;
+    worker->queue[tail++] = from;
+    count = SolveFound(worker,from,target,room,found,0,cap);
+    while(head < tail && count < cap) {
+        int v = worker->queue[head++];
+        for(long j=graph->offsets[v];j<graph->offsets[v+1] && count < cap;j++) {
+            int u = graph->neighbors[j];
+            if(worker->stamp[u] == stamp) continue;
+            worker->stamp[u] = stamp;
+            worker->dist[u] = worker->dist[v]+1;
+            worker->parent[u] = v;
+            worker->queue[tail++] = u;
+            count = SolveFound(worker,u,target,room,found,count,cap);
+        }
+    }
+    return count;
+}
+
+// Sets state of worker back to the game when solve started, with an empty plan.
+void ResetSolveState(solveWorker_t* worker) {
+    solver_t* solver = worker->solver;
+    int i;
+    memcpy(worker->items,solver->items,sizeof(int)*solver->itemCount);
+    memset(worker->itemsInRoom,0,sizeof(int)*solver->roomCount);
+    memset(worker->wanted,0,sizeof(int)*solver->roomCount);
+    memset(worker->roomSlots,0xff,sizeof(int)*2*solver->roomCount);
+    worker->misplacedCount = 0;
+    for(i=0;i<solver->itemCount;i++) {
+        int room = worker->items[i], dest = solver->itemDest[i];
+        if(room != dest) {
+            worker->misplacedCount++;
+            worker->wanted[dest]++;
+        }
+        if(room >= 0) worker->roomSlots[2*room+worker->itemsInRoom[room]++] = i;
+    }
+    worker->currentRoom = solver->currentRoom;
+    worker->itemHeld = solver->itemHeld;
+    worker->len = 0;
+}
+
+// Returns the number of commands of the plan of worker so far.
+int PlanTotal(solveWorker_t* worker) {
+    return worker->len ? worker->plan[worker->len-1].total : 0;
+}
+
+// Returns the least number of commands needed to finish the game from the state of worker: every misplaced item
+// must be picked up, moved at least once and dropped, and held item only moved (unless it is in its room) and dropped.
+int SolveBound(solveWorker_t* worker) {
+    int held = worker->itemHeld;
+    if(held == -1) return 3*worker->misplacedCount;
+    return 3*worker->misplacedCount-(worker->currentRoom == worker->solver->itemDest[held] ? 2 : 1);
+}
+
+// Applies carry of item to room to the state of worker and appends it to the plan, total being the number of
+// commands of the plan with it.
+void ApplyCarry(solveWorker_t* worker, int item, int room, int total) {
+    int dest = worker->solver->itemDest[item];
+    if(item != worker->itemHeld) {
+        int* slots = &worker->roomSlots[2*worker->items[item]];
+        if(slots[0] == item) slots[0] = slots[1];
+        slots[1] = -1;
+        worker->itemsInRoom[worker->items[item]]--;
+    }
+    worker->itemHeld = -1;
+    worker->items[item] = room;
+    worker->roomSlots[2*room+worker->itemsInRoom[room]++] = item;
+    if(room == dest) {
+        worker->misplacedCount--;
+        worker->wanted[dest]--;
+    }
+    worker->currentRoom = room;
+    if(worker->len == worker->cap) {
+        worker->cap = worker->cap ? 2*worker->cap : 1024;
+        worker->plan = (carry_t*)realloc(worker->plan,sizeof(carry_t)*worker->cap);
+        if(!worker->plan) ERR("realloc");
+    }
+    carry_t carry = {item,room,total};
+    worker->plan[worker->len++] = carry;
+}
+
+// Completes plan of worker with greedy carries, randomized if random is set. Returns false if it gets over bound or the time.
+bool CompletePlan(solveWorker_t* worker, bool random, int bound) {
+    solver_t* solver = worker->solver;
+    int found[SOLVE_CANDIDATES], room, item, pickUp, moves;
+    bool blocked = false; // Last carry took an item out of a full room.
+    while(worker->misplacedCount > 0) {
+        if(PlanTotal(worker)+SolveBound(worker) >= bound) return false;
+        if(worker->len % SOLVE_CHECK == 0
+           && (__atomic_load_n(&solver->stop,__ATOMIC_RELAXED) || MonotonicNs() >= solver->end)) return false;
+        if(worker->itemHeld != -1) {
+            item = worker->itemHeld;
+            pickUp = worker->currentRoom;
+            moves = 0;
+        }
+        else {
+            int count = SolveSearch(worker,worker->currentRoom,TARGET_DELIVERY,-1,found,random ? SOLVE_CANDIDATES : 1);
+            if(count == 0 && (blocked || !SolveSearch(worker,worker->currentRoom,TARGET_BLOCKER,-1,found,1))) return false; // Unreachable items.
+            int choice = 0;
+            while(choice < count-1 && RngBelow(&worker->rng,2)) choice++;
+            item = found[choice];
+            pickUp = worker->items[item];
+            moves = worker->dist[pickUp]+1;
+            blocked = count == 0;
+        }
+        int dest = solver->itemDest[item];
+        if(worker->itemsInRoom[dest] < 2 && !SolveSearch(worker,pickUp,TARGET_ROOM,dest,&room,1)) return false;
+        if(worker->itemsInRoom[dest] == 2 && !SolveSearch(worker,pickUp,TARGET_FREE_ROOM,blocked ? pickUp : -1,&room,1)) return false;
+        moves += worker->dist[room]+1;
+        ApplyCarry(worker,item,room,PlanTotal(worker)+moves);
+    }
+    return true;
+}
+
+// Adds distances of misplaced items from their rooms to lower bound of solver, until all are found or the time is over.
+void SolveDistances(solveWorker_t* worker) {
+    solver_t* solver = worker->solver;
+    int room, k, none;
+    while(!__atomic_load_n(&solver->stop,__ATOMIC_RELAXED) && MonotonicNs() < solver->end) {
+        room = __atomic_fetch_add(&solver->nextRoom,1,__ATOMIC_RELAXED);
+        if(room >= solver->roomCount) break;
+        if(solver->destItems[2*room] == -1) k = 0;
+        else {
+            SolveSearch(worker,room,TARGET_ROOM,-1,&none,1); // Finds distances from room to all rooms.
+            for(k=0;k<2 && solver->destItems[2*room+k] != -1;k++) {
+                int item = solver->destItems[2*room+k], from = item == solver->itemHeld ? solver->currentRoom : solver->items[item];
+                __atomic_fetch_add(&solver->distanceSum,worker->stamp[from] == worker->searchCount ? worker->dist[from] : 0,__ATOMIC_RELAXED);
+            }
+        }
+        if(__atomic_add_fetch(&solver->roomsDone,1,__ATOMIC_ACQ_REL) < solver->roomCount) continue;
+        pthread_mutex_lock(&solver->mutex); // The last room, every move of the bound becomes the whole distance.
+        solver->lowerBound = 2*solver->misplacedCount-(solver->itemHeld != -1)+__atomic_load_n(&solver->distanceSum,__ATOMIC_RELAXED);
+        if(solver->bestTotal <= solver->lowerBound) {
+            __atomic_store_n(&solver->stop,true,__ATOMIC_RELAXED);
+            if(pthread_cond_signal(&solver->changed)) ERR("pthread_cond_signal");
+        }
+        pthread_mutex_unlock(&solver->mutex);
+    }
+}
+
+// Function passed to threads of solve, builds plans from random parts of the best one until the time budget is over.
+void* SolveWork(void* pVoid) {
+    solveWorker_t* worker = pVoid;
+    solver_t* solver = worker->solver;
+    int i;
+    while(worker->greedy || (!__atomic_load_n(&solver->stop,__ATOMIC_RELAXED) && MonotonicNs() < solver->end)) {
+        if(!worker->greedy && solver->destItems) SolveDistances(worker);
+        ResetSolveState(worker);
+        pthread_mutex_lock(&solver->mutex);
+        int bound = solver->bestTotal, keep = solver->bestLen > 0 && !worker->greedy ? RngBelow(&worker->rng,solver->bestLen) : 0;
+        for(i=0;i<keep;i++) ApplyCarry(worker,solver->best[i].item,solver->best[i].room,solver->best[i].total);
+        pthread_mutex_unlock(&solver->mutex);
+        bool done = CompletePlan(worker,!worker->greedy,bound);
+        worker->greedy = false;
+        __atomic_fetch_add(&solver->plans,1,__ATOMIC_RELAXED);
+        if(!done) continue;
+        pthread_mutex_lock(&solver->mutex);
+        if(PlanTotal(worker) < solver->bestTotal) {
+            solver->best = (carry_t*)realloc(solver->best,sizeof(carry_t)*(worker->len+1));
+            if(!solver->best) ERR("realloc");
+            memcpy(solver->best,worker->plan,sizeof(carry_t)*worker->len);
+            solver->bestLen = worker->len;
+            solver->bestTotal = PlanTotal(worker);
+            if(solver->bestTotal <= solver->lowerBound) {
+                __atomic_store_n(&solver->stop,true,__ATOMIC_RELAXED);
+                if(pthread_cond_signal(&solver->changed)) ERR("pthread_cond_signal");
+            }
+        }
+        pthread_mutex_unlock(&solver->mutex);
+    }
+    return NULL;
+}
+
+// Writes best plan of solver to path as game commands, one per line, replaying it in worker to find the rooms
+// the player walks through.
+void WritePlan(solver_t* solver, solveWorker_t* worker, char* path) {
+    FILE* file = fopen(path,"w");
+    int i, room, *rooms = (int*)malloc(sizeof(int)*solver->roomCount);
+    if(!file) ERR("fopen");
+    if(!rooms) ERR("malloc");
+    ResetSolveState(worker);
+    for(i=0;i<solver->bestLen;i++) {
+        carry_t* carry = &solver->best[i];
+        int stops[2] = {worker->itemHeld == carry->item ? -1 : worker->items[carry->item],carry->room};
+        for(int k=0;k<2;k++) {
+            if(stops[k] == -1) continue;
+            SolveSearch(worker,worker->currentRoom,TARGET_ROOM,stops[k],&room,1);
+            int len = worker->dist[room];
+            for(int j=len-1;j>=0;j--,room=worker->parent[room]) rooms[j] = room;
+            for(int j=0;j<len;j++) fprintf(file,"move-to %d\n",rooms[j]);
+            worker->currentRoom = stops[k];
+            fprintf(file,k == 0 ? "pick-up %d\n" : "drop %d\n",carry->item);
+        }
+        ApplyCarry(worker,carry->item,carry->room,carry->total);
+    }
+    free(rooms);
+    if(fclose(file)) ERR("fclose");
+}
+
+// Prepares solver for a search from the current state of game in args, called under mutex of the game.
+void InitSolver(solver_t* solver, gameArgs_t* args) {
+    memset(solver,0,sizeof(solver_t));
+    solver->graph = &args->graph;
+    solver->roomCount = args->roomCount;
+    solver->itemCount = 3*args->roomCount/2;
+    solver->items = (int*)malloc(sizeof(int)*solver->itemCount);
+    solver->itemDest = (int*)malloc(sizeof(int)*solver->itemCount);
+    if(!solver->items || !solver->itemDest) ERR("malloc");
+    memcpy(solver->items,args->items,sizeof(int)*solver->itemCount);
+    memcpy(solver->itemDest,args->itemDest,sizeof(int)*solver->itemCount);
+    solver->currentRoom = args->currentRoom;
+    solver->itemHeld = args->itemHeld;
+    solver->misplacedCount = args->misplacedCount;
+    solver->lowerBound = 3*args->misplacedCount;
+    if(args->itemHeld != -1) solver->lowerBound -= args->currentRoom == args->itemDest[args->itemHeld] ? 2 : 1;
+    if((double)args->roomCount*(args->roomCount+args->graph.offsets[args->roomCount]) <= SOLVE_BOUND_WORK) {
+        solver->destItems = (int*)malloc(sizeof(int)*2*args->roomCount);
+        if(!solver->destItems) ERR("malloc");
+        memset(solver->destItems,0xff,sizeof(int)*2*args->roomCount);
+        for(int i=0;i<solver->itemCount;i++) {
+            int dest = solver->itemDest[i];
+            if(solver->items[i] != dest) solver->destItems[2*dest+(solver->destItems[2*dest] != -1)] = i;
+        }
+    }
+    if(pthread_mutex_init(&solver->mutex,NULL)) ERR("pthread_mutex_init");
+    if(pthread_cond_init(&solver->changed,NULL)) ERR("pthread_cond_init");
+    solver->bestLen = -1;
+    solver->bestTotal = INT_MAX;
+}
+
+// Frees memory of solver.
+void FreeSolver(solver_t* solver) {
+    free(solver->items);
+    free(solver->itemDest);
+    free(solver->destItems);
+    free(solver->best);
+    if(pthread_mutex_destroy(&solver->mutex)) ERR("pthread_mutex_destroy");
+    if(pthread_cond_destroy(&solver->changed)) ERR("pthread_cond_destroy");
+}
+
+// Allocates state of worker for plans of solver, the first one being the greedy plan if greedy is set.
+void InitSolveWorker(solveWorker_t* worker, solver_t* solver, bool greedy, uint64_t seed) {
+    int n = solver->roomCount;
+    memset(worker,0,sizeof(solveWorker_t));
+    worker->solver = solver;
+    worker->greedy = greedy;
+    RngSeed(&worker->rng,seed);
+    worker->items = (int*)malloc(sizeof(int)*solver->itemCount);
+    worker->roomSlots = (int*)malloc(sizeof(int)*2*n);
+    worker->itemsInRoom = (int*)malloc(sizeof(int)*n);
+    worker->wanted = (int*)malloc(sizeof(int)*n);
+    worker->dist = (int*)malloc(sizeof(int)*n);
+    worker->parent = (int*)malloc(sizeof(int)*n);
+    worker->stamp = (unsigned int*)calloc(n,sizeof(unsigned int));
+    worker->queue = (int*)malloc(sizeof(int)*n);
+    if(!worker->items || !worker->roomSlots || !worker->itemsInRoom || !worker->wanted || !worker->dist
+       || !worker->parent || !worker->stamp || !worker->queue) ERR("malloc");
+}
+
+// Frees memory of worker.
+void FreeSolveWorker(solveWorker_t* worker) {
+    free(worker->items);
+    free(worker->roomSlots);
+    free(worker->itemsInRoom);
+    free(worker->wanted);
+    free(worker->plan);
+    free(worker->dist);
+    free(worker->parent);
+    free(worker->stamp);
+    free(worker->queue);
+}
+
+// Searches for a short plan finishing the game copied into solver for the given number of seconds and reports it to out.
+void Solve(solver_t* solver, double seconds, char* planPath, outBuffer_t* out) {
+    int i, threadCount = ProcessorCount();
+    uint64_t start = MonotonicNs(), report = start+SOLVE_REPORT_MS*1000000ULL;
+    solveWorker_t* workers = (solveWorker_t*)calloc(threadCount,sizeof(solveWorker_t));
+    if(!workers) ERR("calloc");
+    solver->end = start+(uint64_t)(seconds*1.0e9);
+    for(i=0;i<threadCount;i++) {
+        InitSolveWorker(&workers[i],solver,i == 0,start+i);
+        if(pthread_create(&workers[i].thread,NULL,SolveWork,&workers[i])) ERR("pthread_create");
+    }
+    pthread_mutex_lock(&solver->mutex);
+    while(!solver->stop) {
+        uint64_t now = MonotonicNs(), wake = report < solver->end ? report : solver->end;
+        if(now >= solver->end) break;
+        if(now >= report) {
+            if(solver->bestLen < 0) OutPrintf(out,"Solving: no plan yet after %.0f s\n",(now-start)*1.0e-9);
+            else OutPrintf(out,"Solving: best plan has %d moves after %.0f s and %ld plans\n",solver->bestTotal,(now-start)*1.0e-9,
+                           __atomic_load_n(&solver->plans,__ATOMIC_RELAXED));
+            OutFlush(out);
+            report += SOLVE_REPORT_MS*1000000ULL;
+            continue;
+        }
+        struct timespec deadline;
+        if(clock_gettime(CLOCK_REALTIME,&deadline)) ERR("clock_gettime");
+        uint64_t ns = deadline.tv_nsec+(wake-now);
+        deadline.tv_sec += ns/1000000000;
+        deadline.tv_nsec = ns%1000000000;
+        int result = pthread_cond_timedwait(&solver->changed,&solver->mutex,&deadline);
+        if(result && result != ETIMEDOUT) ERR("pthread_cond_timedwait");
+    }
+    __atomic_store_n(&solver->stop,true,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&solver->mutex);
+    for(i=0;i<threadCount;i++) {
+        if(pthread_join(workers[i].thread,NULL)) ERR("pthread_join");
+    }
+    double elapsed = (MonotonicNs()-start)*1.0e-9;
+    if(solver->bestLen < 0) OutPrintf(out,"No plan found in %.2f s, the time was too short or some items cannot be reached\n",elapsed);
+    else {
+        OutPrintf(out,"Plan has %d moves (at least %d are needed), best of %ld plans found by %d threads in %.2f s\n",
+                  solver->bestTotal,solver->lowerBound,solver->plans,threadCount,elapsed);
+        if(planPath) WritePlan(solver,&workers[0],planPath);
+    }
+    for(i=0;i<threadCount;i++) FreeSolveWorker(&workers[i]);
+    free(workers);
+}
+
+// Adds an event to the journal, called under mutex of the game right after the event changed it.
+// movesCount is the number of moves after the event. The event reaches the file within JOURNAL_COMMIT_MS.
+void JournalEvent(gameArgs_t* args, int type, int a, int b, int movesCount) {
+    journal_t* journal = args->journal;
+    if(!journal) return;
+    pthread_mutex_lock(&journal->mutex);
+    if(journal->pendingLen == journal->pendingCap) {
+        journal->pendingCap = journal->pendingCap ? 2*journal->pendingCap : JOURNAL_BATCH;
+        journal->pending = (journalRecord_t*)realloc(journal->pending,sizeof(journalRecord_t)*journal->pendingCap);
+        if(!journal->pending) ERR("realloc");
+    }
+    journalRecord_t* record = &journal->pending[journal->pendingLen++];
+    memset(record,0,sizeof(*record));
+    record->seq = journal->nextSeq++;
+    record->type = type;
+    record->movesCount = movesCount;
+    record->a = a;
+    record->b = b;
+    record->check = JournalChecksum(record);
+    if(journal->pendingLen == JOURNAL_BATCH) pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+// Writes pending events to the journal file and flushes it, called by the autosave thread. Events
+// older than the file, already covered by a snapshot, are skipped. Returns number of bytes written.
+uint64_t FlushJournal(journal_t* journal) {
+    pthread_mutex_lock(&journal->mutex);
+    journalRecord_t* records = journal->pending;
+    int len = journal->pendingLen, cap = journal->pendingCap, i = 0;
+    journal->pending = journal->writing;
+    journal->pendingCap = journal->writingCap;
+    journal->pendingLen = 0;
+    journal->writing = records;
+    journal->writingCap = cap;
+    pthread_mutex_unlock(&journal->mutex);
+    while(i < len && records[i].seq < journal->firstSeq) i++;
+    if(i == len) return 0;
+    WriteAll(journal->fd,records+i,sizeof(journalRecord_t)*(len-i));
+    if(fdatasync(journal->fd)) ERR("fdatasync");
+    journal->writtenSeq = records[len-1].seq+1;
+    return sizeof(journalRecord_t)*(len-i);
+}
+
+// Replaces the journal file with one starting from event seq, keeping written events not older than it.
+// The new file is written under a temporary name and renamed, like save files.
+void RotateJournal(journal_t* journal, uint64_t seq) {
+    char tmpPath[MAX_PATH+16];
+    journalRecord_t records[JOURNAL_BATCH];
+    journalHeader_t header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,JOURNAL_MAGIC,sizeof(header.magic));
+    header.sessionId = journal->sessionId;
+    header.firstSeq = seq;
+    snprintf(tmpPath,sizeof(tmpPath),"%s.tmp",journal->path);
+    int out = open(tmpPath,O_WRONLY|O_CREAT|O_TRUNC,0777);
+    if(out < 0) ERR("open");
+    WriteAll(out,&header,sizeof(header));
+    if(journal->fd >= 0 && journal->writtenSeq > seq) {
+        off_t offset = sizeof(header)+(seq-journal->firstSeq)*sizeof(journalRecord_t);
+        uint64_t left = journal->writtenSeq-seq;
+        while(left > 0) {
+            size_t count = left < JOURNAL_BATCH ? left : JOURNAL_BATCH;
+            if(pread(journal->fd,records,sizeof(journalRecord_t)*count,offset) != (ssize_t)(sizeof(journalRecord_t)*count)) ERR("pread");
+            WriteAll(out,records,sizeof(journalRecord_t)*count);
+            offset += sizeof(journalRecord_t)*count;
+            left -= count;
+        }
+    }
+    if(fdatasync(out)) ERR("fdatasync");
+    if(rename(tmpPath,journal->path)) ERR("rename");
+    if(!SyncDirectory(journal->path)) ERR("fsync");
+    if(journal->fd >= 0 && close(journal->fd)) ERR("close");
+    journal->fd = out;
+    journal->firstSeq = seq;
+    if(journal->writtenSeq < seq) journal->writtenSeq = seq;
+}
+
+// Stops signal handling and autosave threads of the game, writing remaining journal events.
+// Called with mutex of the game unlocked.
+void StopGameThreads(gameArgs_t* args) {
+    journal_t* journal = args->journal;
+    if(!args->gameThreads) return;
+    args->gameThreads = false;
+    pthread_cancel(args->signalThread);
+    if(pthread_join(args->signalThread,NULL)) ERR("pthread_join");
+    if(args->live) {
+        pthread_cancel(args->autosaveThread);
+        if(pthread_join(args->autosaveThread,NULL)) ERR("pthread_join");
+        if(close(args->liveTimer)) ERR("close");
+        SyncLive(args);
+        return;
+    }
+    pthread_mutex_lock(&journal->mutex);
+    journal->stop = true;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->mutex);
+    if(pthread_join(args->autosaveThread,NULL)) ERR("pthread_join");
+    if(close(journal->fd)) ERR("close");
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_cond_destroy(&journal->wake);
+    free(journal->pending);
+    free(journal->writing);
+    free(journal);
+    args->journal = NULL;
+}
+
+// Frees dynamically allocated memory, called with mutex of the game locked.
+void FreeMemory(gameArgs_t *args) {
+    pthread_mutex_unlock(args->mutex);
+    StopGameThreads(args);
+    if(args->walkPool) DestroyWalkPool(args->walkPool);
+    args->walkPool = NULL;
+    StopRouting(args);
+    ReleaseGame(args);
+}
+
+// Prints summary of a headless game: speed of the game engine and hash of the final state,
+// which is the same in every replay of the same script.
+void PrintSummary(gameArgs_t* args, long commands, struct timespec* start) {
+    struct timespec end;
+    int i, numberOfItems = 3*args->roomCount/2;
+    int state[3] = {args->movesCount,args->itemHeld,args->currentRoom};
+    uint64_t hash = 14695981039346656037ULL;
+    for(i=0;i<3;i++) hash = (hash ^ (uint32_t)state[i])*1099511628211ULL;
+    for(i=0;i<numberOfItems;i++) hash = (hash ^ (uint32_t)args->items[i])*1099511628211ULL;
+    if(clock_gettime(CLOCK_MONOTONIC,&end)) ERR("clock_gettime");
+    double elapsed = ELAPSED(*start,end);
+    printf("Commands: %ld, time: %.3f s, %.0f commands/s, moves: %d, misplaced items: %d, state hash: %016llx\n",
+           commands,elapsed,elapsed > 0 ? commands/elapsed : 0.0,args->movesCount,args->misplacedCount,(unsigned long long)hash);
+}
+
+// Splits a command line in place into at most count words separated by spaces, storing NULL for missing ones.
+// The first word is never NULL, an empty line gives an empty command.
+void SplitCommand(char* text, char** words, int count) {
+    int i;
+    for(i=0;i<count;i++) {
+        while(*text == ' ' || *text == '\r' || *text == '\n') text++;
+        words[i] = *text ? text : NULL;
+        while(*text && *text != ' ' && *text != '\r' && *text != '\n') text++;
+        if(*text) *text++ = '\0';
+    }
+    if(!words[0]) words[0] = "";
+}
+
+// Returns commandId of word. Commands are told apart by their first letters and confirmed with a single
+// comparison, instead of comparing the word with every command in turn.
+int CommandId(const char* word) {
+    switch(word[0]) {
+        case 'm':
+            if(word[1] == 'o') return strcmp(word,"move-to") == 0 ? CMD_MOVE_TO : CMD_UNKNOWN;
+            if(word[1] == 'u') return strcmp(word,"multiplayer") == 0 ? CMD_MULTIPLAYER : CMD_UNKNOWN;
+            return strcmp(word,"map-from-dir-tree") == 0 ? CMD_MAP_FROM_DIR_TREE : CMD_UNKNOWN;
+        case 'p': return strcmp(word,"pick-up") == 0 ? CMD_PICK_UP : CMD_UNKNOWN;
+        case 'd': return strcmp(word,"drop") == 0 ? CMD_DROP : CMD_UNKNOWN;
+        case '#': return strcmp(word,"#swap") == 0 ? CMD_SWAP : CMD_UNKNOWN;
+        case 'f': return strcmp(word,"find-path") == 0 ? CMD_FIND_PATH : CMD_UNKNOWN;
+        case 'q': return strcmp(word,"quit") == 0 ? CMD_QUIT : CMD_UNKNOWN;
+        case 's':
+            if(word[1] == 'a') return strcmp(word,"save") == 0 ? CMD_SAVE : CMD_UNKNOWN;
+            if(word[1] == 'e') return strcmp(word,"seed") == 0 ? CMD_SEED : strcmp(word,"self-play") == 0 ? CMD_SELF_PLAY : CMD_UNKNOWN;
+            if(strcmp(word,"stats") == 0) return CMD_STATS;
+            if(word[1] == 'o') return strcmp(word,"solve") == 0 ? CMD_SOLVE : CMD_UNKNOWN;
+            return strcmp(word,"start-game") == 0 ? CMD_START_GAME : CMD_UNKNOWN;
+        case 'e': return strcmp(word,"exit") == 0 ? CMD_EXIT : CMD_UNKNOWN;
+        case 'g': return strcmp(word,"generate-random-map") == 0 ? CMD_GENERATE_RANDOM_MAP : CMD_UNKNOWN;
+        case 'l': return strcmp(word,"load-game") == 0 ? CMD_LOAD_GAME : CMD_UNKNOWN;
+        case 'j': return strcmp(word,"join-game") == 0 ? CMD_JOIN_GAME : CMD_UNKNOWN;
+        case 'c': return strcmp(word,"convert-save") == 0 ? CMD_CONVERT_SAVE : CMD_UNKNOWN;
+        case 'a': return strcmp(word,"analyze-map") == 0 ? CMD_ANALYZE_MAP : CMD_UNKNOWN;
+        case 'h': return strcmp(word,"hint") == 0 ? CMD_HINT : CMD_UNKNOWN;
+        default: return CMD_UNKNOWN;
+    }
+}
+
+// Adds runtime metrics of the process to out as one line of JSON.
+void PrintMetrics(outBuffer_t* out) {
+    int i;
+    bool first = true;
+    OutPrintf(out,"{\"sampleEvery\":%d,\"commands\":{",METRICS_SAMPLE);
+    for(i=0;i<CMD_COUNT;i++) {
+        uint64_t count = __atomic_load_n(&metrics.commands[i],__ATOMIC_RELAXED);
+        if(count == 0) continue;
+        OutPrintf(out,"%s\"%s\":{\"count\":%llu,\"timeNs\":",first ? "" : ",",commandNames[i],(unsigned long long)count);
+        OutHistogram(out,&metrics.commandTimes[i]);
+        OutText(out,"}");
+        first = false;
+    }
+    OutPrintf(out,"},\"gameLock\":{\"locks\":%llu,\"waits\":%llu,\"waitNs\":",
+              (unsigned long long)__atomic_load_n(&metrics.locks,__ATOMIC_RELAXED),(unsigned long long)__atomic_load_n(&metrics.lockWaits,__ATOMIC_RELAXED));
+    OutHistogram(out,&metrics.lockWaitTimes);
+    OutText(out,"},\"autosave\":{\"snapshotNs\":");
+    OutHistogram(out,&metrics.snapshotTimes);
+    OutText(out,",\"journalWriteNs\":");
+    OutHistogram(out,&metrics.journalTimes);
+    OutText(out,",\"liveSyncNs\":");
+    OutHistogram(out,&metrics.liveSyncTimes);
+    OutPrintf(out,",\"bytes\":%llu},\"save\":{\"timeNs\":",(unsigned long long)__atomic_load_n(&metrics.autosaveBytes,__ATOMIC_RELAXED));
+    OutHistogram(out,&metrics.saveTimes);
+    OutPrintf(out,",\"bytes\":%llu},\"load\":{\"timeNs\":",(unsigned long long)__atomic_load_n(&metrics.saveBytes,__ATOMIC_RELAXED));
+    OutHistogram(out,&metrics.loadTimes);
+    uint64_t searches = __atomic_load_n(&metrics.findPaths,__ATOMIC_RELAXED), found = __atomic_load_n(&metrics.pathsFound,__ATOMIC_RELAXED);
+    OutPrintf(out,"},\"findPath\":{\"searches\":%llu,\"found\":%llu,\"successRate\":%.4f,\"pathLength\":",
+              (unsigned long long)searches,(unsigned long long)found,searches ? (double)found/searches : 0.0);
+    OutHistogram(out,&metrics.pathLengths);
+    OutText(out,",\"walkSteps\":");
+    OutHistogram(out,&metrics.walkLengths);
+    OutText(out,"}}\n");
+}
+
+// Function passed to the thread writing metrics to stderr on every SIGUSR2, which is blocked in other threads.
+void* MetricsWork(void* pVoid) {
+    sigset_t* mask = pVoid;
+    outBuffer_t out = {NULL,0,0,STDERR_FILENO};
+    int signo;
+    while(1) {
+        if(sigwait(mask,&signo)) ERR("sigwait");
+        PrintMetrics(&out);
+        OutFlush(&out);
+    }
+    return NULL;
+}
+
+// Runs one game command with commandId id, called under mutex of the game. Messages go to output of the game.
+// Returns COMMAND_QUIT for quit and COMMAND_FINISHED if the command ended the game, which is then left for the caller to free.
+int RunCommand(gameArgs_t* args, int id, char* arg1, char* arg2, char* arg3) {
+    int i, tmp = arg1 ? atoi(arg1) : -1;
+    switch(id) { // Commands that only read the game.
+        case CMD_QUIT: return COMMAND_QUIT;
+        case CMD_STATS:
+            PrintMetrics(args->output);
+            break;
+        case CMD_SAVE:
+            if(!arg1) break;
+            if(SaveGame(args,arg1)) args->saveCount++;
+            else OutPrintf(args->output,"Cannot save to %s: %s\n",arg1,strerror(errno));
+            break;
+        case CMD_FIND_PATH: {
+            if(!arg1 || !arg2) break;
+            bool exact = strcmp(arg1,"--exact") == 0, route = strcmp(arg1,"--route") == 0;
+            int k = route ? 1 : atoi(exact ? arg2 : arg1);
+            int x = route ? atoi(arg2) : exact ? (arg3 ? atoi(arg3) : -1) : atoi(arg2);
+            if(k < 1 || x < 0 || x >= args->roomCount) {
+                OutText(args->output,"Bad thread count or room number\n");
+                break;
+            }
+            if(exact && k > ProcessorCount()) k = ProcessorCount(); // More threads would only wait for each other.
+            if(args->session && (exact || (route && !__atomic_load_n(&args->routing.index,__ATOMIC_ACQUIRE)))) {
+                OutText(args->output,"Exact search is not available in server games\n");
+                break;
+            }
+            if(args->session && k > SESSION_MAX_WALKS) k = SESSION_MAX_WALKS;
+            // Search uses only the map and the current room, which only this thread changes, so it runs without
+            // the mutex and item swaps and autosave snapshots do not wait for it.
+            pthread_mutex_unlock(args->mutex);
+            findPathReturnArgs_t* returnArgs = route ? FindRoutedPath(args,x) : exact ? FindExactPath(args,k,x) : FindPath(args,k,x);
+            LockGame(args);
+            if(!returnArgs) {
+                OutText(args->output,"Cannot start search threads\n");
+                break;
+            }
+            __atomic_fetch_add(&metrics.findPaths,1,__ATOMIC_RELAXED);
+            if(returnArgs->ok) {
+                __atomic_fetch_add(&metrics.pathsFound,1,__ATOMIC_RELAXED);
+                HistogramAdd(&metrics.pathLengths,returnArgs->len);
+            }
+            if(!returnArgs->ok) OutText(args->output,"Couldn't find path");
+            else {
+                for(i=0;i<=returnArgs->len;i++) OutInt(args->output,returnArgs->path[i],' ');
+            }
+            FreePath(returnArgs);
+            OutText(args->output,"\n");
+            break;
+        }
+        case CMD_HINT:
+            PrintHint(args,args->output);
+            break;
+        case CMD_SOLVE: {
+            double seconds = arg1 ? atof(arg1) : SOLVE_SECONDS;
+            if(seconds > SOLVE_MAX_SECONDS) seconds = SOLVE_MAX_SECONDS; // Deadline in nanoseconds must fit in uint64_t.
+            if(!(seconds > 0)) { // Also NaN.
+                OutText(args->output,"Bad time budget\n");
+                break;
+            }
+            if(args->session) {
+                OutText(args->output,"solve is not available in server games\n");
+                break;
+            }
+            solver_t solver;
+            InitSolver(&solver,args);
+            // Search uses a copy of the game, so it runs without the mutex, like find-path.
+            pthread_mutex_unlock(args->mutex);
+            Solve(&solver,seconds,arg2,args->output);
+            LockGame(args);
+            FreeSolver(&solver);
+            break;
+        }
+    }
+    BeginChange(args); // Commands above only read the game, the rest change it.
+    switch(id) {
+        case CMD_MOVE_TO:
+            if(!arg1) break;
+            if(tmp >= 0 && tmp < args->roomCount && IsNeighbor(&args->graph,args->currentRoom,tmp)) {
+                args->currentRoom = tmp;
+                JournalEvent(args,EVENT_MOVE,tmp,-1,args->movesCount+1);
+            }
+            else OutText(args->output,"Bad room number\n");
+            break;
+        case CMD_PICK_UP:
+            if(arg1 && args->itemHeld == -1 && tmp >= 0 && tmp < 3*args->roomCount/2 && args->items[tmp] == args->currentRoom) {
+                args->itemHeld = tmp;
+                RemoveItem(args,tmp);
+                JournalEvent(args,EVENT_PICK_UP,tmp,-1,args->movesCount+1);
+            }
+            break;
+        case CMD_DROP:
+            if(arg1 && tmp == args->itemHeld && args->itemHeld != -1 && args->itemsInRoom[args->currentRoom] <= 1) {
+                PlaceItem(args,tmp,args->currentRoom);
+                args->itemHeld = -1;
+                JournalEvent(args,EVENT_DROP,tmp,-1,args->movesCount+1);
+                if(CheckIfFinished(args)) {
+                    OutPrintf(args->output,"Finished game with %d moves\n",args->movesCount);
+                    EndChange(args);
+                    return COMMAND_FINISHED;
+                }
+            }
+            break;
+        case CMD_SWAP: { // recorded SIGUSR1
+            if(!arg1 || !arg2 || !args->headless) break;
+            int b = atoi(arg2), numberOfItems = 3*args->roomCount/2;
+            if(tmp >= 0 && b >= 0 && tmp < numberOfItems && b < numberOfItems && tmp != b && tmp != args->itemHeld && b != args->itemHeld) {
+                SwapItems(args,tmp,b);
+                JournalEvent(args,EVENT_SWAP,tmp,b,args->movesCount);
+            }
+            args->movesCount--; // Not a move of the player.
+            break;
+        }
+    }
+    args->movesCount++; // every command adds to the score, even if it's invalid
+    EndChange(args);
+    return COMMAND_DONE;
+}
+
+// Runs one game command, called under mutex of the game, and counts it in metrics.
+// Returns the result of RunCommand.
+int GameCommand(gameArgs_t* args, char* cmd, char* arg1, char* arg2, char* arg3) {
+    int id = CommandId(cmd);
+    bool timed = args->metricsTicks[id]++ % METRICS_SAMPLE == 0; // Per kind, so rare commands are timed too.
+    uint64_t start = timed ? MonotonicNs() : 0;
+    int result = RunCommand(args,id,arg1,arg2,arg3);
+    ReportRouting(args);
+    __atomic_fetch_add(&metrics.commands[id],1,__ATOMIC_RELAXED);
+    if(timed) HistogramAdd(&metrics.commandTimes[id],MonotonicNs()-start);
+    return result;
+}
+
+// Main game function.
+void Play(gameArgs_t* args) {
+    char quit[] = "quit", *text, *words[4];
+    long commands = 0;
+    struct timespec start;
+    if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+    if(!args->headless) PrintGameState(args,args->output);
+    while(1) {
+        if(!(text = ReadLine(args->input,args->output))) text = quit; // End of input ends the game.
+        LockGame(args);
+        if(args->record) { // Under the mutex, so swaps are recorded in the order they happened.
+            fputs(text,args->record);
+            fputc('\n',args->record);
+        }
+        SplitCommand(text,words,4);
+        commands++;
+        if(GameCommand(args,words[0],words[1],words[2],words[3]) != COMMAND_DONE) {
+            OutFlush(args->output);
+            if(args->headless) PrintSummary(args,commands,&start);
+            FreeMemory(args);
+            return;
+        }
+        pthread_mutex_unlock(args->mutex);
+        if(!args->headless) PrintGameState(args,args->output);
+    }
+}
+
+// Writes snapshot of the game copied under the seqlock to autosave path and starts a new journal file from it.
+void Snapshot(gameArgs_t* args) {
+    journal_t* journal = args->journal;
+    int numberOfItems = 3*args->roomCount/2;
+    size_t sizes[4] = {sizeof(int)*numberOfItems,sizeof(int)*args->roomCount,sizeof(int)*2*args->roomCount,sizeof(uint64_t)*BITSET_WORDS(numberOfItems)};
+    void* copies[4];
+    gameArgs_t copy;
+    uint64_t seq, start = MonotonicNs();
+    int i, attempt;
+    for(i=0;i<4;i++) if(!(copies[i] = malloc(sizes[i] ? sizes[i] : 1))) ERR("malloc");
+    printf("\nAutosaving to %s\n",args->autosavePath);
+    fflush(stdout);
+    for(attempt=0;;attempt++) {
+        if(attempt == SNAPSHOT_RETRIES) LockGame(args);
+        unsigned long version = ReadBegin(args);
+        copy = *args;
+        copy.items = memcpy(copies[0],args->items,sizes[0]);
+        copy.itemsInRoom = memcpy(copies[1],args->itemsInRoom,sizes[1]);
+        copy.roomSlots = memcpy(copies[2],args->roomSlots,sizes[2]);
+        copy.properRoom = memcpy(copies[3],args->properRoom,sizes[3]);
+        pthread_mutex_lock(&journal->mutex); // Events are added inside changes, so the count matches the copy.
+        seq = journal->nextSeq;
+        pthread_mutex_unlock(&journal->mutex);
+        if(attempt == SNAPSHOT_RETRIES) {
+            pthread_mutex_unlock(args->mutex);
+            break;
+        }
+        if(!ReadRetry(args,version)) break;
+    }
+    uint64_t bytes = WriteGame(&copy,args->autosavePath,journal->sessionId,seq);
+    if(!bytes) ERR("autosave"); // The journal cannot be restarted from a snapshot that is not there.
+    __atomic_fetch_add(&metrics.autosaveBytes,bytes,__ATOMIC_RELAXED);
+    RotateJournal(journal,seq);
+    for(i=0;i<4;i++) free(copies[i]);
+    HistogramAdd(&metrics.snapshotTimes,MonotonicNs()-start);
+}
+
+// Function passed to autosave thread. Writes journal events in batches and a full snapshot
+// after AUTOSAVE_SECONDS passed from last save.
+void* autosaveWork(void* pVoid) {
+    gameArgs_t* args = pVoid;
+    journal_t* journal = args->journal;
+    struct timespec start,current,deadline;
+    int currSaveCount = args->saveCount;
+    bool stop = false;
+    if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+    while(!stop) {
+        if(clock_gettime(CLOCK_MONOTONIC,&deadline)) ERR("clock_gettime");
+        deadline.tv_nsec += JOURNAL_COMMIT_MS*1000000L;
+        deadline.tv_sec += deadline.tv_nsec/1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_mutex_lock(&journal->mutex);
+        while(!journal->stop && journal->pendingLen < JOURNAL_BATCH) {
+            int result = pthread_cond_timedwait(&journal->wake,&journal->mutex,&deadline);
+            if(result == ETIMEDOUT) break;
+            if(result) ERR("pthread_cond_timedwait");
+        }
+        stop = journal->stop;
+        pthread_mutex_unlock(&journal->mutex);
+        uint64_t flushStart = MonotonicNs(), bytes = FlushJournal(journal);
+        if(bytes > 0) {
+            HistogramAdd(&metrics.journalTimes,MonotonicNs()-flushStart);
+            __atomic_fetch_add(&metrics.autosaveBytes,bytes,__ATOMIC_RELAXED);
+        }
+        if(clock_gettime(CLOCK_MONOTONIC,&current)) ERR("clock_gettime");
+        if(currSaveCount != args->saveCount) {
+            start = current;
+            currSaveCount = args->saveCount;
+        }
+        else if(!stop && ELAPSED(start,current) >= AUTOSAVE_SECONDS) {
+            Snapshot(args);
+            if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+        }
+    }
+    return NULL;
+}
+
+// Function passed to autosave thread of a live game, flushes changed pages of the game file every LIVE_SYNC_MS.
+void* liveSyncWork(void* pVoid) {
+    gameArgs_t* args = pVoid;
+    uint64_t expirations, synced = 1; // Odd, so the first tick always flushes.
+    while(1) {
+        if(read(args->liveTimer,&expirations,sizeof(expirations)) != sizeof(expirations)) ERR("read");
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL); // Never leave the mutex locked.
+        LockGame(args);
+        uint64_t writes = __atomic_load_n(&args->live->liveWrites,__ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(args->mutex);
+        if(writes != synced) {
+            // Flushed without the mutex, moves made meanwhile only leave the count changed and are flushed next tick.
+            uint64_t start = MonotonicNs();
+            SyncLive(args);
+            HistogramAdd(&metrics.liveSyncTimes,MonotonicNs()-start);
+            if(__atomic_load_n(&args->live->liveWrites,__ATOMIC_SEQ_CST) == writes) synced = writes;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,NULL);
+    }
+}
+
+// Generates dense connected map with the rooms of bits into its adjacency rows, every pair connected with probability 1/2.
+void FillBits(bitGraph_t* bits, uint64_t seed) {
+    rng_t rng;
+    uint64_t block[64];
+    int i, k, n = bits->roomCount;
+    long w, v;
+    memset(bits->rows,0,sizeof(uint64_t)*n*bits->words);
+    RngSeed(&rng,seed);
+    for(i=0;i<n-1;i++) {
+        uint64_t* row = bits->rows+i*bits->words, any = 0;
+        while(!any) { // We need to ensure the graph is connected.
+            for(w=i/64;w<bits->words;w++) row[w] = RngNext(&rng);
+            row[i/64] &= ~(((uint64_t)2 << (i%64))-1);
+            row[bits->words-1] &= TailMask(n);
+            for(w=i/64;w<bits->words;w++) any |= row[w];
+        }
+    }
+    for(w=0;w<bits->words;w++) {
+        for(v=w;v<bits->words;v++) { // Block in rows of word w and columns of word v goes to rows of v and columns of w.
+            for(k=0;k<64;k++) block[k] = w*64+k < n ? bits->rows[(w*64+k)*bits->words+v] : 0;
+            Transpose64(block);
+            for(k=0;k<64 && v*64+k < n;k++) bits->rows[(v*64+k)*bits->words+w] |= block[k];
+        }
+    }
+}
+
+// Generates dense connected map with n rooms as adjacency rows, see FillBits.
+bitGraph_t CreateBits(int n, uint64_t seed) {
+    bitGraph_t bits;
+    bits.roomCount = n;
+    bits.words = BITSET_WORDS(n);
+    bits.rows = (uint64_t*)calloc(n*bits.words+1,sizeof(uint64_t));
+    if(!bits.rows) ERR("calloc");
+    FillBits(&bits,seed);
+    return bits;
+}
+
+// Creates and returns undirected graph with n vertices and random edges between them, which becomes game map.
+graph_t CreateGraph(int n) {
+    bitGraph_t bits = CreateBits(n,((uint64_t)rand() << 32) ^ rand());
+    graph_t graph = GraphFromBits(&bits);
+    free(bits.rows);
+    return graph;
+}
+
+// Increments counter of generated map and returns its previous value. Atomic operations on random
+// rooms cost more than the rest of generation, so they are used only if more than one thread runs.
+long BumpCounter(mapGen_t* gen, long* counter) {
+    return gen->threadCount > 1 ? __atomic_fetch_add(counter,1,__ATOMIC_RELAXED) : (*counter)++;
+}
+
+// Adds edge a-b of generated map: counts it in the first pass and stores it in the second one.
+void EmitEdge(mapGen_t* gen, int a, int b) {
+    if(a == b) return;
+    if(gen->pass == MAPGEN_COUNT) {
+        BumpCounter(gen,&gen->offsets[a+1]);
+        BumpCounter(gen,&gen->offsets[b+1]);
+    }
+    else {
+        gen->neighbors[BumpCounter(gen,&gen->offsets[a])] = b;
+        gen->neighbors[BumpCounter(gen,&gen->offsets[b])] = a;
+    }
+}
+
+// Makes edges of rooms of one chunk. Every room makes its edges only to a constant number of rooms
+// or, for TOPOLOGY_GNP, jumps over rooms it is not connected to, so the whole map takes O(n+m).
+void GenerateChunk(mapGen_t* gen, int chunk) {
+    rng_t rng;
+    int n = gen->n, t;
+    long i, lo = (long)chunk*MAPGEN_CHUNK_ROOMS, hi = lo+MAPGEN_CHUNK_ROOMS < n ? lo+MAPGEN_CHUNK_ROOMS : n;
+    RngSeed(&rng,gen->seed+chunk);
+    for(i=lo;i<hi;i++) {
+        if(gen->topology == TOPOLOGY_GRID) {
+            if((i+1)%gen->width != 0 && i+1 < n) EmitEdge(gen,i,i+1);
+            if(i+gen->width < n) EmitEdge(gen,i,i+gen->width);
+        }
+        else if(gen->topology == TOPOLOGY_SMALL_WORLD) {
+            EmitEdge(gen,i,(i+1)%n);
+            for(t=2;t<=gen->degree/2;t++) EmitEdge(gen,i,RngUniform(&rng) < SMALL_WORLD_REWIRE ? (long)RngBelow(&rng,n) : (i+t)%n);
+        }
+        else {
+            if(i > 0) EmitEdge(gen,i,RngBelow(&rng,i)); // Spanning tree, every room joins an earlier one.
+            if(gen->topology == TOPOLOGY_TREE) {
+                for(t=1;t<gen->degree/2;t++) EmitEdge(gen,i,RngBelow(&rng,n));
+            }
+            else if(gen->logQ < 0) { // Gaps between later rooms connected to room i are geometrically distributed.
+                long j = i;
+                while(1) {
+                    double skip = log(1-RngUniform(&rng))/gen->logQ;
+                    if(skip >= n-j-1) break;
+                    j += 1+(long)skip;
+                    EmitEdge(gen,i,j);
+                }
+            }
+        }
+    }
+}
+
+// Sorts neighbor lists of rooms of one chunk and moves repeated neighbors to their ends.
+void SortChunk(mapGen_t* gen, int chunk) {
+    long i, lo = (long)chunk*MAPGEN_CHUNK_ROOMS, hi = lo+MAPGEN_CHUNK_ROOMS < gen->n ? lo+MAPGEN_CHUNK_ROOMS : gen->n;
+    for(i=lo;i<hi;i++) {
+        int* row = gen->neighbors+gen->offsets[i];
+        long j, len = gen->offsets[i+1]-gen->offsets[i], unique = 0;
+        if(len > 32) qsort(row,len,sizeof(int),CompareInts);
+        else for(j=1;j<len;j++) { // Insertion sort is faster for short rows of sparse maps.
+            int value = row[j];
+            long k = j;
+            for(;k>0 && row[k-1] > value;k--) row[k] = row[k-1];
+            row[k] = value;
+        }
+        for(j=0;j<len;j++) {
+            if(unique == 0 || row[j] != row[unique-1]) row[unique++] = row[j];
+        }
+        gen->rowLen[i] = unique;
+    }
+}
+
+// Function passed to threads of map generator, takes chunks one by one and does current pass on them.
+void* MapGenWork(void* pVoid) {
+    mapGen_t* gen = pVoid;
+    int chunk;
+    while((chunk = __atomic_fetch_add(&gen->nextChunk,1,__ATOMIC_RELAXED)) < gen->chunkCount) {
+        if(gen->pass == MAPGEN_SORT) SortChunk(gen,chunk);
+        else GenerateChunk(gen,chunk);
+    }
+    return NULL;
+}
+
+// Does one pass of map generation on all chunks.
+void RunMapGenPass(mapGen_t* gen, int pass) {
+    int i, threadCount = gen->threadCount;
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t)*threadCount);
+    if(!threads) ERR("malloc");
+    gen->pass = pass;
+    gen->nextChunk = 0;
+    for(i=0;i<threadCount;i++) {
+        if(pthread_create(&threads[i],NULL,MapGenWork,gen)) ERR("pthread_create");
+    }
+    for(i=0;i<threadCount;i++) {
+        if(pthread_join(threads[i],NULL)) ERR("pthread_join");
+    }
+    free(threads);
+}
+
+// Generates sparse connected map with n rooms and given topology straight into a shared mapping of the map file at path.
+void GenerateMap(int n, char* path, int topology, int degree, uint64_t seed) {
+    char tmpPath[MAX_PATH+8];
+    saveHeader_t header;
+    mapGen_t gen;
+    long i;
+    size_t headerSize = ALIGN8(sizeof(saveHeader_t)), offsetsSize = sizeof(long)*(n+1);
+    memset(&gen,0,sizeof(gen));
+    gen.topology = topology;
+    gen.n = n;
+    gen.degree = degree;
+    gen.width = (int)ceil(sqrt(n));
+    double p = n > 1 ? (degree-2.0)/(n-1) : 0; // The spanning tree already gives about 2 neighbors.
+    gen.logQ = p <= 0 ? 0 : p >= 1 ? -INFINITY : log(1-p);
+    gen.seed = seed;
+    gen.chunkCount = (n+MAPGEN_CHUNK_ROOMS-1)/MAPGEN_CHUNK_ROOMS;
+    gen.threadCount = ProcessorCount() < gen.chunkCount ? ProcessorCount() : gen.chunkCount;
+    snprintf(tmpPath,sizeof(tmpPath),"%s.tmp",path);
+    int out = open(tmpPath,O_RDWR|O_CREAT|O_TRUNC,0777);
+    if(out < 0) ERR("open");
+    if(ftruncate(out,headerSize+offsetsSize)) ERR("ftruncate");
+    char* mapping = mmap(NULL,headerSize+offsetsSize,PROT_READ|PROT_WRITE,MAP_SHARED,out,0);
+    if(mapping == MAP_FAILED) ERR("mmap");
+    gen.offsets = (long*)(mapping+headerSize);
+    RunMapGenPass(&gen,MAPGEN_COUNT);
+    for(i=0;i<n;i++) gen.offsets[i+1] += gen.offsets[i];
+    size_t size = headerSize+offsetsSize+ALIGN8(sizeof(int)*gen.offsets[n]);
+    if(munmap(mapping,headerSize+offsetsSize)) ERR("munmap");
+    if(ftruncate(out,size)) ERR("ftruncate");
+    if((mapping = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,out,0)) == MAP_FAILED) ERR("mmap");
+    gen.offsets = (long*)(mapping+headerSize);
+    gen.neighbors = (int*)(mapping+headerSize+offsetsSize);
+    RunMapGenPass(&gen,MAPGEN_FILL);
+    for(i=n;i>0;i--) gen.offsets[i] = gen.offsets[i-1]; // Every row start was moved to the next one while filling.
+    gen.offsets[0] = 0;
+    gen.rowLen = (int*)malloc(sizeof(int)*(n+1));
+    if(!gen.rowLen) ERR("malloc");
+    RunMapGenPass(&gen,MAPGEN_SORT);
+    long len = 0;
+    for(i=0;i<n;i++) { // Removing repeated edges left at ends of rows.
+        memmove(gen.neighbors+len,gen.neighbors+gen.offsets[i],sizeof(int)*gen.rowLen[i]);
+        gen.offsets[i] = len;
+        len += gen.rowLen[i];
+    }
+    gen.offsets[n] = len;
+    free(gen.rowLen);
+    memset(gen.neighbors+len,0,ALIGN8(sizeof(int)*len)-sizeof(int)*len);
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,SAVE_MAGIC,sizeof(header.magic));
+    header.version = SAVE_VERSION;
+    header.roomCount = n;
+    header.itemHeld = -1;
+    header.sections[SECTION_OFFSETS].offset = headerSize;
+    header.sections[SECTION_OFFSETS].size = offsetsSize;
+    header.sections[SECTION_NEIGHBORS].offset = headerSize+offsetsSize;
+    header.sections[SECTION_NEIGHBORS].size = sizeof(int)*len;
+    memcpy(mapping,&header,sizeof(header));
+    if(munmap(mapping,size)) ERR("munmap");
+    if(ftruncate(out,headerSize+offsetsSize+ALIGN8(sizeof(int)*len))) ERR("ftruncate");
+    if(fdatasync(out)) ERR("fdatasync");
+    if(close(out)) ERR("close");
+    if(rename(tmpPath,path)) ERR("rename");
+    if(!SyncDirectory(path)) ERR("fsync");
+}
+
+// Runs breadth-first searches from up to 64 rooms starting at room first at once, bit b of every word standing for room first+b.
+void BitBfs(analyzeWorker_t* worker, int first, uint64_t* seen, uint64_t* front, uint64_t* next, uint16_t* dist) {
+    mapAnalysis_t* analysis = worker->analysis;
+    bitGraph_t* bits = analysis->bits;
+    graph_t* graph = analysis->graph;
+    int b, level = 0, n = analysis->roomCount, batch = n-first < 64 ? n-first : 64;
+    long v, w, k, words = BITSET_WORDS(n), frontierRooms = batch, unseenRooms = n;
+    uint64_t all = batch < 64 ? ((uint64_t)1 << batch)-1 : ~(uint64_t)0, block[64];
+    memset(seen,0,sizeof(uint64_t)*n);
+    memset(front,0,sizeof(uint64_t)*n);
+    for(b=0;b<batch;b++) {
+        seen[first+b] = front[first+b] = (uint64_t)1 << b;
+        analysis->eccentricity[first+b] = 0;
+    }
+    if(dist) {
+        for(k=0;k<(long)batch*n;k++) dist[k] = NO_DIST;
+        for(b=0;b<batch;b++) dist[(long)b*n+first+b] = 0;
+    }
+    while(frontierRooms > 0 && unseenRooms > 0) { // Top-down while frontier is small, then bottom-up.
+        double topDown = frontierRooms*analysis->degree;
+        double bottomUp = unseenRooms*fmin(analysis->degree,4.0*n/frontierRooms);
+        if(!graph && level == 0) {
+            for(w=0;w<words;w++) {
+                for(b=0;b<64;b++) block[b] = b < batch ? bits->rows[(first+b)*words+w] : 0;
+                Transpose64(block);
+                for(b=0;b<64 && w*64+b < n;b++) next[w*64+b] = block[b] & ~seen[w*64+b];
+            }
+        }
+        else if(topDown < bottomUp) {
+            memset(next,0,sizeof(uint64_t)*n);
+            for(v=0;v<n;v++) {
+                if(!front[v]) continue;
+                if(graph) {
+                    for(k=graph->offsets[v];k<graph->offsets[v+1];k++) next[graph->neighbors[k]] |= front[v];
+                    continue;
+                }
+                uint64_t* row = bits->rows+v*words;
+                for(w=0;w<words;w++) {
+                    for(uint64_t word=row[w];word;word&=word-1) next[w*64+__builtin_ctzll(word)] |= front[v];
+                }
+            }
+            for(v=0;v<n;v++) next[v] &= ~seen[v];
+        }
+        else {
+            for(v=0;v<n;v++) {
+                uint64_t missing = all & ~seen[v];
+                next[v] = missing;
+                if(graph) {
+                    for(k=graph->offsets[v];k<graph->offsets[v+1] && missing;k++) missing &= ~front[graph->neighbors[k]];
+                }
+                else {
+                    uint64_t* row = bits->rows+v*words;
+                    for(w=0;w<words && missing;w++) {
+                        for(uint64_t word=row[w];word && missing;word&=word-1) missing &= ~front[w*64+__builtin_ctzll(word)];
+                    }
+                }
+                next[v] &= ~missing;
+            }
+        }
+        level++;
+        frontierRooms = unseenRooms = 0;
+        uint64_t reached = 0; // Searches that reached some room at this level.
+        for(v=0;v<n;v++) {
+            front[v] = next[v];
+            seen[v] |= next[v];
+            unseenRooms += seen[v] != all;
+            if(!next[v]) continue;
+            frontierRooms++;
+            reached |= next[v];
+            worker->distanceCounts[level] += __builtin_popcountll(next[v]);
+            if(dist) {
+                for(uint64_t word=next[v];word;word&=word-1) dist[__builtin_ctzll(word)*(long)n+v] = level;
+            }
+        }
+        for(;reached;reached&=reached-1) analysis->eccentricity[first+__builtin_ctzll(reached)] = level;
+    }
+    uint64_t found = 0; // Searches whose lowest visited room is known.
+    for(v=0;v<n && found != all;v++) {
+        for(uint64_t word=seen[v] & ~found;word;word&=word-1) worker->components += v == first+__builtin_ctzll(word);
+        found |= seen[v];
+    }
+}
+
+// Function passed to threads of analyze-map. Every thread takes 64 rooms at a time and searches from them.
+void* AnalyzeWork(void* pVoid) {
+    analyzeWorker_t* worker = pVoid;
+    mapAnalysis_t* analysis = worker->analysis;
+    int n = analysis->roomCount;
+    uint64_t* seen = (uint64_t*)malloc(sizeof(uint64_t)*3*n);
+    uint16_t* dist = analysis->distanceFd >= 0 ? (uint16_t*)malloc(sizeof(uint16_t)*64*n) : NULL;
+    worker->distanceCounts = (long*)calloc(n,sizeof(long));
+    if(!seen || (analysis->distanceFd >= 0 && !dist) || !worker->distanceCounts) ERR("malloc");
+    while(1) {
+        int first = __atomic_fetch_add(&analysis->nextSource,64,__ATOMIC_RELAXED);
+        if(first >= n) break;
+        BitBfs(worker,first,seen,seen+n,seen+2*n,dist);
+        size_t size = sizeof(uint16_t)*n*(n-first < 64 ? n-first : 64);
+        if(dist && pwrite(analysis->distanceFd,dist,size,(off_t)sizeof(uint16_t)*n*first) != (ssize_t)size) ERR("pwrite");
+    }
+    free(seen);
+    free(dist);
+    return NULL;
+}
+
+// Finds distances between all pairs of rooms of map in bits or graph on all processors and adds their summary to out as JSON.
+void AnalyzeMap(bitGraph_t* bits, graph_t* graph, int n, char* distancePath, outBuffer_t* out) {
+    struct timespec start, end;
+    int i, threadCount = ProcessorCount() < (n+63)/64 ? ProcessorCount() : (n+63)/64, components = 0, radius = n, diameter = 0;
+    long d, edges = 0, pairs = 0, distanceSum = 0;
+    mapAnalysis_t analysis = {bits,graph,n,0,0,NULL,-1};
+    if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+    if(graph) edges = graph->offsets[n];
+    else for(d=0;d<n*bits->words;d++) edges += __builtin_popcountll(bits->rows[d]);
+    analysis.degree = (double)edges/n;
+    analysis.eccentricity = (int*)malloc(sizeof(int)*n);
+    analyzeWorker_t* workers = (analyzeWorker_t*)calloc(threadCount,sizeof(analyzeWorker_t));
+    long* counts = (long*)calloc(n,sizeof(long)); // Counts of distances, then of eccentricities.
+    if(!analysis.eccentricity || !workers || !counts) ERR("malloc");
+    if(distancePath && (analysis.distanceFd = open(distancePath,O_WRONLY|O_CREAT|O_TRUNC,0777)) < 0) ERR("open");
+    for(i=0;i<threadCount;i++) {
+        workers[i].analysis = &analysis;
+        if(pthread_create(&workers[i].thread,NULL,AnalyzeWork,&workers[i])) ERR("pthread_create");
+    }
+    for(i=0;i<threadCount;i++) {
+        if(pthread_join(workers[i].thread,NULL)) ERR("pthread_join");
+        for(d=1;d<n;d++) counts[d] += workers[i].distanceCounts[d];
+        components += workers[i].components;
+        free(workers[i].distanceCounts);
+    }
+    if(analysis.distanceFd >= 0 && close(analysis.distanceFd)) ERR("close");
+    if(clock_gettime(CLOCK_MONOTONIC,&end)) ERR("clock_gettime");
+    for(d=1;d<n;d++) {
+        pairs += counts[d];
+        distanceSum += d*counts[d];
+    }
+    OutPrintf(out,"{\"rooms\":%d,\"edges\":%ld,\"threads\":%d,\"seconds\":%.3f,\"connected\":%s,\"components\":%d,",
+              n,edges/2,threadCount,ELAPSED(start,end),components == 1 ? "true" : "false",components);
+    OutPrintf(out,"\"meanDistance\":%.4f,\"distances\":{",pairs ? (double)distanceSum/pairs : 0.0);
+    for(d=1,i=0;d<n;d++) {
+        if(counts[d]) OutPrintf(out,"%s\"%ld\":%ld",i++ ? "," : "",d,counts[d]);
+    }
+    memset(counts,0,sizeof(long)*n);
+    for(i=0;i<n;i++) {
+        counts[analysis.eccentricity[i]]++;
+        if(analysis.eccentricity[i] > diameter) diameter = analysis.eccentricity[i];
+        if(analysis.eccentricity[i] < radius) radius = analysis.eccentricity[i];
+    }
+    OutPrintf(out,"},\"diameter\":%d,\"radius\":%d,\"eccentricities\":{",diameter,radius);
+    for(d=0,i=0;d<n;d++) {
+        if(counts[d]) OutPrintf(out,"%s\"%ld\":%ld",i++ ? "," : "",d,counts[d]);
+    }
+    OutPrintf(out,"}}\n");
+    free(counts);
+    free(workers);
+    free(analysis.eccentricity);
+}
+
+// Function passed to threads of self-play, plays games one by one with the greedy plan of solve.
+void* SelfPlayWork(void* pVoid) {
+    selfPlayWorker_t* worker = pVoid;
+    selfPlay_t* batch = worker->batch;
+    gameArgs_t* args = &worker->args;
+    rng_t rng;
+    int i, game;
+    while((game = __atomic_fetch_add(&batch->nextGame,1,__ATOMIC_RELAXED)) < batch->gameCount) {
+        RngSeed(&rng,batch->seed+game); // Game does not depend on which thread plays it.
+        uint64_t mapSeed = RngNext(&rng), itemSeed = RngNext(&rng), start = MonotonicNs(), now;
+        if(!batch->graph) {
+            FillBits(&worker->bits,mapSeed);
+            FillGraphFromBits(&worker->bits,&args->graph,&worker->neighborCap);
+        }
+        now = MonotonicNs();
+        worker->mapNs += now-start;
+        start = now;
+        PlaceItems(args,worker->slots,itemSeed,RngBelow(&rng,batch->roomCount));
+        now = MonotonicNs();
+        worker->itemsNs += now-start;
+        start = now;
+        worker->solver.currentRoom = args->currentRoom;
+        worker->agent.greedy = true;
+        ResetSolveState(&worker->agent);
+        bool done = CompletePlan(&worker->agent,false,INT_MAX);
+        for(i=0;i<worker->agent.len;i++) {
+            carry_t* carry = &worker->agent.plan[i];
+            RemoveItem(args,carry->item);
+            PlaceItem(args,carry->item,carry->room);
+            args->currentRoom = carry->room;
+            args->movesCount = carry->total;
+        }
+        batch->moves[game] = done && CheckIfFinished(args) ? args->movesCount : -1;
+        worker->playNs += MonotonicNs()-start;
+    }
+    return NULL;
+}
+
+// Plays gameCount games with n rooms each on all processors and reports statistics of their moves to out as one
+// line of JSON. Games are played on graph if it is not NULL, otherwise every game gets a new dense map.
+void SelfPlay(graph_t* graph, int n, int gameCount, uint64_t seed, outBuffer_t* out) {
+    struct timespec start, end;
+    int i, finished = 0, numberOfItems = 3*n/2, threadCount = ProcessorCount() < gameCount ? ProcessorCount() : gameCount;
+    double sum = 0, squares = 0;
+    selfPlay_t batch = {graph,n,gameCount,seed,0,NULL};
+    batch.moves = (int*)malloc(sizeof(int)*gameCount);
+    selfPlayWorker_t* workers = (selfPlayWorker_t*)calloc(threadCount,sizeof(selfPlayWorker_t));
+    if(!batch.moves || !workers) ERR("malloc");
+    if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+    for(i=0;i<threadCount;i++) {
+        selfPlayWorker_t* worker = &workers[i];
+        gameArgs_t* args = &worker->args;
+        worker->batch = &batch;
+        args->roomCount = n;
+        if(graph) args->graph = *graph; // Shared by all threads, only read.
+        else {
+            worker->bits.roomCount = n;
+            worker->bits.words = BITSET_WORDS(n);
+            worker->bits.rows = (uint64_t*)calloc(n*worker->bits.words+1,sizeof(uint64_t));
+            args->graph.offsets = (long*)malloc(sizeof(long)*(n+1));
+            if(!worker->bits.rows || !args->graph.offsets) ERR("malloc");
+        }
+        worker->slots = ArenaItemArrays(args);
+        worker->solver.graph = &args->graph;
+        worker->solver.roomCount = n;
+        worker->solver.itemCount = numberOfItems;
+        worker->solver.items = args->items;
+        worker->solver.itemDest = args->itemDest;
+        worker->solver.itemHeld = -1;
+        worker->solver.end = UINT64_MAX; // Games of self-play have no time budget.
+        InitSolveWorker(&worker->agent,&worker->solver,true,seed+i);
+        if(pthread_create(&worker->thread,NULL,SelfPlayWork,worker)) ERR("pthread_create");
+    }
+    for(i=0;i<threadCount;i++) {
+        if(pthread_join(workers[i].thread,NULL)) ERR("pthread_join");
+    }
+    if(clock_gettime(CLOCK_MONOTONIC,&end)) ERR("clock_gettime");
+    double elapsed = ELAPSED(start,end);
+    for(i=0;i<gameCount;i++) {
+        if(batch.moves[i] < 0) continue;
+        batch.moves[finished++] = batch.moves[i];
+        sum += batch.moves[i];
+        squares += (double)batch.moves[i]*batch.moves[i];
+    }
+    qsort(batch.moves,finished,sizeof(int),CompareInts);
+    double mean = finished ? sum/finished : 0;
+    OutPrintf(out,"{\"games\":%d,\"rooms\":%d,\"threads\":%d,\"seconds\":%.3f,\"gamesPerSecond\":%.1f,\"unfinished\":%d,",
+              gameCount,n,threadCount,elapsed,gameCount/elapsed,gameCount-finished);
+    OutPrintf(out,"\"moves\":{\"mean\":%.1f,\"stddev\":%.1f,\"min\":%d",mean,finished ? sqrt(fmax(squares/finished-mean*mean,0)) : 0.0,
+              finished ? batch.moves[0] : 0);
+    const double ps[] = {10,50,90,99};
+    for(i=0;i<(int)(sizeof(ps)/sizeof(ps[0]));i++) {
+        long rank = (long)ceil(ps[i]/100*finished);
+        OutPrintf(out,",\"p%g\":%d",ps[i],finished ? batch.moves[rank > 0 ? rank-1 : 0] : 0);
+    }
+    uint64_t mapNs = 0, itemsNs = 0, playNs = 0;
+    for(i=0;i<threadCount;i++) {
+        mapNs += workers[i].mapNs;
+        itemsNs += workers[i].itemsNs;
+        playNs += workers[i].playNs;
+    }
+    OutPrintf(out,",\"max\":%d},\"movesPerItem\":%.3f,\"threadSeconds\":{\"map\":%.3f,\"items\":%.3f,\"play\":%.3f}}\n",
+              finished ? batch.moves[finished-1] : 0,mean/numberOfItems,mapNs*1.0e-9,itemsNs*1.0e-9,playNs*1.0e-9);
+    for(i=0;i<threadCount;i++) {
+        gameArgs_t* args = &workers[i].args;
+        if(!graph) {
+            free(workers[i].bits.rows);
+            FreeGraph(&args->graph);
+        }
+        free(args->arena);
+        FreeSolveWorker(&workers[i].agent);
+    }
+    free(workers);
+    free(batch.moves);
+}
+
+// Returns item in slot k of slots word of a room, -1 if the slot is empty.
+int SlotItem(uint64_t word, int k) {
+    return (int32_t)(word >> 32*k);
+}
+
+// Returns slots word of a room with items a and b in its slots.
+uint64_t SlotWord(int a, int b) {
+    return (uint32_t)a | (uint64_t)(uint32_t)b << 32;
+}
+
+// Takes item out of room of world. Returns false if it is not there, because another player took it first.
+bool TakeItem(world_t* world, int room, int item) {
+    uint64_t word = __atomic_load_n(&world->slots[room],__ATOMIC_ACQUIRE), next;
+    do {
+        if(SlotItem(word,0) == item) next = SlotWord(SlotItem(word,1),-1);
+        else if(SlotItem(word,1) == item) next = SlotWord(SlotItem(word,0),-1);
+        else return false;
+    } while(!__atomic_compare_exchange_n(&world->slots[room],&word,next,true,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE));
+    return true;
+}
+
+// Puts item into a free slot of room of world. Returns false if the room is full, because another player filled it first.
+bool PutItem(world_t* world, int room, int item) {
+    uint64_t word = __atomic_load_n(&world->slots[room],__ATOMIC_ACQUIRE), next;
+    do {
+        if(SlotItem(word,1) != -1) return false;
+        next = SlotItem(word,0) == -1 ? SlotWord(item,-1) : SlotWord(SlotItem(word,0),item);
+    } while(!__atomic_compare_exchange_n(&world->slots[room],&word,next,true,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE));
+    return true;
+}
+
+// Makes one action of player: drops its item, picks up a misplaced one or moves to a random neighbor.
+void PlayerAction(player_t* player) {
+    world_t* world = player->world;
+    int k, room = player->room;
+    uint64_t word = __atomic_load_n(&world->slots[room],__ATOMIC_ACQUIRE);
+    if(player->held != -1 && SlotItem(word,1) == -1 && (world->itemDest[player->held] == room || RngBelow(&player->rng,DROP_AWAY) == 0)) {
+        if(!PutItem(world,room,player->held)) {
+            player->conflicts++;
+            return;
+        }
+        if(world->itemDest[player->held] == room) __atomic_fetch_sub(&world->misplacedCount,1,__ATOMIC_RELAXED);
+        player->held = -1;
+        player->drops++;
+        return;
+    }
+    for(k=0;k<2 && player->held == -1;k++) {
+        int item = SlotItem(word,k);
+        if(item == -1 || world->itemDest[item] == room) continue;
+        if(TakeItem(world,room,item)) {
+            player->held = item;
+            player->pickUps++;
+        }
+        else player->conflicts++;
+        return;
+    }
+    int degree = Degree(world->graph,room);
+    if(degree == 0) return;
+    player->room = world->graph->neighbors[world->graph->offsets[room]+RngBelow(&player->rng,degree)];
+    player->moves++;
+}
+
+// Function passed to threads of players, makes actions until the end of the run.
+void* PlayerWork(void* pVoid) {
+    player_t* player = pVoid;
+    world_t* world = player->world;
+    long count;
+    for(count=0;count % STRESS_CHECK != 0 || MonotonicNs() < world->end;count++) {
+        if(world->global) pthread_mutex_lock(world->global);
+        PlayerAction(player);
+        if(world->global) pthread_mutex_unlock(world->global);
+    }
+    return NULL;
+}
+
+// Checks that every item of world is in exactly one room or hand and that the misplaced count matches them.
+bool WorldConsistent(world_t* world, player_t* players, int playerCount) {
+    int i, k, misplaced = 0;
+    bool ok = true;
+    char* seen = (char*)calloc(world->itemCount,sizeof(char));
+    if(!seen) ERR("calloc");
+    for(i=0;i<world->roomCount;i++) {
+        if(SlotItem(world->slots[i],0) == -1 && SlotItem(world->slots[i],1) != -1) ok = false;
+        for(k=0;k<2;k++) {
+            int item = SlotItem(world->slots[i],k);
+            if(item == -1) continue;
+            if(item < 0 || item >= world->itemCount || seen[item]++) ok = false;
+            else misplaced += world->itemDest[item] != i;
+        }
+    }
+    for(i=0;i<playerCount;i++) {
+        if(players[i].held == -1) continue;
+        if(seen[players[i].held]++) ok = false;
+        misplaced++;
+    }
+    for(i=0;i<world->itemCount;i++) {
+        if(seen[i] != 1) ok = false;
+    }
+    free(seen);
+    return ok && misplaced == world->misplacedCount;
+}
+
+// Measures actions per second of 1, 2, 4 and so on up to maxPlayers player threads, under one mutex and with compare-and-swap.
+void StressPlayers(gameArgs_t* args, int maxPlayers, double seconds, outBuffer_t* out) {
+    int i, players, lock, n = args->roomCount;
+    pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER;
+    world_t world = {&args->graph,n,3*n/2,args->itemDest,NULL,0,NULL,0};
+    world.slots = (uint64_t*)malloc(sizeof(uint64_t)*n);
+    player_t* team = (player_t*)calloc(maxPlayers,sizeof(player_t));
+    if(!world.slots || !team) ERR("malloc");
+    OutPrintf(out,"{\"rooms\":%d,\"items\":%d,\"seconds\":%g,\"runs\":[",n,world.itemCount,seconds);
+    for(players=1;;players=players*2 < maxPlayers ? players*2 : maxPlayers) {
+        for(lock=1;lock>=0;lock--) {
+            for(i=0;i<n;i++) world.slots[i] = SlotWord(args->roomSlots[2*i],args->roomSlots[2*i+1]);
+            world.misplacedCount = args->misplacedCount;
+            world.global = lock ? &global : NULL;
+            uint64_t start = MonotonicNs();
+            world.end = start+(uint64_t)(seconds*1.0e9);
+            for(i=0;i<players;i++) {
+                memset(&team[i],0,sizeof(player_t));
+                team[i].world = &world;
+                RngSeed(&team[i].rng,args->itemSeed+i);
+                team[i].room = RngBelow(&team[i].rng,n);
+                team[i].held = -1;
+                if(pthread_create(&team[i].thread,NULL,PlayerWork,&team[i])) ERR("pthread_create");
+            }
+            long moves = 0, pickUps = 0, drops = 0, conflicts = 0;
+            for(i=0;i<players;i++) {
+                if(pthread_join(team[i].thread,NULL)) ERR("pthread_join");
+                moves += team[i].moves;
+                pickUps += team[i].pickUps;
+                drops += team[i].drops;
+                conflicts += team[i].conflicts;
+            }
+            double elapsed = (MonotonicNs()-start)*1.0e-9;
+            OutPrintf(out,"%s{\"players\":%d,\"lock\":\"%s\",\"actionsPerSecond\":%.0f,\"moves\":%ld,\"pickUps\":%ld,\"drops\":%ld,\"conflicts\":%ld,\"misplaced\":%d,\"consistent\":%s}",
+                      players == 1 && lock ? "" : ",",players,lock ? "global" : "rooms",(moves+pickUps+drops)/elapsed,moves,pickUps,drops,conflicts,
+                      world.misplacedCount,WorldConsistent(&world,team,players) ? "true" : "false");
+            OutFlush(out);
+        }
+        if(players == maxPlayers) break;
+    }
+    OutPrintf(out,"]}\n");
+    free(team);
+    free(world.slots);
+}
+
+// Adds task to the end of tasks of walker and wakes an idle thread, if there is one.
+void PushDirTask(dirWalker_t* walker, dirTask_t* task) {
+    dirWalk_t* walk = walker->walk;
+    pthread_mutex_lock(&walker->mutex);
+    if(walker->first+walker->len == walker->cap) {
+        if(walker->first > 0) { // Reusing space of stolen tasks.
+            memmove(walker->tasks,walker->tasks+walker->first,sizeof(dirTask_t)*walker->len);
+            walker->first = 0;
+        }
+        else {
+            walker->cap = walker->cap ? 2*walker->cap : 64;
+            walker->tasks = (dirTask_t*)realloc(walker->tasks,sizeof(dirTask_t)*walker->cap);
+            if(!walker->tasks) ERR("realloc");
+        }
+    }
+    walker->tasks[walker->first+walker->len++] = *task;
+    __atomic_fetch_add(&walk->queued,1,__ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&walker->mutex);
+    if(__atomic_load_n(&walk->idle,__ATOMIC_SEQ_CST) == 0) return; // Idle threads count themselves before checking queued.
+    pthread_mutex_lock(&walk->mutex);
+    if(pthread_cond_signal(&walk->wake)) ERR("pthread_cond_signal");
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+// Takes a task of walker into task, from the end if own is true or from the start otherwise.
+// Returns false if walker has no tasks.
+bool TakeDirTask(dirWalker_t* walker, dirTask_t* task, bool own) {
+    bool found = false;
+    pthread_mutex_lock(&walker->mutex);
+    if(walker->len > 0) {
+        *task = walker->tasks[own ? walker->first+walker->len-1 : walker->first];
+        if(!own) walker->first++;
+        walker->len--;
+        __atomic_fetch_sub(&walker->walk->queued,1,__ATOMIC_SEQ_CST);
+        found = true;
+    }
+    pthread_mutex_unlock(&walker->mutex);
+    return found;
+}
+
+// Drops a reference to dir, closing it if it was the last one.
+void ReleaseDirHandle(dirHandle_t* dir) {
+    if(__atomic_sub_fetch(&dir->refs,1,__ATOMIC_ACQ_REL) > 0) return;
+    if(close(dir->fd)) ERR("close");
+    free(dir);
+}
+
+// Reads directory of task relative to its parent, adding a room and a task for every subdirectory, and frees the task.
+void ReadDirectory(dirWalker_t* walker, dirTask_t* task, char* buf) {
+    dirWalk_t* walk = walker->walk;
+    long len,pos;
+    int fd = openat(task->parent->fd,task->name,O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    ReleaseDirHandle(task->parent);
+    free(task->name);
+    if(fd < 0) return;
+    dirHandle_t* dir = (dirHandle_t*)malloc(sizeof(dirHandle_t));
+    if(!dir) ERR("malloc");
+    dir->fd = fd;
+    dir->refs = 1; // Held while the directory is read.
+    while((len = syscall(SYS_getdents64,fd,buf,DIRWALK_BUFFER)) > 0) {
+        for(pos=0;pos<len;) {
+            linuxDirent64_t* entry = (linuxDirent64_t*)(buf+pos);
+            char* name = entry->d_name;
+            struct stat st;
+            pos += entry->d_reclen;
+            if(strcmp(name,".") == 0 || strcmp(name,"..") == 0) continue;
+            if(entry->d_type != DT_DIR && (entry->d_type != DT_UNKNOWN ||
+               fstatat(fd,name,&st,AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode))) continue;
+            dirTask_t child;
+            if(!(child.name = strdup(name))) ERR("strdup");
+            child.parent = dir;
+            __atomic_fetch_add(&dir->refs,1,__ATOMIC_RELAXED);
+            child.room = __atomic_fetch_add(&walk->roomCount,1,__ATOMIC_RELAXED);
+            AddEdge(&walker->edges,task->room,child.room);
+            __atomic_fetch_add(&walk->pending,1,__ATOMIC_RELAXED);
+            PushDirTask(walker,&child);
+        }
+    }
+    ReleaseDirHandle(dir);
+}
+
+// Function passed to threads of the directory tree walker. Every thread reads directories from its own tasks,
+// depth first, steals the oldest tasks of other threads when it has none and waits when no thread has any.
+void* DirWalkWork(void* pVoid) {
+    dirWalker_t* walker = pVoid;
+    dirWalk_t* walk = walker->walk;
+    int i, self = walker-walk->walkers;
+    char* buf = (char*)malloc(DIRWALK_BUFFER);
+    if(!buf) ERR("malloc");
+    while(1) {
+        dirTask_t task;
+        bool found = TakeDirTask(walker,&task,true);
+        for(i=1;!found && i<walk->threadCount;i++) found = TakeDirTask(&walk->walkers[(self+i)%walk->threadCount],&task,false);
+        if(!found) {
+            pthread_mutex_lock(&walk->mutex);
+            __atomic_fetch_add(&walk->idle,1,__ATOMIC_SEQ_CST);
+            while(__atomic_load_n(&walk->queued,__ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&walk->pending,__ATOMIC_ACQUIRE) > 0) {
+                if(pthread_cond_wait(&walk->wake,&walk->mutex)) ERR("pthread_cond_wait");
+            }
+            __atomic_fetch_sub(&walk->idle,1,__ATOMIC_SEQ_CST);
+            bool done = __atomic_load_n(&walk->pending,__ATOMIC_ACQUIRE) == 0;
+            pthread_mutex_unlock(&walk->mutex);
+            if(done) break;
+            continue;
+        }
+        ReadDirectory(walker,&task,buf);
+        if(__atomic_sub_fetch(&walk->pending,1,__ATOMIC_ACQ_REL) > 0) continue;
+        pthread_mutex_lock(&walk->mutex); // The last directory, idle threads are woken to end.
+        if(pthread_cond_broadcast(&walk->wake)) ERR("pthread_cond_broadcast");
+        pthread_mutex_unlock(&walk->mutex);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Creates map from directory tree rooted at path on all processors. Returns false if path is not a readable directory.
+bool MapFromDirTree(char* path, graph_t* graph, int* roomCount) {
+    dirWalk_t walk;
+    struct timespec start,end;
+    int i, rootFd;
+    if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+    if((rootFd = open(path,O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) return false;
+    walk.threadCount = ProcessorCount();
+    walk.roomCount = 1;
+    walk.pending = 1;
+    walk.queued = 0;
+    walk.idle = 0;
+    if(pthread_mutex_init(&walk.mutex,NULL)) ERR("pthread_mutex_init");
+    if(pthread_cond_init(&walk.wake,NULL)) ERR("pthread_cond_init");
+    walk.walkers = (dirWalker_t*)calloc(walk.threadCount,sizeof(dirWalker_t));
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t)*walk.threadCount);
+    if(!walk.walkers || !threads) ERR("malloc");
+    for(i=0;i<walk.threadCount;i++) {
+        walk.walkers[i].walk = &walk;
+        if(pthread_mutex_init(&walk.walkers[i].mutex,NULL)) ERR("pthread_mutex_init");
+    }
+    dirTask_t root = {(dirHandle_t*)malloc(sizeof(dirHandle_t)),strdup("."),0};
+    if(!root.parent || !root.name) ERR("malloc");
+    root.parent->fd = rootFd;
+    root.parent->refs = 1;
+    PushDirTask(&walk.walkers[0],&root);
+    for(i=0;i<walk.threadCount;i++) {
+        if(pthread_create(&threads[i],NULL,DirWalkWork,&walk.walkers[i])) ERR("pthread_create");
+    }
+    for(i=0;i<walk.threadCount;i++) { // Every thread can take tasks of the others until all are done.
+        if(pthread_join(threads[i],NULL)) ERR("pthread_join");
+    }
+    edgeList_t edges = {NULL,0,0};
+    for(i=0;i<walk.threadCount;i++) {
+        dirWalker_t* walker = &walk.walkers[i];
+        if(edges.len+walker->edges.len > edges.cap) {
+            edges.cap = edges.len+walker->edges.len;
+            edges.ends = (int*)realloc(edges.ends,sizeof(int)*2*edges.cap);
+            if(!edges.ends) ERR("realloc");
+        }
+        memcpy(edges.ends+2*edges.len,walker->edges.ends,sizeof(int)*2*walker->edges.len);
+        edges.len += walker->edges.len;
+        free(walker->edges.ends);
+        free(walker->tasks);
+        pthread_mutex_destroy(&walker->mutex);
+    }
+    free(threads);
+    free(walk.walkers);
+    pthread_mutex_destroy(&walk.mutex);
+    pthread_cond_destroy(&walk.wake);
+    *roomCount = walk.roomCount;
+    *graph = BuildGraph(walk.roomCount,&edges);
+    free(edges.ends);
+    if(clock_gettime(CLOCK_MONOTONIC,&end)) ERR("clock_gettime");
+    double elapsed = ELAPSED(start,end);
+    printf("Read %d directories in %.3f s, %.0f directories per second\n",walk.roomCount,elapsed,elapsed > 0 ? walk.roomCount/elapsed : 0.0);
+    return true;
+}
+
+// Function passed to thread waiting for SIGUSR1, after receiving SIGUSR1 swaps rooms between two items.
+void* signalHandling(void* pVoid) {
     gameArgs_t* args = pVoid;
     int signo;
     while(1) {
         if(sigwait(args->mask,&signo)) ERR("sigwait");
         if(signo == SIGUSR1) {
             int a=-1,b=-1;
+            int numberOfItems = 3*args->roomCount/2;
+            LockGame(args);
+            if(numberOfItems - (args->itemHeld != -1) < 2) { // Nothing to swap.
+                pthread_mutex_unlock(args->mutex);
+                continue;
+            }
             while(a == b || a == args->itemHeld || b == args->itemHeld) {
-                a = rand()%(3*args->roomCount/2);
-                b = rand()%(3*args->roomCount/2);
-            }
-            int k = args->items[a];
-            pthread_mutex_lock(args->mutex);
-            args->items[a] = args->items[b];
-            args->items[b] = k;
-            if(args->items[a] == args->itemDest[a]) args->properRoom[a] = true;
-            else args->properRoom[a] = false;
-            if(args->items[b] == args->itemDest[b]) args->properRoom[b] = true;
-            else args->properRoom[b] = false;
+                a = RngBelow(&args->swapRng,numberOfItems);
+                b = RngBelow(&args->swapRng,numberOfItems);
+            }
+            BeginChange(args);
+            SwapItems(args,a,b);
+            JournalEvent(args,EVENT_SWAP,a,b,args->movesCount); // Inside the change, so snapshots see the event with it.
+            EndChange(args);
+            if(args->record) fprintf(args->record,"#swap %d %d\n",a,b);
             pthread_mutex_unlock(args->mutex);
-            printf("Swapped item %d with item %d.\n",a,b);
-            PrintAvailableRooms(args);
-            PrintItemsInRoom(args);
+            outBuffer_t out = {NULL,0,0,STDOUT_FILENO}; // Output of the game belongs to the thread running Play.
+            OutPrintf(&out,"Swapped item %d with item %d.\n",a,b);
+            PrintGameState(args,&out);
+            OutFlush(&out);
+            OutFree(&out);
+        }
+    }
+}
+
+// Starts a journal session of a new or loaded game with a snapshot at autosave path.
+void StartJournal(gameArgs_t* args) {
+    struct timespec now;
+    pthread_condattr_t attr;
+    rng_t rng;
+    journal_t* journal = (journal_t*)calloc(1,sizeof(journal_t));
+    if(!journal) ERR("calloc");
+    if(snprintf(journal->path,sizeof(journal->path),"%s.journal",args->autosavePath) >= (int)sizeof(journal->path)) ERR("snprintf");
+    if(clock_gettime(CLOCK_REALTIME,&now)) ERR("clock_gettime");
+    RngSeed(&rng,((uint64_t)now.tv_sec << 30) ^ now.tv_nsec ^ ((uint64_t)getpid() << 48));
+    journal->sessionId = RngNext(&rng) | 1;
+    journal->fd = -1;
+    if(pthread_mutex_init(&journal->mutex,NULL)) ERR("pthread_mutex_init");
+    if(pthread_condattr_init(&attr)) ERR("pthread_condattr_init");
+    if(pthread_condattr_setclock(&attr,CLOCK_MONOTONIC)) ERR("pthread_condattr_setclock");
+    if(pthread_cond_init(&journal->wake,&attr)) ERR("pthread_cond_init");
+    pthread_condattr_destroy(&attr);
+    if(!WriteGame(args,args->autosavePath,journal->sessionId,0)) ERR("autosave");
+    RotateJournal(journal,0);
+    args->journal = journal;
+}
+
+// Moves a new or loaded game into live game file at autosave path, so that every change of the game
+// is a change of the file. Returns false if the written file cannot be loaded back.
+bool MakeLive(gameArgs_t* args) {
+    if(args->live) return true;
+    if(!WriteGame(args,args->autosavePath,0,0)) ERR("autosave");
+    StopRouting(args);
+    ReleaseGame(args);
+    return LoadGame(args,args->autosavePath) && args->live;
+}
+
+// Starts autosave and signal handling threads of a new or loaded game. A live game is flushed
+// by a timer, other games get a journal.
+void StartGameThreads(gameArgs_t* args) {
+    if(args->live) {
+        struct itimerspec interval;
+        interval.it_interval.tv_sec = LIVE_SYNC_MS/1000;
+        interval.it_interval.tv_nsec = (LIVE_SYNC_MS%1000)*1000000L;
+        interval.it_value = interval.it_interval;
+        if((args->liveTimer = timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC)) < 0) ERR("timerfd_create");
+        if(timerfd_settime(args->liveTimer,0,&interval,NULL)) ERR("timerfd_settime");
+        if(pthread_create(&args->autosaveThread,NULL,liveSyncWork,args)) ERR("pthread_create");
+    }
+    else {
+        StartJournal(args);
+        if(pthread_create(&args->autosaveThread,NULL,autosaveWork,args)) ERR("pthread_create");
+    }
+    if(pthread_create(&args->signalThread,NULL,signalHandling,args)) ERR("pthread_create");
+    args->gameThreads = true;
+}
+
+// Seeds all generators of the game, so that the same seed and commands give the same game.
+void SeedGame(gameArgs_t* args, unsigned int seed) {
+    srand(seed);
+    RngSeed(&args->swapRng,seed);
+}
+
+// Starts threads of a new or loaded game. A headless game has no autosave and signal handling,
+// and waits for its routing index, so that it depends only on the script.
+void StartGame(gameArgs_t* args) {
+    StartRouting(args);
+    if(!args->headless) StartGameThreads(args);
+    else if(args->routing.building) {
+        if(pthread_join(args->routing.builder,NULL)) ERR("pthread_join");
+        args->routing.building = false;
+    }
+}
+
+// Adds autosave of session id at tick to list.
+void WheelPush(wheelList_t* list, uint64_t id, uint64_t tick) {
+    if(list->len == list->cap) {
+        list->cap = list->cap ? 2*list->cap : 16;
+        list->entries = (wheelEntry_t*)realloc(list->entries,sizeof(wheelEntry_t)*list->cap);
+        if(!list->entries) ERR("realloc");
+    }
+    list->entries[list->len].id = id;
+    list->entries[list->len++].tick = tick;
+}
+
+// Schedules autosave of the game of session AUTOSAVE_SECONDS from now, replacing its previous autosave.
+void ScheduleAutosave(session_t* session) {
+    server_t* server = session->worker->server;
+    pthread_mutex_lock(&server->wheelMutex);
+    uint64_t tick = server->tick+AUTOSAVE_SECONDS;
+    WheelPush(&server->wheel[tick%WHEEL_SLOTS],session->id,tick);
+    pthread_mutex_unlock(&server->wheelMutex);
+    session->autosaveTick = tick;
+    session->autosaveSaves = session->args.saveCount;
+}
+
+// Function passed to timer thread of the game server. Every second moves autosaves due from the timer wheel
+// to their workers, so that thousands of games share one sleeping thread and games are saved by their own workers.
+void* WheelWork(void* pVoid) {
+    server_t* server = pVoid;
+    wheelList_t due = {NULL,0,0};
+    uint64_t expirations, one = 1;
+    int i;
+    while(1) {
+        if(read(server->timerFd,&expirations,sizeof(expirations)) != sizeof(expirations)) ERR("read");
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL); // Never leave a mutex locked.
+        pthread_mutex_lock(&server->wheelMutex);
+        wheelList_t* slot = &server->wheel[++server->tick%WHEEL_SLOTS];
+        wheelList_t tmp = *slot; // Swap buffers, so the slot is refilled while due autosaves are handed out.
+        *slot = due;
+        due = tmp;
+        pthread_mutex_unlock(&server->wheelMutex);
+        for(i=0;i<due.len;i++) {
+            serverWorker_t* worker = &server->workers[due.entries[i].id%server->workerCount];
+            pthread_mutex_lock(&worker->dueMutex);
+            WheelPush(&worker->due,due.entries[i].id,due.entries[i].tick);
+            pthread_mutex_unlock(&worker->dueMutex);
+        }
+        for(i=0;i<server->workerCount && due.len > 0;i++) {
+            if(write(server->workers[i].wakeFd,&one,sizeof(one)) != sizeof(one)) ERR("write");
+        }
+        due.len = 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,NULL);
+    }
+}
+
+// Returns bucket of session id in the session table of worker.
+session_t** SessionBucket(serverWorker_t* worker, uint64_t id) {
+    return &worker->buckets[(id/worker->server->workerCount) & (worker->bucketCount-1)];
+}
+
+// Returns session id of worker, or NULL if it was closed.
+session_t* FindSession(serverWorker_t* worker, uint64_t id) {
+    session_t* session = *SessionBucket(worker,id);
+    while(session && session->id != id) session = session->tableNext;
+    return session;
+}
+
+// Adds session to the session table of its worker, doubling the table when it gets full.
+void AddSession(serverWorker_t* worker, session_t* session) {
+    int i;
+    if(worker->sessionCount == worker->bucketCount) {
+        session_t** old = worker->buckets;
+        int oldCount = worker->bucketCount;
+        worker->bucketCount = oldCount ? 2*oldCount : 64;
+        if(!(worker->buckets = (session_t**)calloc(worker->bucketCount,sizeof(session_t*)))) ERR("calloc");
+        for(i=0;i<oldCount;i++) {
+            while(old[i]) {
+                session_t* next = old[i]->tableNext;
+                session_t** bucket = SessionBucket(worker,old[i]->id);
+                old[i]->tableNext = *bucket;
+                *bucket = old[i];
+                old[i] = next;
+            }
+        }
+        free(old);
+    }
+    session_t** bucket = SessionBucket(worker,session->id);
+    session->tableNext = *bucket;
+    *bucket = session;
+    worker->sessionCount++;
+}
+
+// Removes session from the session table of its worker.
+void RemoveSession(serverWorker_t* worker, session_t* session) {
+    session_t** link = SessionBucket(worker,session->id);
+    while(*link != session) link = &(*link)->tableNext;
+    *link = session->tableNext;
+    worker->sessionCount--;
+}
+
+// Returns array of size bytes at ptr for a save job of the game in args: a copy if the game goes on, or if the
+// array is in the arena of the session, which its next game reuses, and ptr itself otherwise.
+void* SaveJobArray(gameArgs_t* args, void* ptr, size_t size, bool release) {
+    char* arena = args->arena;
+    if(release && !(arena && (char*)ptr >= arena && (char*)ptr < arena+args->arenaSize)) return ptr;
+    void* copy = malloc(size);
+    if(!copy) ERR("malloc");
+    return memcpy(copy,ptr,size);
+}
+
+// Queues save of the game of session for the saver thread. If release is set the game has ended and the job takes
+// it over, otherwise it shares the map with the game, which is freed only by a later job. Jobs run in order.
+void QueueSave(session_t* session, bool write, bool release) {
+    server_t* server = session->worker->server;
+    gameArgs_t* args = &session->args;
+    int n = args->roomCount, numberOfItems = 3*n/2;
+    saveJob_t* job = (saveJob_t*)malloc(sizeof(saveJob_t));
+    if(!job) ERR("malloc");
+    job->game = *args;
+    job->game.items = SaveJobArray(args,args->items,sizeof(int)*numberOfItems,release);
+    job->game.itemDest = SaveJobArray(args,args->itemDest,sizeof(int)*numberOfItems,release);
+    job->game.itemsInRoom = SaveJobArray(args,args->itemsInRoom,sizeof(int)*n,release);
+    job->game.roomSlots = SaveJobArray(args,args->roomSlots,sizeof(int)*2*n,release);
+    job->game.properRoom = SaveJobArray(args,args->properRoom,sizeof(uint64_t)*BITSET_WORDS(numberOfItems),release);
+    job->game.arena = NULL;
+    job->game.arenaSize = 0;
+    strcpy(job->path,session->autosavePath);
+    job->write = write;
+    job->release = release;
+    job->next = NULL;
+    pthread_mutex_lock(&server->saveMutex);
+    if(server->saveFirst) server->saveLast->next = job;
+    else server->saveFirst = job;
+    server->saveLast = job;
+    if(pthread_cond_signal(&server->saveWake)) ERR("pthread_cond_signal");
+    pthread_mutex_unlock(&server->saveMutex);
+}
+
+// Function passed to saver thread of the game server. Writes queued games of sessions to their autosave paths
+// and frees them, until the server stops and the queue is empty. A failed autosave is reported and skipped.
+void* SaverWork(void* pVoid) {
+    server_t* server = pVoid;
+    while(1) {
+        pthread_mutex_lock(&server->saveMutex);
+        while(!server->saveFirst && !server->saveStop) {
+            if(pthread_cond_wait(&server->saveWake,&server->saveMutex)) ERR("pthread_cond_wait");
+        }
+        saveJob_t* job = server->saveFirst;
+        if(job) server->saveFirst = job->next;
+        pthread_mutex_unlock(&server->saveMutex);
+        if(!job) return NULL;
+        gameArgs_t* game = &job->game;
+        if(job->write) {
+            uint64_t start = MonotonicNs(), bytes = WriteGame(game,job->path,0,0);
+            if(!bytes) fprintf(stderr,"Cannot autosave to %s: %s\n",job->path,strerror(errno));
+            __atomic_fetch_add(&metrics.autosaveBytes,bytes,__ATOMIC_RELAXED);
+            HistogramAdd(&metrics.snapshotTimes,MonotonicNs()-start);
+        }
+        if(job->release) {
+            StopRouting(game); // Builder was stopped by the worker, only the index is left.
+            ReleaseGame(game);
+        }
+        else {
+            free(game->items);
+            free(game->itemDest);
+            free(game->itemsInRoom);
+            free(game->roomSlots);
+            free(game->properRoom);
+        }
+        free(job);
+    }
+}
+
+// Hands the game of session to the saver thread to be written to its autosave path.
+void AutosaveSession(session_t* session) {
+    QueueSave(session,true,false);
+    session->autosaveMoves = session->args.movesCount;
+}
+
+// Handles autosaves handed to worker by the timer thread. Games not changed since last save are skipped,
+// and a save command postpones the autosave, like in a single game.
+void RunDueAutosaves(serverWorker_t* worker) {
+    wheelList_t due;
+    int i;
+    pthread_mutex_lock(&worker->dueMutex);
+    due = worker->due;
+    worker->due.entries = NULL;
+    worker->due.len = worker->due.cap = 0;
+    pthread_mutex_unlock(&worker->dueMutex);
+    for(i=0;i<due.len;i++) {
+        session_t* session = FindSession(worker,due.entries[i].id);
+        if(!session || !session->playing || session->autosaveTick != due.entries[i].tick) continue; // Stale.
+        if(session->autosaveSaves == session->args.saveCount && session->autosaveMoves != session->args.movesCount) AutosaveSession(session);
+        ScheduleAutosave(session);
+    }
+    free(due.entries);
+}
+
+// Ends the game of session and hands it to the saver thread, which saves it to its autosave path first if save
+// is true and it changed since last save, and frees it.
+void EndSessionGame(session_t* session, bool save) {
+    gameArgs_t* args = &session->args;
+    if(!session->playing) return;
+    session->playing = false;
+    session->autosaveTick = 0;
+    CancelRouting(args); // Builder uses args of the session, so it is stopped here.
+    QueueSave(session,save && session->autosaveMoves != args->movesCount,true);
+    ClearGame(args); // Walk pool belongs to the worker and is not in args.
+}
+
+// Starts the game of session after its map or save was loaded.
+void StartSessionGame(session_t* session) {
+    gameArgs_t* args = &session->args;
+    StartRouting(args);
+    session->playing = true;
+    session->autosaveMoves = -1;
+    ScheduleAutosave(session);
+    PrintGameState(args,args->output);
+}
+
+// Joins session to the unfinished shared game on the map at path, placing items in a new game if there is none.
+// Returns false if the map cannot be read or is too small.
+bool JoinSharedGame(session_t* session, char* path) {
+    server_t* server = session->worker->server;
+    char* resolved = realpath(path,NULL);
+    if(!resolved) return false;
+    pthread_mutex_lock(&server->gamesMutex); // New games are read under it, so two sessions never make two games of one map.
+    sharedGame_t* shared = server->games;
+    while(shared && strcmp(shared->path,resolved) != 0) shared = shared->next;
+    if(shared) free(resolved);
+    else {
+        if(!(shared = (sharedGame_t*)calloc(1,sizeof(sharedGame_t)))) ERR("calloc");
+        shared->game = session->args;
+        shared->game.arena = NULL;
+        shared->game.arenaSize = 0;
+        bool read = ReadGraph(&shared->game,resolved);
+        if(!read || !OrganizeItems(&shared->game)) {
+            if(read) ReleaseGame(&shared->game);
+            pthread_mutex_unlock(&server->gamesMutex);
+            free(shared->game.arena);
+            free(shared);
+            free(resolved);
+            return false;
+        }
+        gameArgs_t* game = &shared->game;
+        int i, n = game->roomCount;
+        world_t world = {&game->graph,n,3*n/2,game->itemDest,NULL,game->misplacedCount,NULL,0};
+        if(!(world.slots = (uint64_t*)malloc(sizeof(uint64_t)*n))) ERR("malloc");
+        for(i=0;i<n;i++) world.slots[i] = SlotWord(game->roomSlots[2*i],game->roomSlots[2*i+1]);
+        shared->world = world;
+        shared->path = resolved;
+        shared->listed = true;
+        shared->next = server->games;
+        server->games = shared;
+    }
+    __atomic_store_n(&shared->players,shared->players+1,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&server->gamesMutex);
+    session->shared = shared;
+    player_t* player = &session->player;
+    memset(player,0,sizeof(player_t));
+    player->world = &shared->world;
+    RngSeed(&player->rng,shared->game.itemSeed+session->id);
+    player->room = RngBelow(&player->rng,shared->world.roomCount);
+    player->held = -1;
+    return true;
+}
+
+// Takes session out of its shared game, putting the item it holds into the nearest room with an empty slot.
+// The last player frees the game.
+void LeaveSharedGame(session_t* session) {
+    server_t* server = session->worker->server;
+    sharedGame_t* shared = session->shared;
+    player_t* player = &session->player;
+    world_t* world = &shared->world;
+    int head = 0, tail = 0, room;
+    if(player->held != -1) { // There are 2 slots per room and 3 items per 2 rooms, so some room has an empty slot.
+        int* queue = (int*)malloc(sizeof(int)*world->roomCount);
+        char* seen = (char*)calloc(world->roomCount,sizeof(char));
+        if(!queue || !seen) ERR("malloc");
+        queue[tail++] = player->room;
+        seen[player->room] = 1;
+        for(room=-1;room == -1 || !PutItem(world,room,player->held);) {
+            if(head == tail) { // Reachable rooms are full, fall back to all of them.
+                memset(seen,1,world->roomCount);
+                head = tail = 0;
+                for(room=0;room<world->roomCount;room++) queue[tail++] = room;
+            }
+            room = queue[head++];
+            for(long i=world->graph->offsets[room];i<world->graph->offsets[room+1];i++) {
+                int next = world->graph->neighbors[i];
+                if(!seen[next]) {
+                    seen[next] = 1;
+                    queue[tail++] = next;
+                }
+            }
+        }
+        if(world->itemDest[player->held] == room) __atomic_fetch_sub(&world->misplacedCount,1,__ATOMIC_RELAXED);
+        player->held = -1;
+        free(queue);
+        free(seen);
+    }
+    pthread_mutex_lock(&server->gamesMutex);
+    __atomic_store_n(&shared->players,shared->players-1,__ATOMIC_RELAXED);
+    bool last = shared->players == 0;
+    if(shared->listed && (last || __atomic_load_n(&world->misplacedCount,__ATOMIC_RELAXED) == 0)) {
+        sharedGame_t** link = &server->games;
+        while(*link != shared) link = &(*link)->next;
+        *link = shared->next;
+        shared->listed = false;
+    }
+    pthread_mutex_unlock(&server->gamesMutex);
+    session->shared = NULL;
+    if(!last) return;
+    free(world->slots);
+    ReleaseGame(&shared->game);
+    free(shared->game.arena);
+    free(shared->path);
+    free(shared);
+}
+
+// Prints room of the player of session in its shared game, items there and the state of the game.
+void PrintSharedState(session_t* session) {
+    player_t* player = &session->player;
+    world_t* world = player->world;
+    outBuffer_t* out = &session->output;
+    long first = world->graph->offsets[player->room], last = world->graph->offsets[player->room+1];
+    uint64_t word = __atomic_load_n(&world->slots[player->room],__ATOMIC_ACQUIRE);
+    int k;
+    OutReserve(out,256+12*(last-first));
+    char* pos = FORMAT_TEXT(out->data+out->len,"Current room is ");
+    pos = FormatInt(pos,player->room,'.');
+    pos = FORMAT_TEXT(pos," Available rooms are: ");
+    for(long i=first;i<last;i++) pos = FormatInt(pos,world->graph->neighbors[i],' ');
+    pos = FORMAT_TEXT(pos,"\nItems in this room: ");
+    for(k=0;k<2 && SlotItem(word,k) != -1;k++) pos = FormatInt(pos,SlotItem(word,k),' ');
+    pos = FORMAT_TEXT(pos,"\nMisplaced items: ");
+    pos = FormatInt(pos,__atomic_load_n(&world->misplacedCount,__ATOMIC_RELAXED),'.');
+    pos = FORMAT_TEXT(pos," Players: ");
+    pos = FormatInt(pos,__atomic_load_n(&session->shared->players,__ATOMIC_RELAXED),'\n');
+    if(player->held == -1) pos = FORMAT_TEXT(pos,"You can pick up an item.");
+    else {
+        pos = FORMAT_TEXT(pos,"You are carrying item ");
+        pos = FormatInt(pos,player->held,' ');
+        pos = FORMAT_TEXT(pos,"to room ");
+        pos = FormatInt(pos,world->itemDest[player->held],'.');
+    }
+    pos = FORMAT_TEXT(pos," Moves count: ");
+    pos = FormatInt(pos,(int)player->moves,'\n');
+    out->len = pos-out->data;
+}
+
+// Runs one game command of session in its shared game. Pick-ups and drops change the room with compare-and-swap
+// and fail if another player changed it first. The session leaves the game when it quits or the game is finished.
+void SharedCommand(session_t* session, char** words) {
+    player_t* player = &session->player;
+    world_t* world = player->world;
+    outBuffer_t* out = &session->output;
+    int id = CommandId(words[0]), arg = words[1] ? atoi(words[1]) : -1;
+    __atomic_fetch_add(&metrics.commands[id],1,__ATOMIC_RELAXED);
+    if(id == CMD_QUIT) {
+        LeaveSharedGame(session);
+        return;
+    }
+    if(id == CMD_MOVE_TO && words[1]) {
+        if(arg >= 0 && arg < world->roomCount && IsNeighbor(world->graph,player->room,arg)) player->room = arg;
+        else OutText(out,"Bad room number\n");
+    }
+    else if(id == CMD_PICK_UP && player->held == -1 && arg >= 0 && arg < world->itemCount) {
+        if(!TakeItem(world,player->room,arg)) OutText(out,"Item is not in this room\n");
+        else {
+            player->held = arg;
+            if(world->itemDest[arg] == player->room) __atomic_fetch_add(&world->misplacedCount,1,__ATOMIC_RELAXED);
+        }
+    }
+    else if(id == CMD_DROP && player->held != -1 && arg == player->held) {
+        if(!PutItem(world,player->room,arg)) OutText(out,"Room is full\n");
+        else {
+            player->held = -1;
+            if(world->itemDest[arg] == player->room) __atomic_fetch_sub(&world->misplacedCount,1,__ATOMIC_RELAXED);
+        }
+    }
+    else if(id != CMD_MOVE_TO && id != CMD_PICK_UP && id != CMD_DROP) OutText(out,"Not available in shared games\n");
+    player->moves++;
+    if(__atomic_load_n(&world->misplacedCount,__ATOMIC_RELAXED) == 0) { // Finished by this or another player.
+        OutPrintf(out,"Finished game with %ld moves\n",player->moves);
+        LeaveSharedGame(session);
+    }
+    else PrintSharedState(session);
+}
+
+// Runs one command line of the client of session, ending the reply with an empty line. Returns false if the client exited.
+bool SessionCommand(session_t* session, char* line) {
+    gameArgs_t* args = &session->args;
+    char* words[4];
+    int id;
+    SplitCommand(line,words,4);
+    if(session->shared) SharedCommand(session,words);
+    else if(session->playing) {
+        LockGame(&session->args);
+        args->walkPool = session->worker->walkPool;
+        int result = GameCommand(args,words[0],words[1],words[2],words[3]);
+        session->worker->walkPool = args->walkPool;
+        args->walkPool = NULL;
+        pthread_mutex_unlock(&session->mutex);
+        if(result == COMMAND_DONE) {
+            PrintGameState(args,args->output);
+        }
+        else EndSessionGame(session,false);
+    }
+    else if((id = CommandId(words[0])) == CMD_EXIT) return false;
+    else if(id == CMD_START_GAME && words[1]) {
+        if(!ReadGraph(args,words[1])) OutText(args->output,"Bad map file\n");
+        else if(!OrganizeItems(args)) {
+            OutText(args->output,"Map is too small\n");
+            ReleaseGame(args);
+        }
+        else StartSessionGame(session);
+    }
+    else if(id == CMD_LOAD_GAME && words[1]) {
+        if(!LoadGame(args,words[1])) OutText(args->output,"Bad save file\n");
+        else StartSessionGame(session);
+    }
+    else if(id == CMD_JOIN_GAME && words[1]) {
+        if(!JoinSharedGame(session,words[1])) OutText(args->output,"Bad map file\n");
+        else PrintSharedState(session);
+    }
+    else if(id == CMD_STATS) PrintMetrics(args->output);
+    else OutText(args->output,"Bad command\n");
+    OutText(args->output,"\n");
+    return true;
+}
+
+// Sends replies waiting for the client of session, reading its input only once all are sent. Returns false if the client is gone.
+bool FlushSession(session_t* session) {
+    struct epoll_event event;
+    outBuffer_t* output = &session->output;
+    while(session->outSent < output->len) {
+        ssize_t count = send(session->fd,output->data+session->outSent,output->len-session->outSent,MSG_NOSIGNAL|MSG_DONTWAIT);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if(count < 0) return false;
+        session->outSent += count;
+    }
+    if(session->outSent == output->len) session->outSent = output->len = 0;
+    if(session->sending != (output->len > 0)) {
+        session->sending = output->len > 0;
+        event.events = session->sending ? EPOLLOUT : EPOLLIN;
+        event.data.ptr = session;
+        if(epoll_ctl(session->worker->epollFd,EPOLL_CTL_MOD,session->fd,&event)) ERR("epoll_ctl");
+    }
+    return true;
+}
+
+// Handles events of the client of session: runs every complete command it sent and sends replies.
+// Returns false if the session should be closed.
+bool ServeClient(session_t* session, uint32_t events) {
+    if(events & EPOLLOUT) return FlushSession(session);
+    if(!(events & EPOLLIN)) return false; // Error or hang up without data.
+    ssize_t count = recv(session->fd,session->in+session->inLen,sizeof(session->in)-session->inLen,MSG_DONTWAIT);
+    if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return true;
+    if(count <= 0) return false;
+    session->inLen += count;
+    char *line = session->in, *end;
+    bool open = true;
+    while(open && (end = memchr(line,'\n',session->in+session->inLen-line))) {
+        *end = '\0';
+        open = SessionCommand(session,line);
+        line = end+1;
+    }
+    session->inLen -= line-session->in;
+    memmove(session->in,line,session->inLen);
+    if(session->inLen == sizeof(session->in)) open = false; // Line longer than any command.
+    return FlushSession(session) && open;
+}
+
+// Accepts a waiting client of the server, which gets a new session served by worker. Only one client
+// is taken at a time, so that other workers woken for the listening socket take the rest.
+void AcceptClient(serverWorker_t* worker) {
+    server_t* server = worker->server;
+    struct epoll_event event;
+    int fd;
+    do fd = accept4(server->listenFd,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+    while(fd < 0 && errno == EINTR);
+    if(fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)) return;
+    if(fd < 0 && (errno == EMFILE || errno == ENFILE)) { // Client waits in the backlog until a session ends.
+        perror("accept4");
+        return;
+    }
+    if(fd < 0) ERR("accept4");
+    session_t* session = (session_t*)calloc(1,sizeof(session_t));
+    if(!session) ERR("calloc");
+    session->args = *server->args;
+    session->id = worker->nextSeq++*server->workerCount+worker->index;
+    session->worker = worker;
+    session->fd = fd;
+    if(pthread_mutex_init(&session->mutex,NULL)) ERR("pthread_mutex_init");
+    snprintf(session->autosavePath,sizeof(session->autosavePath),"%s.%llu",server->args->autosavePath,(unsigned long long)session->id);
+    gameArgs_t* args = &session->args;
+    args->mutex = &session->mutex;
+    args->autosavePath = session->autosavePath;
+    args->input = NULL;
+    args->record = NULL;
+    args->headless = false;
+    args->session = true;
+    args->liveMode = false;
+    args->arena = NULL; // Every session keeps its own.
+    args->arenaSize = 0;
+    session->output.fd = -1; // Sent by FlushSession.
+    args->output = &session->output;
+    AddSession(worker,session);
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    if(epoll_ctl(worker->epollFd,EPOLL_CTL_ADD,fd,&event)) ERR("epoll_ctl");
+}
+
+// Closes session, saving its game if save is true.
+void CloseSession(session_t* session, bool save) {
+    EndSessionGame(session,save);
+    if(session->shared) LeaveSharedGame(session);
+    RemoveSession(session->worker,session);
+    if(close(session->fd)) ERR("close");
+    pthread_mutex_destroy(&session->mutex);
+    OutFree(&session->output);
+    free(session->args.arena);
+    free(session);
+}
+
+// Function passed to worker threads of the game server. Every worker accepts clients and serves them until the server stops,
+// then saves and closes its sessions.
+void* ServerWork(void* pVoid) {
+    serverWorker_t* worker = pVoid;
+    struct epoll_event events[SERVER_EVENTS];
+    uint64_t count;
+    int i;
+    while(!__atomic_load_n(&worker->server->stop,__ATOMIC_ACQUIRE)) {
+        int ready = epoll_wait(worker->epollFd,events,SERVER_EVENTS,-1);
+        if(ready < 0 && errno == EINTR) continue;
+        if(ready < 0) ERR("epoll_wait");
+        for(i=0;i<ready;i++) {
+            if(!events[i].data.ptr) AcceptClient(worker);
+            else if(events[i].data.ptr == worker) {
+                if(read(worker->wakeFd,&count,sizeof(count)) < 0 && errno != EAGAIN) ERR("read");
+                RunDueAutosaves(worker);
+            }
+            else if(!ServeClient(events[i].data.ptr,events[i].events)) CloseSession(events[i].data.ptr,true);
         }
     }
+    for(i=0;i<worker->bucketCount;i++) {
+        while(worker->buckets[i]) CloseSession(worker->buckets[i],true);
+    }
+    return NULL;
+}
+
+// Runs the game server on Unix domain socket path with workerCount workers until SIGINT or SIGTERM. Sessions
+// get settings of args and autosave to its backup path with the session number appended.
+void RunServer(gameArgs_t* args, char* path, int workerCount) {
+    struct sockaddr_un address;
+    struct epoll_event event;
+    struct stat info;
+    struct itimerspec interval;
+    sigset_t mask;
+    server_t server;
+    uint64_t one = 1;
+    int i, signo;
+    memset(&server,0,sizeof(server));
+    memset(&address,0,sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path too long\n");
+        return;
+    }
+    strcpy(address.sun_path,path);
+    if(lstat(path,&info) == 0 && S_ISSOCK(info.st_mode) && unlink(path)) ERR("unlink"); // Left by a server that was killed.
+    if((server.listenFd = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0)) < 0) ERR("socket");
+    if(bind(server.listenFd,(struct sockaddr*)&address,sizeof(address))) ERR("bind");
+    if(listen(server.listenFd,SOMAXCONN)) ERR("listen");
+    sigemptyset(&mask);
+    sigaddset(&mask,SIGINT);
+    sigaddset(&mask,SIGTERM);
+    if(pthread_sigmask(SIG_BLOCK,&mask,NULL)) ERR("pthread_sigmask");
+    server.args = args;
+    server.workerCount = workerCount;
+    if(pthread_mutex_init(&server.wheelMutex,NULL)) ERR("pthread_mutex_init");
+    if(pthread_mutex_init(&server.saveMutex,NULL)) ERR("pthread_mutex_init");
+    if(pthread_cond_init(&server.saveWake,NULL)) ERR("pthread_cond_init");
+    if(pthread_mutex_init(&server.gamesMutex,NULL)) ERR("pthread_mutex_init");
+    if(pthread_create(&server.saverThread,NULL,SaverWork,&server)) ERR("pthread_create");
+    if(!(server.workers = (serverWorker_t*)calloc(workerCount,sizeof(serverWorker_t)))) ERR("calloc");
+    for(i=0;i<workerCount;i++) {
+        serverWorker_t* worker = &server.workers[i];
+        worker->server = &server;
+        worker->index = i;
+        if(pthread_mutex_init(&worker->dueMutex,NULL)) ERR("pthread_mutex_init");
+        if((worker->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) ERR("epoll_create1");
+        if((worker->wakeFd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) < 0) ERR("eventfd");
+        event.events = EPOLLIN|EPOLLEXCLUSIVE; // A new client wakes one worker, not all of them.
+        event.data.ptr = NULL;
+        if(epoll_ctl(worker->epollFd,EPOLL_CTL_ADD,server.listenFd,&event)) ERR("epoll_ctl");
+        event.events = EPOLLIN;
+        event.data.ptr = worker;
+        if(epoll_ctl(worker->epollFd,EPOLL_CTL_ADD,worker->wakeFd,&event)) ERR("epoll_ctl");
+        if(pthread_create(&worker->thread,NULL,ServerWork,worker)) ERR("pthread_create");
+    }
+    interval.it_interval.tv_sec = 1;
+    interval.it_interval.tv_nsec = 0;
+    interval.it_value = interval.it_interval;
+    if((server.timerFd = timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC)) < 0) ERR("timerfd_create");
+    if(timerfd_settime(server.timerFd,0,&interval,NULL)) ERR("timerfd_settime");
+    if(pthread_create(&server.timerThread,NULL,WheelWork,&server)) ERR("pthread_create");
+    printf("Serving on %s with %d workers\n",path,workerCount);
+    fflush(stdout);
+    if(sigwait(&mask,&signo)) ERR("sigwait");
+    printf("Stopping server, saving games\n");
+    pthread_cancel(server.timerThread);
+    if(pthread_join(server.timerThread,NULL)) ERR("pthread_join");
+    __atomic_store_n(&server.stop,true,__ATOMIC_RELEASE);
+    for(i=0;i<workerCount;i++) {
+        if(write(server.workers[i].wakeFd,&one,sizeof(one)) != sizeof(one)) ERR("write");
+    }
+    for(i=0;i<workerCount;i++) {
+        serverWorker_t* worker = &server.workers[i];
+        if(pthread_join(worker->thread,NULL)) ERR("pthread_join");
+        if(worker->walkPool) DestroyWalkPool(worker->walkPool);
+        if(close(worker->epollFd) || close(worker->wakeFd)) ERR("close");
+        pthread_mutex_destroy(&worker->dueMutex);
+        free(worker->buckets);
+        free(worker->due.entries);
+    }
+    pthread_mutex_lock(&server.saveMutex); // Workers have queued their last games, the saver writes them and ends.
+    server.saveStop = true;
+    if(pthread_cond_signal(&server.saveWake)) ERR("pthread_cond_signal");
+    pthread_mutex_unlock(&server.saveMutex);
+    if(pthread_join(server.saverThread,NULL)) ERR("pthread_join");
+    pthread_mutex_destroy(&server.saveMutex);
+    pthread_cond_destroy(&server.saveWake);
+    for(i=0;i<WHEEL_SLOTS;i++) free(server.wheel[i].entries);
+    if(close(server.timerFd) || close(server.listenFd)) ERR("close");
+    if(unlink(path)) ERR("unlink");
+    pthread_mutex_destroy(&server.wheelMutex);
+    pthread_mutex_destroy(&server.gamesMutex); // Sessions left their shared games when they were closed.
+    free(server.workers);
 }
 
 // Main menu.
 int main(int argc, char** argv) {
-    if(argc != 1 && argc != 3) usage();
     char savePath[MAX_PATH] = "";
-    char text[MAX_PATH] = "", *cmd, *arg1, *arg2;
+    char *text, *words[5], *cmd, *arg1, *arg2, *arg3, *arg4;
     gameArgs_t args;
-    srand(time(NULL));
-    if(argc == 1) {
+    memset(&args,0,sizeof(args));
+    int opt, id;
+    unsigned int seed = time(NULL);
+    char *scriptPath = NULL, *recordPath = NULL, *serverPath = NULL;
+    int workers = ProcessorCount();
+    const char* routeModes[] = {"none","table","alt","auto"};
+    const char* topologies[] = {"dense","tree","gnp","grid","small-world"};
+    const struct option longOptions[] = {
+        {"headless",required_argument,NULL,'H'},
+        {"seed",required_argument,NULL,'s'},
+        {"record",required_argument,NULL,'R'},
+        {"server",required_argument,NULL,'S'},
+        {"workers",required_argument,NULL,'w'},
+        {NULL,0,NULL,0}
+    };
+    while((opt = getopt_long(argc,argv,"b:lr:",longOptions,NULL)) != -1) {
+        if(opt == 'b' && strlen(optarg) < MAX_PATH) strcpy(savePath,optarg);
+        else if(opt == 'l') args.liveMode = true;
+        else if(opt == 'H') scriptPath = optarg;
+        else if(opt == 's') seed = strtoul(optarg,NULL,10);
+        else if(opt == 'R') recordPath = optarg;
+        else if(opt == 'S') serverPath = optarg;
+        else if(opt == 'w' && atoi(optarg) > 0) workers = atoi(optarg);
+        else if(opt == 'r') {
+            for(args.routing.mode=ROUTE_AUTO;args.routing.mode>=ROUTE_NONE;args.routing.mode--) {
+                if(strcmp(optarg,routeModes[args.routing.mode]) == 0) break;
+            }
+            if(args.routing.mode < ROUTE_NONE) usage();
+        }
+        else usage();
+    }
+    if(optind != argc) usage();
+    if(savePath[0] == '\0') {
         if(getenv("GAME_AUTOSAVE")) strcpy(savePath,getenv("GAME_AUTOSAVE"));
         else strcpy(savePath,"./.game_autosave");
     }
-    else if(strcmp(argv[1],"-b") != 0) usage();
-    else strcpy(savePath,argv[2]);
     args.autosavePath = savePath;
-    pthread_t autosave, signalHandler;
+    FILE* script = stdin;
+    if(scriptPath) {
+        args.headless = true;
+        if(!(script = fopen(scriptPath,"r"))) ERR("fopen");
+    }
+    lineReader_t input;
+    outBuffer_t output = {NULL,0,0,STDOUT_FILENO};
+    InitReader(&input,script);
+    args.input = &input;
+    args.output = &output;
+    if(recordPath) {
+        if(!(args.record = fopen(recordPath,"w"))) ERR("fopen");
+        setvbuf(args.record,NULL,_IOLBF,0);
+        fprintf(args.record,"seed %u\n",seed);
+    }
+    SeedGame(&args,seed);
     pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
     args.mutex = &mutex;
-    sigset_t mask,oldmask;
+    sigset_t mask,oldmask,metricsMask;
     sigemptyset(&mask);
     sigaddset(&mask,SIGUSR1);
     if(pthread_sigmask(SIG_BLOCK,&mask,&oldmask)) ERR("pthread_sigmask");
     args.mask = &mask;
+    sigemptyset(&metricsMask);
+    sigaddset(&metricsMask,SIGUSR2);
+    if(pthread_sigmask(SIG_BLOCK,&metricsMask,NULL)) ERR("pthread_sigmask");
+    pthread_t metricsThread;
+    if(pthread_create(&metricsThread,NULL,MetricsWork,&metricsMask)) ERR("pthread_create");
+    if(pthread_detach(metricsThread)) ERR("pthread_detach");
+    if(serverPath) {
+        RunServer(&args,serverPath,workers);
+        return EXIT_SUCCESS;
+    }
     while(1) {
-        fgets(text,MAX_PATH,stdin);
-        cmd = strtok(text," ");
-        if(cmd[strlen(cmd)-1] == '\n') cmd[strlen(cmd)-1] = '\0'; // Dealing with \n left by fgets.
-        arg1 = strtok(NULL," ");
-        if(arg1 && arg1[strlen(arg1)-1] == '\n') arg1[strlen(arg1)-1] = '\0';
-        arg2 = strtok(NULL," ");
-        if(arg2 && arg2[strlen(arg2)-1] == '\n') arg2[strlen(arg2)-1] = '\0';
-        if(strcmp(cmd,"exit") == 0) break; // exit command
-        if(strcmp(cmd,"generate-random-map") == 0 && arg1 && arg2) { // generate-random-map command
+        if(!(text = ReadLine(args.input,args.output))) break; // End of input, like exit.
+        if(args.record) {
+            fputs(text,args.record);
+            fputc('\n',args.record);
+        }
+        SplitCommand(text,words,5);
+        cmd = words[0];
+        arg1 = words[1];
+        arg2 = words[2];
+        arg3 = words[3];
+        arg4 = words[4];
+        id = CommandId(cmd);
+        if(id == CMD_EXIT) break; // exit command
+        if(id == CMD_SEED && arg1) SeedGame(&args,strtoul(arg1,NULL,10)); // seed command
+        else if(id == CMD_STATS) { // stats command
+            PrintMetrics(args.output);
+            OutFlush(args.output);
+        }
+        else if(id == CMD_GENERATE_RANDOM_MAP && arg1 && arg2) { // generate-random-map command
+            int topology = TOPOLOGY_DENSE, degree = arg4 ? atoi(arg4) : MAPGEN_DEFAULT_DEGREE;
+            while(arg3 && topology <= TOPOLOGY_SMALL_WORLD && strcmp(arg3,topologies[topology]) != 0) topology++;
             args.roomCount = atoi(arg1);
-            args.graph = CreateGraph(args.roomCount);
-            SaveGraph(args.graph,args.roomCount,arg2);
-        }
-        else if(strcmp(cmd,"map-from-dir-tree") == 0 && arg1 && arg2) { // map-from-dir-tree command
-            nftwArgs.len = 0;
-            if(nftw(arg1,walk,MAX_FD,FTW_PHYS)) ERR("nftw");
-            args.roomCount = nftwArgs.len;
-            args.graph = MapFromDirTree(&nftwArgs);
-            SaveGraph(args.graph,args.roomCount,arg2);
-        }
-        else if (strcmp(cmd,"load-game") == 0 && arg1) { // load-game command
-            LoadGame(&args,arg1);
-            if(pthread_create(&autosave,NULL,autosaveWork,&args)) ERR("pthread_create");
-            if(pthread_create(&signalHandler,NULL,signalHandling,&args)) ERR("pthread_create");
+            if(topology > TOPOLOGY_SMALL_WORLD || degree < 2 || args.roomCount < 1) printf("Bad topology, degree or room count\n");
+            else if(topology != TOPOLOGY_DENSE) GenerateMap(args.roomCount,arg2,topology,degree,((uint64_t)rand() << 32) ^ rand());
+            else {
+                bitGraph_t bits = CreateBits(args.roomCount,((uint64_t)rand() << 32) ^ rand());
+                if(!SaveBits(&bits,arg2)) printf("Cannot write %s: %s\n",arg2,strerror(errno));
+                free(bits.rows);
+            }
+        }
+        else if(id == CMD_MAP_FROM_DIR_TREE && arg1 && arg2) { // map-from-dir-tree command
+            if(!MapFromDirTree(arg1,&args.graph,&args.roomCount)) printf("Bad directory\n");
+            else {
+                if(!SaveGraph(&args.graph,args.roomCount,arg2)) printf("Cannot write %s: %s\n",arg2,strerror(errno));
+                FreeGraph(&args.graph);
+            }
+        }
+        else if(id == CMD_LOAD_GAME && arg1) { // load-game command
+            if(!LoadGame(&args,arg1) || (args.liveMode && !MakeLive(&args))) {
+                printf("Bad save file\n");
+                continue;
+            }
+            StartGame(&args);
             Play(&args);
-            pthread_cancel(autosave);
-            pthread_cancel(signalHandler);
-        }
-        else if(strcmp(cmd,"start-game") == 0 && arg1) { // save-game command
-            ReadGraph(&args,arg1);
-            OrganizeItems(&args);
-            if(pthread_create(&autosave,NULL,autosaveWork,&args)) ERR("pthread_create");
-            if(pthread_create(&signalHandler,NULL,signalHandling,&args)) ERR("pthread_create");
+        }
+        else if(id == CMD_START_GAME && arg1) { // save-game command
+            if(!ReadGraph(&args,arg1)) {
+                printf("Bad map file\n");
+                continue;
+            }
+            if(!OrganizeItems(&args)) {
+                printf("Map is too small\n");
+                ReleaseGame(&args);
+                continue;
+            }
+            if(args.liveMode && !MakeLive(&args)) {
+                printf("Bad map file\n");
+                continue;
+            }
+            StartGame(&args);
             Play(&args);
-            pthread_cancel(autosave);
-            pthread_cancel(signalHandler);
+        }
+        else if(id == CMD_ANALYZE_MAP && arg1) { // analyze-map command
+            bitGraph_t bits;
+            if(!ReadMapBits(&args,arg1,&bits)) {
+                printf("Bad map file or too many rooms\n");
+                continue;
+            }
+            AnalyzeMap(bits.rows ? &bits : NULL,bits.rows ? NULL : &args.graph,args.roomCount,arg2,args.output);
+            OutFlush(args.output);
+            ReleaseGame(&args);
+        }
+        else if(id == CMD_SELF_PLAY && arg1 && arg2) { // self-play command
+            struct stat st;
+            int games = atoi(arg1);
+            bool dir = stat(arg2,&st) == 0 && S_ISDIR(st.st_mode);
+            args.roomCount = dir ? 0 : atoi(arg2);
+            if(games < 1 || (!dir && args.roomCount < 2)) printf("Bad game count or map source\n");
+            else if(dir && !MapFromDirTree(arg2,&args.graph,&args.roomCount)) printf("Bad directory\n");
+            else {
+                if(args.roomCount < 2) printf("Map is too small\n");
+                else {
+                    SelfPlay(dir ? &args.graph : NULL,args.roomCount,games,((uint64_t)rand() << 32) ^ rand(),args.output);
+                    OutFlush(args.output);
+                }
+                if(dir) FreeGraph(&args.graph);
+            }
+        }
+        else if(id == CMD_MULTIPLAYER && arg1) { // multiplayer command
+            int players = arg2 ? atoi(arg2) : (ProcessorCount() > 4 ? ProcessorCount() : 4);
+            double seconds = arg3 ? atof(arg3) : STRESS_SECONDS;
+            if(players < 1 || seconds <= 0) printf("Bad player count or time\n");
+            else if(!ReadGraph(&args,arg1)) printf("Bad map file\n");
+            else {
+                if(!OrganizeItems(&args)) printf("Map is too small\n");
+                else {
+                    StressPlayers(&args,players,seconds,args.output);
+                    OutFlush(args.output);
+                }
+                ReleaseGame(&args);
+            }
+        }
+        else if(id == CMD_CONVERT_SAVE && arg1 && arg2) { // convert-save command
+            int result = ReadLegacyFile(&args,arg1,true);
+            if(result < 0) printf("Bad file\n");
+            else {
+                if(!(result == 1 ? SaveGame(&args,arg2) : SaveGraph(&args.graph,args.roomCount,arg2))) {
+                    printf("Cannot write %s: %s\n",arg2,strerror(errno));
+                }
+                ReleaseGame(&args);
+            }
         }
         else printf("Bad command\n");
     }
+    free(input.buf);
+    free(args.arena);
+    OutFree(&output);
+    if(args.headless && fclose(script)) ERR("fclose");
+    if(args.record && fclose(args.record)) ERR("fclose");
     return EXIT_SUCCESS;
 }